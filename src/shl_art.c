@@ -0,0 +1,944 @@
+/*
+ * SHL - Adaptive Radix Tree
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Adaptive Radix Tree
+ * This implements adaptive radix trees as described by Leis et al. in "The
+ * Adaptive Radix Tree: ARTful Indexing for Main-Memory Databases". The tree is
+ * a pointer to the root node, NULL if empty. Like in shl_trie, pointers to
+ * nodes have the LSB set, pointers to entries have it cleared. Entries are the
+ * user-supplied key-pointers.
+ *
+ * Every node branches on a single key-byte. Depending on the number of
+ * children, a node is one of 4 types:
+ *   NODE4:   up to 4 children, sorted key-array and child-array
+ *   NODE16:  up to 16 children, same layout as NODE4
+ *   NODE48:  up to 48 children, a 256-byte index maps key-bytes to child slots
+ *   NODE256: up to 256 children, child-array directly indexed by key-byte
+ * Nodes grow and shrink between these types as children are added or removed.
+ *
+ * Keys are zero-terminated. We treat the terminating zero as part of the key,
+ * so no key can be a prefix of another key and every key ends in a leaf.
+ *
+ * Each node stores the bytes that all keys below it share (path compression).
+ * Only the first SHL_ART_PREFIX bytes are stored in the node, but the full
+ * length is remembered. Lookups simply skip the remaining bytes and verify the
+ * key once they reach a leaf. Inserts and prefix-searches need the skipped
+ * bytes and read them from an arbitrary leaf below the node.
+ *
+ * Each node stores a pointer to its parent and the key-byte it is linked by.
+ * This allows us to traverse the tree without recursion and without any
+ * additional memory. See shl_trie.c for why we avoid recursion.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "shl_art.h"
+#include "shl_macro.h"
+
+#define SHL_ART_PREFIX 12
+
+enum shl_art_type {
+	SHL_ART_NODE4,
+	SHL_ART_NODE16,
+	SHL_ART_NODE48,
+	SHL_ART_NODE256,
+};
+
+struct shl_art_node {
+	struct shl_art_node *parent;
+	size_t prefix_len;
+	uint16_t num;
+	uint8_t type;
+	uint8_t pkey;
+	uint8_t prefix[SHL_ART_PREFIX];
+};
+
+struct shl_art_node4 {
+	struct shl_art_node n;
+	uint8_t keys[4];
+	void *childs[4];
+};
+
+struct shl_art_node16 {
+	struct shl_art_node n;
+	uint8_t keys[16];
+	void *childs[16];
+};
+
+struct shl_art_node48 {
+	struct shl_art_node n;
+	uint8_t index[256];
+	void *childs[48];
+};
+
+struct shl_art_node256 {
+	struct shl_art_node n;
+	void *childs[256];
+};
+
+/* same as in shl_trie.c; entries are user-allocated key pointers */
+struct shl_art_leaf {
+	uint8_t *key;
+} __attribute__ ((__packed__));
+
+/* posix_memalign requires at least sizeof(void*) alignment */
+#define SHL_ART_ALIGNMENT ((sizeof(void*) > 4) ? sizeof(void*) : 4)
+
+static inline int shl_art_check_alignment(const void *ptr)
+{
+	unsigned long addr;
+
+	addr = (unsigned long)ptr;
+	if (addr & 0x3UL)
+		return -EFAULT;
+
+	return 0;
+}
+
+/* return true if @ptr is a node, otherwise it's a leaf */
+static inline bool shl_art_is_node(void *ptr)
+{
+	return !!((unsigned long)ptr & 0x1UL);
+}
+
+/* casts @ptr to a node; caller must guarantee that @ptr is a node */
+static inline struct shl_art_node *shl_art_get_node(void *ptr)
+{
+	return (struct shl_art_node*)((unsigned long)ptr & ~0x1UL);
+}
+
+/* casts @ptr to a leaf; caller must guarantee that @ptr is a leaf */
+static inline struct shl_art_leaf *shl_art_get_leaf(void *ptr)
+{
+	return ptr;
+}
+
+/* casts @ptr to the entry the user inserted; caller must guarantee that @ptr
+ * is a leaf. Never take the address of the packed leaf->key for this, the
+ * pointer the user passed in is properly aligned already. */
+static inline uint8_t **shl_art_get_entry(void *ptr)
+{
+	return ptr;
+}
+
+/* cast @node into a node pointer for use in tree objects */
+static inline void *shl_art_make_node(struct shl_art_node *node)
+{
+	return (void*)((unsigned long)node | 0x1UL);
+}
+
+/* return key-byte at position @depth; the terminating zero is part of the key */
+static inline uint8_t shl_art_key(const uint8_t *key, size_t keylen,
+				  size_t depth)
+{
+	return (depth < keylen) ? key[depth] : 0;
+}
+
+static int shl_art_alloc_node(struct shl_art_node **out, unsigned int type)
+{
+	static const size_t sizes[] = {
+		[SHL_ART_NODE4] = sizeof(struct shl_art_node4),
+		[SHL_ART_NODE16] = sizeof(struct shl_art_node16),
+		[SHL_ART_NODE48] = sizeof(struct shl_art_node48),
+		[SHL_ART_NODE256] = sizeof(struct shl_art_node256),
+	};
+	void *p;
+
+	if (posix_memalign(&p, SHL_ART_ALIGNMENT, sizes[type]))
+		return -ENOMEM;
+
+	memset(p, 0, sizes[type]);
+	*out = p;
+	(*out)->type = type;
+	return 0;
+}
+
+/* copy the header of @from into @to, except for type and child-count */
+static void shl_art_copy_header(struct shl_art_node *to,
+				struct shl_art_node *from)
+{
+	to->parent = from->parent;
+	to->pkey = from->pkey;
+	to->prefix_len = from->prefix_len;
+	memcpy(to->prefix, from->prefix, sizeof(from->prefix));
+}
+
+/* link @child to @node via key-byte @b if @child is a node */
+static inline void shl_art_reparent(void *child, struct shl_art_node *node,
+				    uint8_t b)
+{
+	struct shl_art_node *c;
+
+	if (shl_art_is_node(child)) {
+		c = shl_art_get_node(child);
+		c->parent = node;
+		c->pkey = b;
+	}
+}
+
+/* return index of @b in the sorted key array @keys, or -1 */
+static inline int shl_art_find16(const uint8_t *keys, unsigned int num,
+				 uint8_t b)
+{
+	unsigned int i;
+#ifdef __SSE2__
+	__m128i cmp;
+	unsigned int mask;
+
+	/* NODE16 keys are compared all at once, NODE4 is not worth it */
+	if (num > 4) {
+		cmp = _mm_cmpeq_epi8(_mm_set1_epi8(b),
+				     _mm_loadu_si128((const __m128i*)keys));
+		mask = _mm_movemask_epi8(cmp) & ((1U << num) - 1);
+		return mask ? __builtin_ctz(mask) : -1;
+	}
+#endif
+
+	for (i = 0; i < num && keys[i] <= b; ++i)
+		if (keys[i] == b)
+			return i;
+
+	return -1;
+}
+
+/* return pointer to the child-slot of @node for key-byte @b, or NULL */
+static void **shl_art_find_child(struct shl_art_node *node, uint8_t b)
+{
+	struct shl_art_node4 *n4;
+	struct shl_art_node16 *n16;
+	struct shl_art_node48 *n48;
+	struct shl_art_node256 *n256;
+	int i;
+
+	switch (node->type) {
+	case SHL_ART_NODE4:
+		n4 = (struct shl_art_node4*)node;
+		i = shl_art_find16(n4->keys, node->num, b);
+		return (i < 0) ? NULL : &n4->childs[i];
+	case SHL_ART_NODE16:
+		n16 = (struct shl_art_node16*)node;
+		i = shl_art_find16(n16->keys, node->num, b);
+		return (i < 0) ? NULL : &n16->childs[i];
+	case SHL_ART_NODE48:
+		n48 = (struct shl_art_node48*)node;
+		i = n48->index[b];
+		return i ? &n48->childs[i - 1] : NULL;
+	case SHL_ART_NODE256:
+		n256 = (struct shl_art_node256*)node;
+		return n256->childs[b] ? &n256->childs[b] : NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the first child of @node with a key-byte equal to or bigger than
+ * @from. The key-byte of the child is returned in @b. NULL is returned if there
+ * is no such child. This is used for in-order traversal.
+ */
+static void *shl_art_next_child(struct shl_art_node *node, unsigned int from,
+				unsigned int *b)
+{
+	struct shl_art_node4 *n4;
+	struct shl_art_node16 *n16;
+	struct shl_art_node48 *n48;
+	struct shl_art_node256 *n256;
+	unsigned int i;
+
+	switch (node->type) {
+	case SHL_ART_NODE4:
+		n4 = (struct shl_art_node4*)node;
+		for (i = 0; i < node->num; ++i) {
+			if (n4->keys[i] >= from) {
+				*b = n4->keys[i];
+				return n4->childs[i];
+			}
+		}
+		break;
+	case SHL_ART_NODE16:
+		n16 = (struct shl_art_node16*)node;
+		for (i = 0; i < node->num; ++i) {
+			if (n16->keys[i] >= from) {
+				*b = n16->keys[i];
+				return n16->childs[i];
+			}
+		}
+		break;
+	case SHL_ART_NODE48:
+		n48 = (struct shl_art_node48*)node;
+		for (i = from; i < 256; ++i) {
+			if (n48->index[i]) {
+				*b = i;
+				return n48->childs[n48->index[i] - 1];
+			}
+		}
+		break;
+	case SHL_ART_NODE256:
+		n256 = (struct shl_art_node256*)node;
+		for (i = from; i < 256; ++i) {
+			if (n256->childs[i]) {
+				*b = i;
+				return n256->childs[i];
+			}
+		}
+		break;
+	}
+
+	return NULL;
+}
+
+/* return an arbitrary leaf below @node; we use the smallest one */
+static struct shl_art_leaf *shl_art_any_leaf(struct shl_art_node *node)
+{
+	unsigned int b;
+	void *iter;
+
+	iter = shl_art_make_node(node);
+	while (shl_art_is_node(iter))
+		iter = shl_art_next_child(shl_art_get_node(iter), 0, &b);
+
+	return shl_art_get_leaf(iter);
+}
+
+/*
+ * Return the number of prefix-bytes of @node that match @key at position
+ * @depth. If the stored prefix is truncated, the remaining bytes are read from
+ * a leaf below @node.
+ */
+static size_t shl_art_match_prefix(struct shl_art_node *node,
+				   const uint8_t *key, size_t keylen,
+				   size_t depth)
+{
+	const uint8_t *lkey;
+	size_t i, max;
+
+	max = shl_min_t(size_t, node->prefix_len, SHL_ART_PREFIX);
+	for (i = 0; i < max; ++i)
+		if (node->prefix[i] != shl_art_key(key, keylen, depth + i))
+			return i;
+
+	if (node->prefix_len > SHL_ART_PREFIX) {
+		lkey = shl_art_any_leaf(node)->key;
+		for ( ; i < node->prefix_len; ++i)
+			if (lkey[depth + i] != shl_art_key(key, keylen,
+							   depth + i))
+				return i;
+	}
+
+	return i;
+}
+
+/* insert @child at key-byte @b into a NODE4 or NODE16 that has room left */
+static void shl_art_add16(uint8_t *keys, void **childs, unsigned int num,
+			  uint8_t b, void *child)
+{
+	unsigned int i;
+
+	for (i = 0; i < num && keys[i] < b; ++i)
+		/* empty */ ;
+
+	memmove(&keys[i + 1], &keys[i], num - i);
+	memmove(&childs[i + 1], &childs[i], (num - i) * sizeof(*childs));
+	keys[i] = b;
+	childs[i] = child;
+}
+
+/*
+ * Add @child to @node with key-byte @b. If @node is full, it is replaced by a
+ * bigger node. @ref is the slot that links @node and is updated in that case.
+ */
+static int shl_art_add_child(struct shl_art_node *node, void **ref,
+			     uint8_t b, void *child)
+{
+	struct shl_art_node4 *n4;
+	struct shl_art_node16 *n16;
+	struct shl_art_node48 *n48;
+	struct shl_art_node256 *n256;
+	struct shl_art_node *new;
+	unsigned int i;
+	int r;
+
+	switch (node->type) {
+	case SHL_ART_NODE4:
+		n4 = (struct shl_art_node4*)node;
+		if (node->num < 4) {
+			shl_art_add16(n4->keys, n4->childs, node->num, b,
+				      child);
+			break;
+		}
+
+		r = shl_art_alloc_node(&new, SHL_ART_NODE16);
+		if (r < 0)
+			return r;
+
+		n16 = (struct shl_art_node16*)new;
+		shl_art_copy_header(new, node);
+		memcpy(n16->keys, n4->keys, sizeof(n4->keys));
+		memcpy(n16->childs, n4->childs, sizeof(n4->childs));
+		new->num = node->num;
+		for (i = 0; i < new->num; ++i)
+			shl_art_reparent(n16->childs[i], new, n16->keys[i]);
+
+		free(node);
+		*ref = shl_art_make_node(new);
+		return shl_art_add_child(new, ref, b, child);
+	case SHL_ART_NODE16:
+		n16 = (struct shl_art_node16*)node;
+		if (node->num < 16) {
+			shl_art_add16(n16->keys, n16->childs, node->num, b,
+				      child);
+			break;
+		}
+
+		r = shl_art_alloc_node(&new, SHL_ART_NODE48);
+		if (r < 0)
+			return r;
+
+		n48 = (struct shl_art_node48*)new;
+		shl_art_copy_header(new, node);
+		memcpy(n48->childs, n16->childs, sizeof(n16->childs));
+		for (i = 0; i < node->num; ++i) {
+			n48->index[n16->keys[i]] = i + 1;
+			shl_art_reparent(n48->childs[i], new, n16->keys[i]);
+		}
+		new->num = node->num;
+
+		free(node);
+		*ref = shl_art_make_node(new);
+		return shl_art_add_child(new, ref, b, child);
+	case SHL_ART_NODE48:
+		n48 = (struct shl_art_node48*)node;
+		if (node->num < 48) {
+			for (i = 0; n48->childs[i]; ++i)
+				/* empty */ ;
+
+			n48->childs[i] = child;
+			n48->index[b] = i + 1;
+			break;
+		}
+
+		r = shl_art_alloc_node(&new, SHL_ART_NODE256);
+		if (r < 0)
+			return r;
+
+		n256 = (struct shl_art_node256*)new;
+		shl_art_copy_header(new, node);
+		for (i = 0; i < 256; ++i) {
+			if (n48->index[i]) {
+				n256->childs[i] = n48->childs[n48->index[i] - 1];
+				shl_art_reparent(n256->childs[i], new, i);
+			}
+		}
+		new->num = node->num;
+
+		free(node);
+		*ref = shl_art_make_node(new);
+		return shl_art_add_child(new, ref, b, child);
+	case SHL_ART_NODE256:
+		n256 = (struct shl_art_node256*)node;
+		n256->childs[b] = child;
+		break;
+	}
+
+	++node->num;
+	shl_art_reparent(child, node, b);
+	return 0;
+}
+
+/* remove key-byte @i from a NODE4 or NODE16 */
+static void shl_art_remove16(uint8_t *keys, void **childs, unsigned int num,
+			     unsigned int i)
+{
+	memmove(&keys[i], &keys[i + 1], num - i - 1);
+	memmove(&childs[i], &childs[i + 1], (num - i - 1) * sizeof(*childs));
+}
+
+/*
+ * A NODE4 with a single child is useless. Replace it by its child and merge
+ * the prefixes if the child is a node.
+ */
+static void shl_art_collapse(struct shl_art_node *node, void **ref)
+{
+	struct shl_art_node4 *n4 = (struct shl_art_node4*)node;
+	struct shl_art_node *c;
+	uint8_t prefix[SHL_ART_PREFIX];
+	size_t l, max;
+
+	if (shl_art_is_node(n4->childs[0])) {
+		c = shl_art_get_node(n4->childs[0]);
+
+		/* new prefix is: node-prefix + key-byte + child-prefix */
+		l = shl_min_t(size_t, node->prefix_len, SHL_ART_PREFIX);
+		memcpy(prefix, node->prefix, l);
+		if (l < SHL_ART_PREFIX)
+			prefix[l++] = n4->keys[0];
+		if (l < SHL_ART_PREFIX) {
+			max = shl_min_t(size_t, c->prefix_len,
+					SHL_ART_PREFIX - l);
+			memcpy(&prefix[l], c->prefix, max);
+			l += max;
+		}
+
+		memcpy(c->prefix, prefix, l);
+		c->prefix_len += node->prefix_len + 1;
+		c->parent = node->parent;
+		c->pkey = node->pkey;
+	}
+
+	*ref = n4->childs[0];
+	free(node);
+}
+
+/*
+ * Remove the child with key-byte @b from @node. If @node gets too small, it is
+ * replaced by a smaller node. @ref is the slot that links @node and is updated
+ * in that case. We use some hysteresis to avoid growing and shrinking nodes
+ * all the time.
+ * Shrinking never allocates, so we cannot fail. If an allocation fails, we
+ * simply keep the bigger node.
+ */
+static void shl_art_remove_child(struct shl_art_node *node, void **ref,
+				 uint8_t b)
+{
+	struct shl_art_node4 *n4;
+	struct shl_art_node16 *n16;
+	struct shl_art_node48 *n48;
+	struct shl_art_node256 *n256;
+	struct shl_art_node *new;
+	unsigned int i, j;
+
+	switch (node->type) {
+	case SHL_ART_NODE4:
+		n4 = (struct shl_art_node4*)node;
+		i = shl_art_find16(n4->keys, node->num, b);
+		shl_art_remove16(n4->keys, n4->childs, node->num, i);
+		if (--node->num == 1)
+			shl_art_collapse(node, ref);
+		break;
+	case SHL_ART_NODE16:
+		n16 = (struct shl_art_node16*)node;
+		i = shl_art_find16(n16->keys, node->num, b);
+		shl_art_remove16(n16->keys, n16->childs, node->num, i);
+		if (--node->num > 3 ||
+		    shl_art_alloc_node(&new, SHL_ART_NODE4) < 0)
+			break;
+
+		n4 = (struct shl_art_node4*)new;
+		shl_art_copy_header(new, node);
+		new->num = node->num;
+		memcpy(n4->keys, n16->keys, new->num);
+		memcpy(n4->childs, n16->childs, new->num * sizeof(void*));
+		for (i = 0; i < new->num; ++i)
+			shl_art_reparent(n4->childs[i], new, n4->keys[i]);
+
+		free(node);
+		*ref = shl_art_make_node(new);
+		break;
+	case SHL_ART_NODE48:
+		n48 = (struct shl_art_node48*)node;
+		n48->childs[n48->index[b] - 1] = NULL;
+		n48->index[b] = 0;
+		if (--node->num > 12 ||
+		    shl_art_alloc_node(&new, SHL_ART_NODE16) < 0)
+			break;
+
+		n16 = (struct shl_art_node16*)new;
+		shl_art_copy_header(new, node);
+		for (i = 0, j = 0; i < 256; ++i) {
+			if (n48->index[i]) {
+				n16->keys[j] = i;
+				n16->childs[j] = n48->childs[n48->index[i] - 1];
+				shl_art_reparent(n16->childs[j], new, i);
+				++j;
+			}
+		}
+		new->num = j;
+
+		free(node);
+		*ref = shl_art_make_node(new);
+		break;
+	case SHL_ART_NODE256:
+		n256 = (struct shl_art_node256*)node;
+		n256->childs[b] = NULL;
+		if (--node->num > 37 ||
+		    shl_art_alloc_node(&new, SHL_ART_NODE48) < 0)
+			break;
+
+		n48 = (struct shl_art_node48*)new;
+		shl_art_copy_header(new, node);
+		for (i = 0, j = 0; i < 256; ++i) {
+			if (n256->childs[i]) {
+				n48->childs[j] = n256->childs[i];
+				n48->index[i] = ++j;
+				shl_art_reparent(n256->childs[i], new, i);
+			}
+		}
+		new->num = j;
+
+		free(node);
+		*ref = shl_art_make_node(new);
+		break;
+	}
+}
+
+bool shl_art_lookup(struct shl_art *art, const uint8_t *key, size_t keylen,
+		    uint8_t ***out)
+{
+	struct shl_art_node *node;
+	struct shl_art_leaf *leaf;
+	size_t i, max, depth;
+	void *iter, **child;
+
+	iter = art->root;
+	depth = 0;
+
+	/* empty trees cannot contain @key */
+	if (!iter)
+		return false;
+
+	while (shl_art_is_node(iter)) {
+		node = shl_art_get_node(iter);
+
+		/* Compare the stored prefix and skip the rest. We verify the
+		 * whole key once we reach a leaf. */
+		if (node->prefix_len) {
+			max = shl_min_t(size_t, node->prefix_len,
+					SHL_ART_PREFIX);
+			for (i = 0; i < max; ++i)
+				if (node->prefix[i] !=
+				    shl_art_key(key, keylen, depth + i))
+					return false;
+
+			depth += node->prefix_len;
+			if (depth > keylen)
+				return false;
+		}
+
+		child = shl_art_find_child(node, shl_art_key(key, keylen,
+							     depth));
+		if (!child)
+			return false;
+
+		iter = *child;
+		++depth;
+	}
+
+	/* Got a leaf, but no clue whether it's correct. Test it! */
+	leaf = shl_art_get_leaf(iter);
+	if (strcmp((const char*)key, (const char*)leaf->key))
+		return false;
+
+	if (out)
+		*out = shl_art_get_entry(iter);
+	return true;
+}
+
+int shl_art_insert(struct shl_art *art, uint8_t **rkey, size_t keylen,
+		   uint8_t ***out)
+{
+	const uint8_t *key = *rkey, *lkey;
+	struct shl_art_node *node, *new, *parent;
+	struct shl_art_leaf *leaf;
+	uint8_t b, pkey;
+	size_t i, p, depth;
+	void **where, **child;
+	int r;
+
+	r = shl_art_check_alignment(rkey);
+	if (r < 0)
+		return r;
+
+	where = &art->root;
+	parent = NULL;
+	pkey = 0;
+	depth = 0;
+
+	/* Empty tree? Insert it as root. */
+	if (!*where) {
+		*where = rkey;
+		goto done;
+	}
+
+	while (shl_art_is_node(*where)) {
+		node = shl_art_get_node(*where);
+
+		p = shl_art_match_prefix(node, key, keylen, depth);
+		if (p < node->prefix_len) {
+			/* The prefix differs at byte @p. Split the prefix by
+			 * inserting a new NODE4 which links @node and our new
+			 * leaf. The new node gets the common part of the
+			 * prefix, @node keeps everything behind the differing
+			 * byte. */
+			r = shl_art_alloc_node(&new, SHL_ART_NODE4);
+			if (r < 0)
+				return r;
+
+			new->parent = node->parent;
+			new->pkey = node->pkey;
+			new->prefix_len = p;
+			for (i = 0; i < p && i < SHL_ART_PREFIX; ++i)
+				new->prefix[i] = key[depth + i];
+
+			if (node->prefix_len <= SHL_ART_PREFIX) {
+				b = node->prefix[p];
+				node->prefix_len -= p + 1;
+				memmove(node->prefix, &node->prefix[p + 1],
+					node->prefix_len);
+			} else {
+				lkey = shl_art_any_leaf(node)->key;
+				b = lkey[depth + p];
+				node->prefix_len -= p + 1;
+				memcpy(node->prefix, &lkey[depth + p + 1],
+				       shl_min_t(size_t, node->prefix_len,
+						 SHL_ART_PREFIX));
+			}
+
+			shl_art_add_child(new, NULL, b, *where);
+			shl_art_add_child(new, NULL,
+					  shl_art_key(key, keylen, depth + p),
+					  rkey);
+			*where = shl_art_make_node(new);
+			goto done;
+		}
+
+		depth += node->prefix_len;
+		b = shl_art_key(key, keylen, depth);
+
+		child = shl_art_find_child(node, b);
+		if (!child) {
+			r = shl_art_add_child(node, where, b, rkey);
+			if (r < 0)
+				return r;
+
+			goto done;
+		}
+
+		parent = node;
+		pkey = b;
+		where = child;
+		++depth;
+	}
+
+	/* We reached a leaf. Prefixes were compared in full on the way down,
+	 * so the first @depth bytes are equal. Find the first byte where it
+	 * differs from @key. Both keys are zero-terminated, so if they're
+	 * equal including the terminating zero, it's a duplicate. */
+	leaf = shl_art_get_leaf(*where);
+	for (i = depth; i <= keylen; ++i)
+		if (leaf->key[i] != shl_art_key(key, keylen, i))
+			break;
+
+	if (i > keylen) {
+		if (out)
+			*out = shl_art_get_entry(*where);
+		return -EALREADY;
+	}
+
+	/* replace the leaf by a NODE4 that links both leaves */
+	r = shl_art_alloc_node(&new, SHL_ART_NODE4);
+	if (r < 0)
+		return r;
+
+	new->parent = parent;
+	new->pkey = pkey;
+	new->prefix_len = i - depth;
+	memcpy(new->prefix, &key[depth],
+	       shl_min_t(size_t, new->prefix_len, SHL_ART_PREFIX));
+
+	shl_art_add_child(new, NULL, leaf->key[i], *where);
+	shl_art_add_child(new, NULL, shl_art_key(key, keylen, i), rkey);
+	*where = shl_art_make_node(new);
+
+done:
+	if (out)
+		*out = rkey;
+	return 0;
+}
+
+bool shl_art_remove(struct shl_art *art, const uint8_t *key, size_t keylen,
+		    uint8_t ***out)
+{
+	struct shl_art_node *node;
+	struct shl_art_leaf *leaf;
+	size_t i, max, depth;
+	uint8_t **entry;
+	uint8_t b;
+	void **where, **parent, **child;
+
+	/* empty trees cannot contain @key */
+	if (!art->root)
+		return false;
+
+	parent = NULL;
+	where = &art->root;
+	depth = 0;
+	b = 0;
+
+	while (shl_art_is_node(*where)) {
+		node = shl_art_get_node(*where);
+
+		if (node->prefix_len) {
+			max = shl_min_t(size_t, node->prefix_len,
+					SHL_ART_PREFIX);
+			for (i = 0; i < max; ++i)
+				if (node->prefix[i] !=
+				    shl_art_key(key, keylen, depth + i))
+					return false;
+
+			depth += node->prefix_len;
+			if (depth > keylen)
+				return false;
+		}
+
+		b = shl_art_key(key, keylen, depth);
+		child = shl_art_find_child(node, b);
+		if (!child)
+			return false;
+
+		parent = where;
+		where = child;
+		++depth;
+	}
+
+	/* Got a leaf, but no clue whether it's correct. Test it! */
+	leaf = shl_art_get_leaf(*where);
+	if (strcmp((const char*)key, (const char*)leaf->key))
+		return false;
+
+	entry = shl_art_get_entry(*where);
+
+	/* unlink leaf from tree */
+	if (!parent)
+		art->root = NULL;
+	else
+		shl_art_remove_child(shl_art_get_node(*parent), parent, b);
+
+	if (out)
+		*out = entry;
+	return true;
+}
+
+/*
+ * Traverse the sub-tree @sub in lexicographic order and call @do_cb on every
+ * leaf. If @free_nodes is true, each node is freed after it was traversed.
+ * We use the parent-pointers and the key-byte of each node to get back to the
+ * parent and continue with the next child. This requires no additional memory
+ * and is safe against deep trees.
+ */
+static void shl_art_traverse(void *sub,
+			     void (*do_cb) (uint8_t **key, void *ctx),
+			     void *ctx, bool free_nodes)
+{
+	struct shl_art_node *node, *top, *parent;
+	unsigned int from, b;
+	void *iter;
+
+	if (!sub)
+		return;
+
+	if (!shl_art_is_node(sub)) {
+		if (do_cb)
+			do_cb(shl_art_get_entry(sub), ctx);
+		return;
+	}
+
+	top = shl_art_get_node(sub);
+	node = top;
+	from = 0;
+
+	while (true) {
+		iter = shl_art_next_child(node, from, &b);
+		if (iter) {
+			if (shl_art_is_node(iter)) {
+				node = shl_art_get_node(iter);
+				from = 0;
+			} else {
+				if (do_cb)
+					do_cb(shl_art_get_entry(iter), ctx);
+				from = b + 1;
+			}
+			continue;
+		}
+
+		/* all children of @node were visited, go back to the parent */
+		parent = node->parent;
+		from = node->pkey + 1;
+
+		if (free_nodes)
+			free(node);
+		if (node == top)
+			break;
+
+		node = parent;
+	}
+}
+
+void shl_art_clear(struct shl_art *art,
+		   void (*free_cb) (uint8_t **key, void *ctx),
+		   void *ctx)
+{
+	shl_art_traverse(art->root, free_cb, ctx, true);
+	art->root = NULL;
+}
+
+void shl_art_visit(struct shl_art *art, const uint8_t *prefix, size_t plen,
+		   void (*do_cb) (uint8_t **key, void *ctx),
+		   void *ctx)
+{
+	struct shl_art_node *node;
+	struct shl_art_leaf *leaf;
+	size_t i, depth;
+	void *iter, **child;
+
+	/* empty trees are boring */
+	if (!art->root)
+		return;
+
+	/* if no prefix given, traverse the whole tree */
+	if (!prefix || !plen)
+		return shl_art_traverse(art->root, do_cb, ctx, false);
+
+	/* Follow @prefix until it is exhausted. The sub-tree we end up in
+	 * contains all keys with the given prefix, but we might have skipped
+	 * bytes of compressed prefixes. Hence, verify the prefix against an
+	 * arbitrary leaf of the sub-tree before traversing it. */
+	iter = art->root;
+	depth = 0;
+	while (shl_art_is_node(iter)) {
+		node = shl_art_get_node(iter);
+
+		if (depth + node->prefix_len >= plen)
+			break;
+
+		depth += node->prefix_len;
+		child = shl_art_find_child(node, prefix[depth]);
+		if (!child)
+			return;
+
+		iter = *child;
+		if (++depth >= plen)
+			break;
+	}
+
+	if (shl_art_is_node(iter))
+		leaf = shl_art_any_leaf(shl_art_get_node(iter));
+	else
+		leaf = shl_art_get_leaf(iter);
+
+	/* if the prefix doesn't match, we have no matching entries */
+	for (i = 0; i < plen; ++i)
+		if (prefix[i] != leaf->key[i])
+			return;
+
+	return shl_art_traverse(iter, do_cb, ctx, false);
+}
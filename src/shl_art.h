@@ -0,0 +1,177 @@
+/*
+ * SHL - Adaptive Radix Tree
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Adaptive Radix Tree
+ * This is an alternative to the crit-bit trie (shl_trie) with the same API. A
+ * crit-bit trie branches on single bits, so a lookup walks one node per
+ * differing bit. An adaptive radix tree (ART) instead branches on whole bytes
+ * and adapts the node size to the number of children (4, 16, 48 or 256-way
+ * nodes). Common key-prefixes are compressed into the nodes. This results in
+ * much shallower trees and less cache-misses for large tries.
+ *
+ * Like shl_trie, keys are not copied into the tree. Keys must be
+ * zero-terminated and the storage of the key-pointer is used as entry.
+ */
+
+#ifndef SHL_ART_H
+#define SHL_ART_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* a small type-safe helper to get a surrounding object */
+
+#define shl_art_entry(pointer, type, member) ({ \
+		const typeof(((type*)0)->member) *__ptr = (pointer); \
+		(type*)(((char*)__ptr) - offsetof(type, member)); \
+	})
+
+/*
+ * Tree Head
+ * Embed this structure in your objects where you want the tree head to reside.
+ * You can either initialize the memory to 0 or use shl_art_zero() to do that.
+ */
+struct shl_art {
+	void *root;
+};
+
+/*
+ * Zero out a Tree
+ * You must clear a tree head to zero before using it. Either do that via
+ * memset(.., 0, ..) or use this helper.
+ * You must not call this helper on an non-empty initialized tree. If the tree
+ * is empty, it is safe to call this.
+ *
+ * To destroy a tree, simply remove all elements from it. In this case, the
+ * tree has no more allocated memory and can simply be removed. If you cannot
+ * guarantee that all elements are removed, use shl_art_clear().
+ */
+static inline void shl_art_zero(struct shl_art *art)
+{
+	art->root = NULL;
+}
+
+/*
+ * Clear a Tree
+ * This traverses the given tree and calls @free_cb() on each entry in
+ * lexicographic order. You can pass a context @ctx which is passed through
+ * untouched to the callbacks.
+ *
+ * You must not perform any tree operation from within the callback!
+ *
+ * Once you cleared the tree, there is no more memory allocated. You're free to
+ * destroy it or start inserting elements again.
+ */
+void shl_art_clear(struct shl_art *art,
+		   void (*free_cb) (uint8_t **e, void *ctx),
+		   void *ctx);
+
+/* Same as shl_art_clear() but with string-keys. */
+static inline void shl_art_clear_str(struct shl_art *art,
+				     void (*free_cb) (char **entry,
+				                      void *ctx),
+				     void *ctx)
+{
+	return shl_art_clear(art,
+			     (void(*)(uint8_t **, void*))free_cb,
+			     ctx);
+}
+
+/*
+ * Lookup an element
+ * This searches the tree for a string @key. @keylen is the string-length of
+ * @key. Note that @key must be zero-terminated.
+ *
+ * Returns false if the element couldn't be found. Otherwise, true is returned
+ * and a pointer to the entry is returned in @out. See shl_trie_lookup() for a
+ * description of entries.
+ */
+bool shl_art_lookup(struct shl_art *art, const uint8_t *key, size_t keylen,
+		    uint8_t ***out);
+
+/* Same as shl_art_lookup() but simplified for string operations. */
+static inline bool shl_art_lookup_str(struct shl_art *art, const char *str,
+				      char ***out)
+{
+	return shl_art_lookup(art, (const uint8_t*)str, strlen(str),
+			      (uint8_t***)out);
+}
+
+/*
+ * Insert an element
+ * Insert a new element into the tree. The key is a zero-terminated string
+ * @key (with string-length @keylen).
+ * This function fails with -EALREADY if the key is already present and returns
+ * the found duplicate in @out.
+ * Returns 0 on success, -ENOMEM if out of memory.
+ *
+ * Note that the storage of @key must be valid as long as the element is stored
+ * in the tree. The key is _not_ copied into the tree. In fact, even the storage
+ * of the pointer to @key must be valid!
+ */
+int shl_art_insert(struct shl_art *art, uint8_t **key, size_t keylen,
+		   uint8_t ***out);
+
+/* Same as shl_art_insert() but simplified for strings. */
+static inline int shl_art_insert_str(struct shl_art *art, char **str,
+				     char ***out)
+{
+	return shl_art_insert(art, (uint8_t**)str, strlen(*str),
+			      (uint8_t***)out);
+}
+
+/*
+ * Remove an element
+ * Search the tree for @key (with key-length @keylen). If not found, return
+ * false. Otherwise, return true and store the entry in @out. The entry is
+ * unlinked from the tree.
+ * You can set @out to NULL to prevent the entry from being returned.
+ */
+bool shl_art_remove(struct shl_art *art, const uint8_t *key, size_t keylen,
+		    uint8_t ***out);
+
+/* Same as shl_art_remove() but with "const char" as type. */
+static inline bool shl_art_remove_str(struct shl_art *art, const char *str,
+				      char ***out)
+{
+	return shl_art_remove(art, (const uint8_t*)str, strlen(str),
+			      (uint8_t***)out);
+}
+
+/*
+ * Visit matching elements
+ * This traverses the tree and visits elements with the given prefix @prefix
+ * (with string-length @plen) in lexicographic order. If @prefix is NULL, @plen
+ * is ignored and the whole tree is visited.
+ * For each matching element, the callback do_cb() (if non-NULL) is called. You
+ * can pass a context @ctx to the callbacks. It is left untouched by this code.
+ *
+ * You must not call any tree function from within the callbacks. Unlike
+ * shl_trie_visit(), the tree is not modified during traversal.
+ */
+void shl_art_visit(struct shl_art *art, const uint8_t *prefix, size_t plen,
+		   void (*do_cb) (uint8_t **entry, void *ctx),
+		   void *ctx);
+
+/* Same as shl_art_visit() but with "const char" as key type. */
+static inline void shl_art_visit_str(struct shl_art *art,
+				     const char *prefix,
+				     void (*do_cb) (char **entry, void *ctx),
+				     void *ctx)
+{
+	return shl_art_visit(art, (const uint8_t*)prefix,
+			     prefix ? strlen(prefix) : 0,
+			     (void(*)(uint8_t**, void*))do_cb,
+			     ctx);
+}
+
+#endif  /* SHL_ART_H */
@@ -16,28 +16,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
-#include <sys/timerfd.h>
 #include <unistd.h>
+#include "shl_timer.h"
 
 struct shl_edbus;
 struct shl_edbus_source;
 
-struct shl_edbus {
-	DBusConnection *dbus;
-	struct shl_edbus_source *free_list;
-	int efd;
-	unsigned int owns_bus : 1;
-};
-
 struct shl_edbus_source {
 	struct shl_edbus_source *next;
 	void *object;
 	int fd;
-	unsigned int timeout : 1;
+	struct shl_timer timer;
+	unsigned int wheel : 1;
 	unsigned int dupped : 1;
 	unsigned int dead : 1;
 };
 
+struct shl_edbus {
+	DBusConnection *dbus;
+	struct shl_edbus_source *free_list;
+	struct shl_timer_wheel *wheel;
+	struct shl_edbus_source wheel_source;
+	int efd;
+	unsigned int owns_bus : 1;
+};
+
 static void shl_edbus_kill_source(struct shl_edbus *ctx,
 				  struct shl_edbus_source *s)
 {
@@ -83,25 +86,6 @@ static void shl_edbus_rewatch(int efd, int fd, unsigned int events,
 	epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
 }
 
-static void shl_edbus_store_timespec(struct timespec *ts, int64_t usec)
-{
-	ts->tv_sec = (time_t) (usec / 1000000ULL);
-	ts->tv_nsec = (long int) ((usec % 1000000ULL) * 1000ULL);
-}
-
-static int shl_edbus_arm_timerfd(int fd, int64_t usecs)
-{
-	struct itimerspec its;
-	int r;
-
-	memset(&its, 0, sizeof(its));
-	shl_edbus_store_timespec(&its.it_value, usecs);
-	its.it_interval = its.it_value;
-
-	r = timerfd_settime(fd, 0, &its, NULL);
-	return (r < 0) ? -errno : 0;
-}
-
 static uint32_t shl_edbus_get_watch_events(struct shl_edbus_source *s)
 {
 	unsigned int flags;
@@ -203,16 +187,35 @@ static void shl_edbus_toggle_watch(DBusWatch *watch, void *data)
 	shl_edbus_rewatch(ctx->efd, s->fd, events, s);
 }
 
-static int shl_edbus_adjust_timeout(struct shl_edbus_source *s)
+static int shl_edbus_adjust_timeout(struct shl_edbus *ctx,
+				    struct shl_edbus_source *s)
 {
-	int64_t t = 0;
+	uint64_t t;
 
-	if (dbus_timeout_get_enabled(s->object)) {
-		t = dbus_timeout_get_interval(s->object);
-		t *= 1000ULL; /* msec to usec */
+	if (!dbus_timeout_get_enabled(s->object)) {
+		shl_timer_cancel(ctx->wheel, &s->timer);
+		return 0;
 	}
 
-	return shl_edbus_arm_timerfd(s->fd, t);
+	t = dbus_timeout_get_interval(s->object);
+	t *= 1000ULL; /* msec to usec */
+
+	return shl_timer_arm_rel(ctx->wheel, &s->timer, t);
+}
+
+static void shl_edbus_timeout_cb(struct shl_timer *timer, void *data)
+{
+	struct shl_edbus *ctx = data;
+	struct shl_edbus_source *s;
+
+	s = shl_timer_entry(timer, struct shl_edbus_source, timer);
+	if (s->dead || !dbus_timeout_get_enabled(s->object))
+		return;
+
+	/* dbus timeouts are periodic; re-arm before the handler can
+	 * toggle or remove the timeout */
+	shl_edbus_adjust_timeout(ctx, s);
+	dbus_timeout_handle(s->object);
 }
 
 static dbus_bool_t shl_edbus_add_timeout(DBusTimeout *timeout, void *data)
@@ -226,28 +229,18 @@ static dbus_bool_t shl_edbus_add_timeout(DBusTimeout *timeout, void *data)
 		return FALSE;
 
 	s->object = timeout;
-	s->timeout = 1;
-	s->dupped = 1;
-	s->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (s->fd < 0)
-		goto err_free;
+	s->fd = -1;
+	shl_timer_init(&s->timer, shl_edbus_timeout_cb, ctx);
 
-	r = shl_edbus_adjust_timeout(s);
-	if (r < 0)
-		goto err_close;
-
-	r = shl_edbus_watch(ctx->efd, s->fd, EPOLLIN, s);
-	if (r < 0)
-		goto err_close;
+	r = shl_edbus_adjust_timeout(ctx, s);
+	if (r < 0) {
+		shl_timer_cancel(ctx->wheel, &s->timer);
+		free(s);
+		return FALSE;
+	}
 
 	dbus_timeout_set_data(timeout, s, NULL);
 	return TRUE;
-
-err_close:
-	close(s->fd);
-err_free:
-	free(s);
-	return FALSE;
 }
 
 static void shl_edbus_remove_timeout(DBusTimeout *timeout, void *data)
@@ -259,20 +252,20 @@ static void shl_edbus_remove_timeout(DBusTimeout *timeout, void *data)
 	if (!s)
 		return;
 
-	shl_edbus_unwatch(ctx->efd, s->fd);
-	close(s->fd);
+	shl_timer_cancel(ctx->wheel, &s->timer);
 	shl_edbus_kill_source(ctx, s);
 }
 
 static void shl_edbus_toggle_timeout(DBusTimeout *timeout, void *data)
 {
+	struct shl_edbus *ctx = data;
 	struct shl_edbus_source *s;
 
 	s = dbus_timeout_get_data(timeout);
 	if (!s)
 		return;
 
-	shl_edbus_adjust_timeout(s);
+	shl_edbus_adjust_timeout(ctx, s);
 }
 
 int shl_edbus_new(DBusConnection *c, struct shl_edbus **out)
@@ -292,6 +285,16 @@ int shl_edbus_new(DBusConnection *c, struct shl_edbus **out)
 		goto error;
 	}
 
+	/* all dbus timeouts share a single timer-wheel and its timerfd */
+	r = shl_timer_wheel_new(&ctx->wheel, 0);
+	if (r < 0)
+		goto error;
+
+	ctx->wheel_source.wheel = 1;
+	r = shl_edbus_watch(ctx->efd, r, EPOLLIN, &ctx->wheel_source);
+	if (r < 0)
+		goto error;
+
 	b = dbus_connection_set_watch_functions(ctx->dbus,
 						shl_edbus_add_watch,
 						shl_edbus_remove_watch,
@@ -323,6 +326,7 @@ error:
 					      NULL, NULL);
 	dbus_connection_set_watch_functions(ctx->dbus, NULL, NULL, NULL,
 					    NULL, NULL);
+	shl_timer_wheel_free(ctx->wheel);
 	if (ctx->efd >= 0)
 		close(ctx->efd);
 	free(ctx);
@@ -386,16 +390,22 @@ void shl_edbus_free(struct shl_edbus *ctx)
 		free(s);
 	}
 
+	shl_timer_wheel_free(ctx->wheel);
 	close(ctx->efd);
 	free(ctx);
 }
 
+struct shl_timer_wheel *shl_edbus_get_wheel(struct shl_edbus *ctx)
+{
+	return ctx->wheel;
+}
+
 int shl_edbus_dispatch(struct shl_edbus *ctx, int timeout_ms)
 {
 	struct epoll_event events[64], *e;
 	struct shl_edbus_source *s;
 	unsigned int flags, max;
-	int r, n, i;
+	int r, n, i, err = 0;
 
 	max = sizeof(events) / sizeof(*events);
 	r = epoll_wait(ctx->efd, events, max, timeout_ms);
@@ -413,9 +423,12 @@ int shl_edbus_dispatch(struct shl_edbus *ctx, int timeout_ms)
 		if (s->dead)
 			continue;
 
-		if (s->timeout) {
-			if (dbus_timeout_get_enabled(s->object))
-				dbus_timeout_handle(s->object);
+		if (s->wheel) {
+			/* a failed read or re-arm stalls the wheel, so report
+			 * it; we still handle the other events first */
+			r = shl_timer_wheel_dispatch(ctx->wheel);
+			if (r < 0)
+				err = r;
 		} else {
 			if (dbus_watch_get_enabled(s->object)) {
 				flags = shl_edbus_events_to_flags(e->events);
@@ -430,6 +443,9 @@ int shl_edbus_dispatch(struct shl_edbus *ctx, int timeout_ms)
 		free(s);
 	}
 
+	if (err < 0)
+		return err;
+
 	for (;;) {
 		r = dbus_connection_dispatch(ctx->dbus);
 		if (r == DBUS_DISPATCH_COMPLETE)
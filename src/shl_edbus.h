@@ -22,6 +22,7 @@
 
 /* opaque edbus context object */
 struct shl_edbus;
+struct shl_timer_wheel;
 
 /*
  * Create a new dbus-context object for the given dbus-connection @c. The
@@ -44,12 +45,22 @@ int shl_edbus_new_bus(DBusBusType bus, DBusConnection **cout,
  * left to the caller. */
 void shl_edbus_free(struct shl_edbus *ctx);
 
+/*
+ * Return the timer-wheel of @ctx. All dbus timeouts are multiplexed onto this
+ * wheel and it is dispatched by shl_edbus_dispatch(). You can arm your own
+ * timers on it to share the single timerfd with the dbus connection. See
+ * shl_timer.h for details.
+ */
+struct shl_timer_wheel *shl_edbus_get_wheel(struct shl_edbus *ctx);
+
 /*
  * Dispatch events on @ctx. Call this whenever the edbus file-descriptor is
  * readable. @timeout_ms is passed untouched to epoll_wait() so you can
  * control whether this is non-blocking or blocking.
  * This dispatches all outstanding events on the dbus connection. You're free
  * to perform any dbus actions you want from within your dbus callbacks.
+ * Returns 0 on success or a negative error code, including failures to read
+ * or re-arm the timerfd of the timer-wheel.
  */
 int shl_edbus_dispatch(struct shl_edbus *ctx, int timeout_ms);
 
@@ -0,0 +1,135 @@
+/*
+ * SHL - Heap
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Heap
+ * Node i has its children at i * SHL_HEAP_ARITY + 1 up to
+ * i * SHL_HEAP_ARITY + SHL_HEAP_ARITY, and its parent at
+ * (i - 1) / SHL_HEAP_ARITY. Sifting moves the hole instead of swapping, so
+ * each level costs one pointer store and one index update.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "shl_heap.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+static inline void shl_heap_set(struct shl_heap *heap, size_t i,
+				struct shl_heap_node *node)
+{
+	heap->nodes[i] = node;
+	node->index = i + 1;
+}
+
+static void shl_heap_sift_up(struct shl_heap *heap, size_t i)
+{
+	struct shl_heap_node *node = heap->nodes[i];
+	size_t p;
+
+	while (i > 0) {
+		p = (i - 1) / SHL_HEAP_ARITY;
+		if (heap->cmp(node, heap->nodes[p]) >= 0)
+			break;
+
+		shl_heap_set(heap, i, heap->nodes[p]);
+		i = p;
+	}
+
+	shl_heap_set(heap, i, node);
+}
+
+static void shl_heap_sift_down(struct shl_heap *heap, size_t i)
+{
+	struct shl_heap_node *node = heap->nodes[i];
+	size_t c, j, end, best;
+
+	for (;;) {
+		c = i * SHL_HEAP_ARITY + 1;
+		if (c >= heap->n)
+			break;
+
+		end = shl_min(c + SHL_HEAP_ARITY, heap->n);
+		best = c;
+		for (j = c + 1; j < end; ++j)
+			if (heap->cmp(heap->nodes[j], heap->nodes[best]) < 0)
+				best = j;
+
+		if (heap->cmp(heap->nodes[best], node) >= 0)
+			break;
+
+		shl_heap_set(heap, i, heap->nodes[best]);
+		i = best;
+	}
+
+	shl_heap_set(heap, i, node);
+}
+
+static void shl_heap_fix(struct shl_heap *heap, size_t i)
+{
+	if (i > 0 && heap->cmp(heap->nodes[i],
+			       heap->nodes[(i - 1) / SHL_HEAP_ARITY]) < 0)
+		shl_heap_sift_up(heap, i);
+	else
+		shl_heap_sift_down(heap, i);
+}
+
+void shl_heap_clear(struct shl_heap *heap)
+{
+	size_t i;
+
+	for (i = 0; i < heap->n; ++i)
+		heap->nodes[i]->index = 0;
+
+	free(heap->nodes);
+	heap->nodes = NULL;
+	heap->n = 0;
+	heap->size = 0;
+}
+
+int shl_heap_insert(struct shl_heap *heap, struct shl_heap_node *node)
+{
+	if (!SHL_GREEDY_REALLOC_T(heap->nodes, heap->size, heap->n + 1))
+		return -ENOMEM;
+
+	heap->nodes[heap->n++] = node;
+	shl_heap_sift_up(heap, heap->n - 1);
+	return 0;
+}
+
+void shl_heap_remove(struct shl_heap *heap, struct shl_heap_node *node)
+{
+	struct shl_heap_node *last;
+	size_t i;
+
+	i = node->index - 1;
+	node->index = 0;
+
+	last = heap->nodes[--heap->n];
+	if (i != heap->n) {
+		shl_heap_set(heap, i, last);
+		shl_heap_fix(heap, i);
+	}
+}
+
+struct shl_heap_node *shl_heap_pop(struct shl_heap *heap)
+{
+	struct shl_heap_node *top;
+
+	top = shl_heap_peek(heap);
+	if (top)
+		shl_heap_remove(heap, top);
+
+	return top;
+}
+
+void shl_heap_update(struct shl_heap *heap, struct shl_heap_node *node)
+{
+	shl_heap_fix(heap, node->index - 1);
+}
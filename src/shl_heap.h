@@ -0,0 +1,105 @@
+/*
+ * SHL - Heap
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Heap
+ * An intrusive d-ary min-heap to be used as priority queue. Objects embed a
+ * "struct shl_heap_node" and you get the object back via shl_heap_entry(). The
+ * heap itself is an array of node-pointers, and each node stores its position
+ * in that array. Hence, arbitrary nodes can be removed or re-positioned after
+ * their key changed in O(log n), without searching for them first.
+ *
+ * Nodes have SHL_HEAP_ARITY children instead of 2. This makes the heap
+ * shallower and keeps all children of a node in the same cache-line, which
+ * outweighs the additional comparisons on each level.
+ *
+ * The heap is not stable; nodes that compare equal are returned in arbitrary
+ * order. Zeroed nodes are treated as unlinked.
+ */
+
+#ifndef SHL_HEAP_H
+#define SHL_HEAP_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "shl_macro.h"
+
+#define SHL_HEAP_ARITY 4
+
+struct shl_heap_node {
+	size_t index;		/* position in heap plus 1, or 0 if unlinked */
+};
+
+/* compare two nodes, returns <0, 0 or >0 like strcmp(); smallest is on top */
+typedef int (*shl_heap_cmp_t) (const struct shl_heap_node *a,
+			       const struct shl_heap_node *b);
+
+struct shl_heap {
+	struct shl_heap_node **nodes;
+	size_t n;
+	size_t size;
+	shl_heap_cmp_t cmp;
+};
+
+#define SHL_HEAP_INIT(_cmp) { .cmp = (_cmp), }
+
+#define shl_heap_entry(ptr, type, member) \
+	shl_container_of((ptr), type, member)
+
+static inline void shl_heap_init(struct shl_heap *heap, shl_heap_cmp_t cmp)
+{
+	heap->nodes = NULL;
+	heap->n = 0;
+	heap->size = 0;
+	heap->cmp = cmp;
+}
+
+static inline bool shl_heap_empty(struct shl_heap *heap)
+{
+	return !heap->n;
+}
+
+static inline size_t shl_heap_size(struct shl_heap *heap)
+{
+	return heap->n;
+}
+
+static inline bool shl_heap_node_linked(struct shl_heap_node *node)
+{
+	return node->index;
+}
+
+/* return the smallest node without removing it, or NULL if empty */
+static inline struct shl_heap_node *shl_heap_peek(struct shl_heap *heap)
+{
+	return heap->n ? heap->nodes[0] : NULL;
+}
+
+#define shl_heap_peek_entry(heap, type, member) \
+	shl_heap_entry(shl_heap_peek(heap), type, member)
+
+/* unlink all nodes and free the heap array */
+void shl_heap_clear(struct shl_heap *heap);
+
+/* insert @node; returns -ENOMEM if the heap array cannot grow */
+int shl_heap_insert(struct shl_heap *heap, struct shl_heap_node *node);
+
+/* unlink @node, which must be linked in @heap */
+void shl_heap_remove(struct shl_heap *heap, struct shl_heap_node *node);
+
+/* remove and return the smallest node, or NULL if empty */
+struct shl_heap_node *shl_heap_pop(struct shl_heap *heap);
+
+/*
+ * Restore heap order after the key of @node changed. This works for both,
+ * decreasing and increasing keys. @node must be linked in @heap.
+ */
+void shl_heap_update(struct shl_heap *heap, struct shl_heap_node *node);
+
+#endif /* SHL_HEAP_H */
@@ -109,20 +109,43 @@ static const char *LLOG_SUBSYSTEM __attribute__((__unused__));
 
 #define LLOG_DEFAULT __FILE__, __LINE__, __func__, LLOG_SUBSYSTEM
 
+/*
+ * Filters
+ * The helpers check inline whether a logger is set before evaluating any
+ * argument. Messages with a severity greater than LLOG_SEV_FLOOR are removed
+ * at compile time; define it before including this header to drop, for
+ * instance, all debug call-sites from a release build. Severity thresholds are
+ * up to the log-function, log_llog() applies the shl_log filters.
+ */
+
+#ifndef LLOG_SEV_FLOOR
+#define LLOG_SEV_FLOOR LLOG_DEBUG
+#endif
+
+/* avoid -Waddress warnings if a function is passed directly */
+static inline bool llog__set(llog_submit_t llog)
+{
+	return llog;
+}
+
+#define llog__enabled(llog, sev) \
+	(((sev) >= LLOG_SEV_NUM || (sev) <= LLOG_SEV_FLOOR) && llog__set(llog))
+
 #define llog_printf(obj, sev, format, ...) \
-	llog_format((obj)->llog, \
-		    (obj)->llog_data, \
-		    LLOG_DEFAULT, \
-		    (sev), \
-		    (format), \
-		    ##__VA_ARGS__)
+	llog_dprintf((obj)->llog, \
+		     (obj)->llog_data, \
+		     (sev), \
+		     (format), \
+		     ##__VA_ARGS__)
 #define llog_dprintf(obj, data, sev, format, ...) \
-	llog_format((obj), \
-		    (data), \
-		    LLOG_DEFAULT, \
-		    (sev), \
-		    (format), \
-		    ##__VA_ARGS__)
+	(llog__enabled((obj), (sev)) ? \
+		llog_format((obj), \
+			    (data), \
+			    LLOG_DEFAULT, \
+			    (sev), \
+			    (format), \
+			    ##__VA_ARGS__) : \
+		(void)0)
 
 static inline __attribute__((format(printf, 4, 5)))
 void llog_dummyf(llog_submit_t llog, void *data, unsigned int sev,
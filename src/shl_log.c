@@ -5,62 +5,318 @@
  * Dedicated to the Public Domain
  */
 
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "shl_log.h"
+#include "shl_macro.h"
+#include "shl_mpsc.h"
+#include "shl_ring.h"
+#include "shl_util.h"
 
 /*
- * Locking
- * Dummies to implement locking. If we ever want lock-protected logging, these
- * need to be provided by the user.
+ * Output
+ * Each message is formatted into a per-thread buffer and then emitted as a
+ * whole. In synchronous mode, this is a single write() to stderr, which is
+ * atomic with respect to other threads for all sane message sizes. Hence, we
+ * need no locking at all.
+ * In asynchronous mode (see log_async_start()) the buffer is copied into a
+ * heap-allocated record and pushed onto a lock-free queue. A background thread
+ * collects records and writes them in batches via writev(). Callers never wait
+ * for the output fd. Only if the queue is full and LOG_ASYNC_BLOCK was
+ * requested, they sleep until the writer made room.
  */
 
-static inline void log_lock()
+#define LOG_LINE_MAX 4096
+#define LOG_ASYNC_BATCH 64
+
+static __thread char log__buf[LOG_LINE_MAX];
+
+struct log_rec {
+	struct shl_mpsc_node node;
+	size_t len;
+	char data[];
+};
+
+static struct {
+	struct shl_mpsc queue;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	size_t max;
+	unsigned int policy;
+	bool running;
+	bool stop;
+	size_t queued;
+	size_t waiters;
+	unsigned long dropped;
+
+	/* writer-thread only */
+	struct log_rec *batch[LOG_ASYNC_BATCH];
+	struct iovec iov[LOG_ASYNC_BATCH];
+	size_t num;
+} log__async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+};
+
+static void log__write(int fd, struct iovec *iov, size_t num)
+{
+	ssize_t l;
+
+	/* errors are silently ignored; there is nobody we could tell */
+	while (num > 0) {
+		l = writev(fd, iov, shl_min(num, (size_t)IOV_MAX));
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				poll(&(struct pollfd){ .fd = fd, .events = POLLOUT },
+				     1, -1);
+				continue;
+			}
+			return;
+		}
+
+		while (num > 0 && (size_t)l >= iov->iov_len) {
+			l -= iov->iov_len;
+			++iov;
+			--num;
+		}
+
+		if (num > 0) {
+			iov->iov_base = (char*)iov->iov_base + l;
+			iov->iov_len -= l;
+		}
+	}
+}
+
+static void log__async_flush(void)
+{
+	size_t i, num = log__async.num;
+
+	if (!num)
+		return;
+
+	log__write(log__async.fd, log__async.iov, num);
+
+	for (i = 0; i < num; ++i)
+		free(log__async.batch[i]);
+	log__async.num = 0;
+
+	/* wake up blocked loggers; see log__async_reserve() for the ordering */
+	__atomic_sub_fetch(&log__async.queued, num, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log__async.waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&log__async.lock);
+		pthread_cond_broadcast(&log__async.cond);
+		pthread_mutex_unlock(&log__async.lock);
+	}
+}
+
+static void log__async_cb(struct shl_mpsc_node *n, void *data)
+{
+	struct log_rec *rec = shl_mpsc_entry(n, struct log_rec, node);
+	size_t i = log__async.num++;
+
+	log__async.batch[i] = rec;
+	log__async.iov[i].iov_base = rec->data;
+	log__async.iov[i].iov_len = rec->len;
+
+	if (log__async.num >= LOG_ASYNC_BATCH)
+		log__async_flush();
+}
+
+static void *log__async_run(void *data)
+{
+	struct pollfd pfd = {
+		.fd = log__async.queue.fd,
+		.events = POLLIN,
+	};
+
+	for (;;) {
+		/* Never give up on errors, loggers with LOG_ASYNC_BLOCK would
+		 * wait for us forever. Instead, check the queue every 10ms
+		 * until poll() works again. */
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			poll(NULL, 0, 10);
+
+		shl_mpsc_dispatch(&log__async.queue, log__async_cb, NULL);
+		log__async_flush();
+
+		/* The dispatch above might have consumed the kick of
+		 * log_async_stop(), so check the flag only afterwards. It is
+		 * set before the kick, hence if we missed it, the kick is still
+		 * pending and wakes up poll(). Drain once more so nothing
+		 * pushed before log_async_stop() is lost. */
+		if (__atomic_load_n(&log__async.stop, __ATOMIC_ACQUIRE)) {
+			shl_mpsc_drain(&log__async.queue, log__async_cb, NULL);
+			log__async_flush();
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Reserve a queue slot. The counter may exceed the limit by the number of
+ * blocked loggers, each of them waits until the writer freed enough records
+ * so its own slot is within the limit again.
+ * A waiter increments log__async.waiters before re-checking the counter, the
+ * writer decrements the counter before checking for waiters. With sequential
+ * consistency at least one side sees the other and the waiter either bails
+ * out or gets the broadcast.
+ */
+static bool log__async_reserve(void)
+{
+	if (__atomic_add_fetch(&log__async.queued, 1, __ATOMIC_SEQ_CST) <=
+	    log__async.max)
+		return true;
+
+	if (log__async.policy != LOG_ASYNC_BLOCK) {
+		__atomic_sub_fetch(&log__async.queued, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&log__async.dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	pthread_mutex_lock(&log__async.lock);
+	__atomic_add_fetch(&log__async.waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&log__async.queued, __ATOMIC_SEQ_CST) >
+	       log__async.max)
+		pthread_cond_wait(&log__async.cond, &log__async.lock);
+	__atomic_sub_fetch(&log__async.waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&log__async.lock);
+
+	return true;
+}
+
+static void log__emit(const char *buf, size_t len)
+{
+	struct log_rec *rec;
+
+	if (!__atomic_load_n(&log__async.running, __ATOMIC_ACQUIRE)) {
+		log__write(STDERR_FILENO,
+			   &(struct iovec){ .iov_base = (void*)buf,
+					    .iov_len = len }, 1);
+		return;
+	}
+
+	if (!log__async_reserve())
+		return;
+
+	rec = malloc(sizeof(*rec) + len);
+	if (!rec) {
+		__atomic_sub_fetch(&log__async.queued, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&log__async.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec->len = len;
+	memcpy(rec->data, buf, len);
+	shl_mpsc_push(&log__async.queue, &rec->node);
+}
+
+int log_async_start(int fd, size_t max_queued, unsigned int policy)
 {
+	int r;
+
+	if (log__async.running)
+		return -EALREADY;
+	if (!max_queued)
+		return -EINVAL;
+
+	shl_mpsc_init(&log__async.queue);
+	r = shl_mpsc_init_fd(&log__async.queue);
+	if (r < 0)
+		return r;
+
+	log__async.fd = fd < 0 ? STDERR_FILENO : fd;
+	log__async.max = max_queued;
+	log__async.policy = policy;
+	log__async.stop = false;
+	log__async.queued = 0;
+	log__async.waiters = 0;
+	log__async.dropped = 0;
+	log__async.num = 0;
+
+	r = pthread_create(&log__async.thread, NULL, log__async_run, NULL);
+	if (r) {
+		shl_mpsc_deinit(&log__async.queue);
+		return -r;
+	}
+
+	__atomic_store_n(&log__async.running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_async_stop(void)
+{
+	uint64_t v = 1;
+	ssize_t l;
+
+	if (!log__async.running)
+		return;
+
+	__atomic_store_n(&log__async.running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&log__async.stop, true, __ATOMIC_RELEASE);
+
+	/* kick the writer, it drains the queue once more and exits */
+	l = write(log__async.queue.fd, &v, sizeof(v));
+	(void)l;
+
+	pthread_join(log__async.thread, NULL);
+	shl_mpsc_deinit(&log__async.queue);
+	log__async.fd = -1;
 }
 
-static inline void log_unlock()
+unsigned long log_async_dropped(void)
 {
+	return __atomic_load_n(&log__async.dropped, __ATOMIC_RELAXED);
 }
 
 /*
  * Time Management
  * We print seconds and microseconds since application start for each
- * log-message.
+ * log-message. Timestamps come from shl_clock_now(), so applications can
+ * select a cheaper clock source for hot paths.
  */
 
-static struct timeval log__ftime;
+static uint64_t log__ftime;
 
 static void log__time(long long *sec, long long *usec)
 {
-	struct timeval t;
+	uint64_t now, start = 0;
 
-	/* The first log message sets the start-time. As this is unlocked, the
-	 * worst thing that can happen is that multiple messages set it. We
-	 * don't care for that and just accept short time-diffs in that case.
-	 * What we have to check is for negative time-diffs, though. Simply
-	 * revert them. */
+	/* The first log message sets the start-time. Clock sources may lag a
+	 * little between threads, so clamp negative time-diffs to zero. */
 
-	if (log__ftime.tv_sec == 0 && log__ftime.tv_usec == 0) {
-		gettimeofday(&log__ftime, NULL);
-		*sec = 0;
-		*usec = 0;
-	} else {
-		gettimeofday(&t, NULL);
-		*sec = t.tv_sec - log__ftime.tv_sec;
-		*usec = (long long)t.tv_usec - (long long)log__ftime.tv_usec;
-		if (*usec < 0) {
-			*sec -= 1;
-			if (*sec < 0)
-				*sec = 0;
-			*usec = 1000000 + *usec;
-		}
-	}
+	now = shl_clock_now();
+	if (!__atomic_compare_exchange_n(&log__ftime, &start, now, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		now = shl_max(now, start);
+	else
+		start = now;
+
+	*sec = (now - start) / 1000000ULL;
+	*usec = (now - start) % 1000000ULL;
 }
 
 /*
@@ -81,6 +337,128 @@ const char *LOG_SUBSYSTEM = NULL;
 
 unsigned int log_max_sev = LOG_NOTICE;
 
+/*
+ * Subsystem Severities
+ * Each subsystem gets a level slot in a fixed array. Slots are never removed,
+ * so their addresses are stable and each call-site caches a pointer to its
+ * slot (see log__site_resolve()). Hence, the name lookup is done once per
+ * call-site and filtering is a single load afterwards. Direct callers of
+ * log_submit() still look up the name on each message.
+ * A slot is fully written before log__subs_num is increased, later updates
+ * only touch the severity, so readers need no lock. A severity of LOG_SEV_NUM
+ * inherits log_max_sev. Slot 0 is used for messages without subsystem and if
+ * the table is full; it always inherits.
+ */
+
+#define LOG_SUBS_MAX 64
+
+struct log_subs {
+	char *name;
+	unsigned int sev;
+};
+
+static pthread_mutex_t log__subs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_subs log__subs[LOG_SUBS_MAX] = {
+	[0] = { .sev = LOG_SEV_NUM },
+};
+static size_t log__subs_num = 1;
+
+static struct log_subs *log__subs_find(const char *subs)
+{
+	size_t i, num;
+
+	if (!subs)
+		return &log__subs[0];
+
+	num = __atomic_load_n(&log__subs_num, __ATOMIC_ACQUIRE);
+	for (i = 1; i < num; ++i)
+		if (!strcmp(log__subs[i].name, subs))
+			return &log__subs[i];
+
+	return NULL;
+}
+
+/* find or allocate the slot of @subs */
+static int log__subs_get(const char *subs, struct log_subs **out)
+{
+	struct log_subs *e;
+	int r = 0;
+
+	e = log__subs_find(subs);
+	if (e)
+		goto done;
+
+	pthread_mutex_lock(&log__subs_lock);
+
+	/* somebody else might have allocated it meanwhile */
+	e = log__subs_find(subs);
+	if (e)
+		goto unlock;
+
+	if (log__subs_num >= LOG_SUBS_MAX) {
+		r = -ENOSPC;
+		goto unlock;
+	}
+
+	e = &log__subs[log__subs_num];
+	e->name = strdup(subs);
+	if (!e->name) {
+		e = NULL;
+		r = -ENOMEM;
+		goto unlock;
+	}
+
+	e->sev = LOG_SEV_NUM;
+	__atomic_store_n(&log__subs_num, log__subs_num + 1, __ATOMIC_RELEASE);
+
+unlock:
+	pthread_mutex_unlock(&log__subs_lock);
+done:
+	*out = e;
+	return r;
+}
+
+unsigned int *log__site_resolve(struct log_site *site, const char *subs)
+{
+	struct log_subs *e;
+
+	/* on failure, fall back to the shared slot that inherits */
+	if (log__subs_get(subs, &e) < 0)
+		e = &log__subs[0];
+
+	__atomic_store_n(&site->sev, &e->sev, __ATOMIC_RELEASE);
+	return &e->sev;
+}
+
+int log_set_subsystem_sev(const char *subs, unsigned int sev)
+{
+	struct log_subs *e;
+	int r;
+
+	if (!subs || sev > LOG_SEV_NUM)
+		return -EINVAL;
+
+	r = log__subs_get(subs, &e);
+	if (r < 0)
+		return r;
+
+	__atomic_store_n(&e->sev, sev, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* return the maximum severity that is logged for @subs */
+static unsigned int log__max_sev(const char *subs)
+{
+	struct log_subs *e;
+	unsigned int sev = LOG_SEV_NUM;
+
+	e = log__subs_find(subs);
+	if (e)
+		sev = __atomic_load_n(&e->sev, __ATOMIC_RELAXED);
+
+	return sev < LOG_SEV_NUM ? sev : log_max_sev;
+}
+
 /*
  * Forward declaration so we can use the locked-versions in other functions
  * here. Be careful to avoid deadlocks, though.
@@ -99,8 +477,8 @@ static void log__submit(const char *file,
 
 /*
  * Basic logger
- * The log__submit function writes the message into the current log-target. It
- * must be called with log__mutex locked.
+ * The log__submit function formats the message into the per-thread buffer and
+ * passes it to the current log-target. It is safe to call from any thread.
  * By default the current time elapsed since the first message was logged is
  * prepended to the message. file, line and func information are appended to the
  * message if sev == LOG_DEBUG.
@@ -119,44 +497,136 @@ static const char *log__sev2str[LOG_SEV_NUM] = {
 	[LOG_FATAL] = "FATAL",
 };
 
-static void log__submit(const char *file,
-			int line,
-			const char *func,
-			const char *subs,
-			unsigned int sev,
-			const char *format,
-			va_list args)
+/*
+ * Level Control
+ * Level specs are lists of "subsystem=level" entries separated by commas or
+ * whitespace. The level is a severity name or number, or "inherit" to follow
+ * log_max_sev again. The subsystem "*" sets log_max_sev itself.
+ */
+
+static int log__parse_sev(const char *str, unsigned int *out)
 {
-	int saved_errno = errno;
-	const char *prefix = NULL;
-	FILE *out;
-	long long sec, usec;
+	const char *next;
+	unsigned int i;
 
-	out = stderr;
-	log__time(&sec, &usec);
+	for (i = 0; i < LOG_SEV_NUM; ++i) {
+		if (!strcasecmp(str, log__sev2str[i])) {
+			*out = i;
+			return 0;
+		}
+	}
 
-	if (sev < LOG_SEV_NUM && sev > log_max_sev)
-		return;
+	if (!strcasecmp(str, "inherit")) {
+		*out = LOG_SEV_NUM;
+		return 0;
+	}
+
+	if (shl_atoi_u(str, 10, &next, &i) < 0 || next == str || *next ||
+	    i >= LOG_SEV_NUM)
+		return -EINVAL;
+
+	*out = i;
+	return 0;
+}
+
+int log_parse_levels(const char *spec)
+{
+	char **strv, *sep;
+	unsigned int i, sev;
+	int r;
+
+	r = shl_strsplit(spec, ", \t\n", &strv);
+	if (r < 0)
+		return r;
+
+	for (i = 0; strv[i]; ++i) {
+		sep = strchr(strv[i], '=');
+		if (!sep || sep == strv[i]) {
+			r = -EINVAL;
+			break;
+		}
+
+		*sep++ = 0;
+		r = log__parse_sev(sep, &sev);
+		if (r < 0)
+			break;
+
+		if (!strcmp(strv[i], "*")) {
+			if (sev >= LOG_SEV_NUM) {
+				r = -EINVAL;
+				break;
+			}
+			log_max_sev = sev;
+		} else {
+			r = log_set_subsystem_sev(strv[i], sev);
+			if (r < 0)
+				break;
+		}
+	}
+
+	shl_strv_free(strv);
+	return r;
+}
+
+int log_load_levels(const char *path)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t l;
+	FILE *f;
+	int r = 0;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -errno;
+
+	while ((l = getline(&line, &size, f)) >= 0) {
+		if (line[0] == '#')
+			continue;
+
+		r = log_parse_levels(line);
+		if (r < 0)
+			break;
+	}
+
+	free(line);
+	fclose(f);
+	return r;
+}
+
+/* format the "[time] SEV: SUBS: " prefix into @buf, returns its length */
+static size_t log__head(char *buf, size_t max, long long sec, long long usec,
+			unsigned int sev, const char *subs)
+{
+	const char *prefix = NULL;
+	int l;
 
 	if (sev < LOG_SEV_NUM)
 		prefix = log__sev2str[sev];
 
 	if (prefix) {
 		if (subs)
-			fprintf(out, "[%.4lld.%.6lld] %s: %s: ",
-				sec, usec, prefix, subs);
+			l = snprintf(buf, max, "[%.4lld.%.6lld] %s: %s: ",
+				     sec, usec, prefix, subs);
 		else
-			fprintf(out, "[%.4lld.%.6lld] %s: ",
-				sec, usec, prefix);
+			l = snprintf(buf, max, "[%.4lld.%.6lld] %s: ",
+				     sec, usec, prefix);
 	} else {
 		if (subs)
-			fprintf(out, "[%.4lld.%.6lld] %s: ", sec, usec, subs);
+			l = snprintf(buf, max, "[%.4lld.%.6lld] %s: ",
+				     sec, usec, subs);
 		else
-			fprintf(out, "[%.4lld.%.6lld] ", sec, usec);
+			l = snprintf(buf, max, "[%.4lld.%.6lld] ", sec, usec);
 	}
 
-	errno = saved_errno;
-	vfprintf(out, format, args);
+	return shl_min((size_t)shl_max(l, 0), max - 1);
+}
+
+/* append the debug-suffix and newline to the message in @buf */
+static size_t log__tail(char *buf, size_t len, size_t max, const char *file,
+			int line, const char *func, unsigned int sev)
+{
+	int l;
 
 	if (sev == LOG_DEBUG) {
 		if (!func)
@@ -165,10 +635,1165 @@ static void log__submit(const char *file,
 			file = "<unknown>";
 		if (line < 0)
 			line = 0;
-		fprintf(out, " (%s() in %s:%d)\n", func, file, line);
+		l = snprintf(buf + len, max - len, " (%s() in %s:%d)",
+			     func, file, line);
+		len = shl_min(len + shl_max(l, 0), max - 1);
+	}
+
+	/* @max is one less than the buffer so the newline always fits */
+	buf[len++] = '\n';
+	return len;
+}
+
+/*
+ * Deferred Logging
+ * In deferred mode, log__submit() does not format messages. Instead, it
+ * encodes the call-site and the raw arguments into a binary record:
+ *   struct log_drec | arg | arg | ...
+ * The format string is walked once to learn the argument types. Integers are
+ * stored as int64_t, floats as double or long double, pointers as void*, and
+ * strings as uint32_t length followed by the zero-terminated data. Integers
+ * consumed by '*' width/precision come before their argument. "%m" stores
+ * nothing, the record carries the errno instead.
+ * Records are appended to a bounded shl_ring. log_defer_flush() decodes them
+ * by walking the format string again and formatting each conversion on its
+ * own with the stored value.
+ * Messages that cannot be encoded (positional arguments, %n, wide strings,
+ * records exceeding LOG_LINE_MAX) are formatted immediately.
+ */
+
+enum log_arg_type {
+	LOG_ARG_NONE,
+	LOG_ARG_INT,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_LDOUBLE,
+	LOG_ARG_STR,
+	LOG_ARG_PTR,
+	LOG_ARG_ERRNO,
+	LOG_ARG_INVALID,
+};
+
+struct log_spec {
+	const char *start;
+	size_t len;
+	unsigned int type;
+	unsigned int stars;
+	bool prec_star;
+	int prec;
+	char mod;
+};
+
+struct log_drec {
+	uint32_t len;
+	uint32_t sev;
+	int32_t line;
+	int32_t err;
+	long long sec;
+	long long usec;
+	const char *file;
+	const char *func;
+	const char *subs;
+	const char *format;
+};
+
+#define LOG_SPEC_MAX 64
+
+static __thread uint8_t log__rbuf[LOG_LINE_MAX];
+
+static struct {
+	pthread_mutex_t lock;
+	struct shl_ring ring;
+	size_t max;
+	bool enabled;
+	unsigned long dropped;
+} log__defer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* find the next '%' sequence in *@fmt and parse it into @s */
+static bool log__spec_next(const char **fmt, struct log_spec *s)
+{
+	const char *p;
+
+	p = strchr(*fmt, '%');
+	if (!p)
+		return false;
+
+	memset(s, 0, sizeof(*s));
+	s->start = p++;
+	s->prec = -1;
+
+	if (*p == '%') {
+		s->type = LOG_ARG_NONE;
+		goto out;
+	}
+
+	while (*p && strchr("-+ #0'I", *p))
+		++p;
+
+	if (*p == '*') {
+		++s->stars;
+		++p;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			++p;
+		if (*p == '$')
+			goto invalid;
+	}
+
+	if (*p == '.') {
+		++p;
+		if (*p == '*') {
+			++s->stars;
+			s->prec_star = true;
+			++p;
+		} else {
+			s->prec = 0;
+			while (*p >= '0' && *p <= '9')
+				s->prec = s->prec * 10 + *p++ - '0';
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		s->mod = *p++;
+		if (*p == 'h') {
+			s->mod = 'H';
+			++p;
+		}
+		break;
+	case 'l':
+		s->mod = *p++;
+		if (*p == 'l') {
+			s->mod = 'q';
+			++p;
+		}
+		break;
+	case 'Z':
+		s->mod = 'z';
+		++p;
+		break;
+	case 'q':
+	case 'L':
+	case 'j':
+	case 'z':
+	case 't':
+		s->mod = *p++;
+		break;
+	}
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		s->type = LOG_ARG_INT;
+		break;
+	case 'c':
+		if (s->mod)
+			goto invalid;
+		s->type = LOG_ARG_INT;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		s->type = s->mod == 'L' ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		if (s->mod)
+			goto invalid;
+		s->type = LOG_ARG_STR;
+		break;
+	case 'p':
+		s->type = LOG_ARG_PTR;
+		break;
+	case 'm':
+		s->type = LOG_ARG_ERRNO;
+		break;
+	default:
+		goto invalid;
+	}
+
+out:
+	s->len = p + 1 - s->start;
+	*fmt = p + 1;
+	return true;
+
+invalid:
+	s->type = LOG_ARG_INVALID;
+	return true;
+}
+
+#define LOG__PUT(_buf, _len, _v) ({					\
+		__typeof__(_v) __v = (_v);				\
+		bool __ok = (_len) + sizeof(__v) <= LOG_LINE_MAX;	\
+		if (__ok) {						\
+			memcpy((_buf) + (_len), &__v, sizeof(__v));	\
+			(_len) += sizeof(__v);				\
+		}							\
+		__ok;							\
+	})
+
+#define LOG__GET(_rec, _off, _type) ({					\
+		_type __v;						\
+		memcpy(&__v, (_rec) + (_off), sizeof(__v));		\
+		(_off) += sizeof(__v);					\
+		__v;							\
+	})
+
+static int64_t log__va_int(char mod, va_list *args)
+{
+	switch (mod) {
+	case 'l':
+		return va_arg(*args, long);
+	case 'q':
+		return va_arg(*args, long long);
+	case 'j':
+		return va_arg(*args, intmax_t);
+	case 'z':
+		return va_arg(*args, size_t);
+	case 't':
+		return va_arg(*args, ptrdiff_t);
+	default:
+		return va_arg(*args, int);
+	}
+}
+
+/* encode a message into the per-thread record buffer, returns its length */
+static size_t log__defer_encode(const char *file,
+				int line,
+				const char *func,
+				const char *subs,
+				unsigned int sev,
+				long long sec,
+				long long usec,
+				int err,
+				const char *format,
+				va_list args)
+{
+	uint8_t *buf = log__rbuf;
+	struct log_drec rec;
+	struct log_spec s;
+	const char *f = format, *str;
+	size_t len = sizeof(rec), slen;
+	va_list ap;
+	unsigned int i;
+	bool ok = true;
+	int v;
+
+	va_copy(ap, args);
+
+	while (ok && log__spec_next(&f, &s)) {
+		/* the decoder copies the spec into a small buffer */
+		if (s.len >= LOG_SPEC_MAX) {
+			ok = false;
+			break;
+		}
+
+		for (i = 0; ok && i < s.stars; ++i) {
+			v = va_arg(ap, int);
+			if (s.prec_star && i + 1 == s.stars)
+				s.prec = v;
+			ok = LOG__PUT(buf, len, v);
+		}
+		if (!ok)
+			break;
+
+		switch (s.type) {
+		case LOG_ARG_INT:
+			ok = LOG__PUT(buf, len, log__va_int(s.mod, &ap));
+			break;
+		case LOG_ARG_DOUBLE:
+			ok = LOG__PUT(buf, len, va_arg(ap, double));
+			break;
+		case LOG_ARG_LDOUBLE:
+			ok = LOG__PUT(buf, len, va_arg(ap, long double));
+			break;
+		case LOG_ARG_PTR:
+			ok = LOG__PUT(buf, len, va_arg(ap, void*));
+			break;
+		case LOG_ARG_STR:
+			str = va_arg(ap, const char*);
+			if (!str) {
+				ok = LOG__PUT(buf, len, (uint32_t)UINT32_MAX);
+				break;
+			}
+
+			/* the precision bounds strings that are not
+			 * zero-terminated */
+			slen = s.prec < 0 ? strlen(str) : strnlen(str, s.prec);
+			ok = LOG__PUT(buf, len, (uint32_t)slen) &&
+			     len + slen + 1 <= LOG_LINE_MAX;
+			if (ok) {
+				memcpy(buf + len, str, slen);
+				buf[len + slen] = 0;
+				len += slen + 1;
+			}
+			break;
+		case LOG_ARG_INVALID:
+			ok = false;
+			break;
+		}
+	}
+
+	va_end(ap);
+
+	if (!ok)
+		return 0;
+
+	rec.len = len;
+	rec.sev = sev;
+	rec.line = line;
+	rec.err = err;
+	rec.sec = sec;
+	rec.usec = usec;
+	rec.file = file;
+	rec.func = func;
+	rec.subs = subs;
+	rec.format = format;
+	memcpy(buf, &rec, sizeof(rec));
+
+	return len;
+}
+
+/* format the message of the record @data, appending it to @buf at @len */
+static size_t log__defer_format(const uint8_t *data,
+				const struct log_drec *rec,
+				char *buf,
+				size_t len,
+				size_t max)
+{
+	struct log_spec s;
+	const char *f, *last;
+	char spec[LOG_SPEC_MAX];
+	size_t off = sizeof(*rec);
+	int star[2], l = 0;
+	unsigned int i;
+	int64_t iv;
+	uint32_t slen;
+
+#define LOG__FMT(...)							\
+	do {								\
+		if (s.stars == 2)					\
+			l = snprintf(buf + len, max - len, spec,	\
+				     star[0], star[1], ##__VA_ARGS__);	\
+		else if (s.stars == 1)					\
+			l = snprintf(buf + len, max - len, spec,	\
+				     star[0], ##__VA_ARGS__);		\
+		else							\
+			l = snprintf(buf + len, max - len, spec,	\
+				     ##__VA_ARGS__);			\
+	} while (0)
+
+	for (f = last = rec->format; log__spec_next(&f, &s); last = f) {
+		l = shl_min((size_t)(s.start - last), max - 1 - len);
+		memcpy(buf + len, last, l);
+		len += l;
+
+		/* the encoder rejected longer specs */
+		memcpy(spec, s.start, s.len);
+		spec[s.len] = 0;
+
+		for (i = 0; i < s.stars; ++i)
+			star[i] = LOG__GET(data, off, int);
+
+		switch (s.type) {
+		case LOG_ARG_NONE:
+			LOG__FMT();
+			break;
+		case LOG_ARG_INT:
+			iv = LOG__GET(data, off, int64_t);
+			switch (s.mod) {
+			case 'l':
+				LOG__FMT((long)iv);
+				break;
+			case 'q':
+				LOG__FMT((long long)iv);
+				break;
+			case 'j':
+				LOG__FMT((intmax_t)iv);
+				break;
+			case 'z':
+				LOG__FMT((size_t)iv);
+				break;
+			case 't':
+				LOG__FMT((ptrdiff_t)iv);
+				break;
+			default:
+				LOG__FMT((int)iv);
+				break;
+			}
+			break;
+		case LOG_ARG_DOUBLE:
+			LOG__FMT(LOG__GET(data, off, double));
+			break;
+		case LOG_ARG_LDOUBLE:
+			LOG__FMT(LOG__GET(data, off, long double));
+			break;
+		case LOG_ARG_PTR:
+			LOG__FMT(LOG__GET(data, off, void*));
+			break;
+		case LOG_ARG_STR:
+			slen = LOG__GET(data, off, uint32_t);
+			if (slen == UINT32_MAX) {
+				LOG__FMT((const char*)NULL);
+			} else {
+				LOG__FMT((const char*)data + off);
+				off += slen + 1;
+			}
+			break;
+		case LOG_ARG_ERRNO:
+			errno = rec->err;
+			LOG__FMT();
+			break;
+		}
+
+		len = shl_min(len + shl_max(l, 0), max - 1);
+	}
+
+#undef LOG__FMT
+
+	l = shl_min(strlen(last), max - 1 - len);
+	memcpy(buf + len, last, l);
+	len += l;
+
+	return len;
+}
+
+/* format a record into @buf (at least LOG_LINE_MAX bytes), returns length */
+static size_t log__defer_decode(const uint8_t *data, char *buf)
+{
+	struct log_drec rec;
+	size_t len, max = LOG_LINE_MAX - 1;
+
+	memcpy(&rec, data, sizeof(rec));
+
+	len = log__head(buf, max, rec.sec, rec.usec, rec.sev, rec.subs);
+	len = log__defer_format(data, &rec, buf, len, max);
+	return log__tail(buf, len, max, rec.file, rec.line, rec.func, rec.sev);
+}
+
+static bool log__defer_push(const uint8_t *rec, size_t len)
+{
+	bool ok = false;
+
+	pthread_mutex_lock(&log__defer.lock);
+	if (log__defer.enabled &&
+	    shl_ring_get_size(&log__defer.ring) + len <= log__defer.max)
+		ok = shl_ring_push(&log__defer.ring, rec, len) >= 0;
+	if (!ok)
+		++log__defer.dropped;
+	pthread_mutex_unlock(&log__defer.lock);
+
+	return ok;
+}
+
+int log_defer_start(size_t size)
+{
+	int r = 0;
+
+	if (size < LOG_LINE_MAX)
+		return -EINVAL;
+
+	pthread_mutex_lock(&log__defer.lock);
+	if (log__defer.enabled) {
+		r = -EALREADY;
+	} else {
+		log__defer.max = size;
+		log__defer.dropped = 0;
+		__atomic_store_n(&log__defer.enabled, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log__defer.lock);
+
+	return r;
+}
+
+void log_defer_stop(void)
+{
+	pthread_mutex_lock(&log__defer.lock);
+	__atomic_store_n(&log__defer.enabled, false, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log__defer.lock);
+
+	log_defer_flush(-1);
+
+	pthread_mutex_lock(&log__defer.lock);
+	shl_ring_clear(&log__defer.ring);
+	pthread_mutex_unlock(&log__defer.lock);
+}
+
+/* the journal sink is defined below */
+static bool log__journal_defer(const uint8_t *data, char *buf);
+
+ssize_t log_defer_flush(int fd)
+{
+	static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+	char *buf = log__buf;
+	uint8_t *rec = log__rbuf;
+	uint32_t len;
+	ssize_t num = 0;
+	size_t l;
+
+	/* records are decoded outside of the ring lock, so loggers only wait
+	 * for the copy; only one thread may decode at a time, though */
+	pthread_mutex_lock(&flush_lock);
+
+	for (;;) {
+		pthread_mutex_lock(&log__defer.lock);
+		if (!shl_ring_get_size(&log__defer.ring)) {
+			pthread_mutex_unlock(&log__defer.lock);
+			break;
+		}
+
+		shl_ring_copy(&log__defer.ring, &len, sizeof(len));
+		shl_ring_copy(&log__defer.ring, rec, len);
+		shl_ring_pull(&log__defer.ring, len);
+		pthread_mutex_unlock(&log__defer.lock);
+
+		if (fd < 0 && log__journal_defer(rec, buf)) {
+			++num;
+			continue;
+		}
+
+		l = log__defer_decode(rec, buf);
+		if (fd < 0)
+			log__emit(buf, l);
+		else
+			log__write(fd, &(struct iovec){ .iov_base = buf,
+							.iov_len = l }, 1);
+		++num;
+	}
+
+	pthread_mutex_unlock(&flush_lock);
+	return num;
+}
+
+unsigned long log_defer_dropped(void)
+{
+	unsigned long r;
+
+	pthread_mutex_lock(&log__defer.lock);
+	r = log__defer.dropped;
+	pthread_mutex_unlock(&log__defer.lock);
+
+	return r;
+}
+
+/*
+ * Flight Recorder
+ * Each thread records into its own fixed-size circular buffer, so recording
+ * needs no locks and no atomic read-modify-write. Records use the deferred
+ * encoding (see log__defer_encode()) prefixed by their length:
+ *   uint32_t len | struct log_drec | args...
+ * @head counts all bytes ever written, @tail is the offset of the oldest
+ * complete record. Before a record is written, @tail is moved past all records
+ * that are overwritten.
+ * Buffers are linked into a global list and never freed. When a thread exits,
+ * its buffer is released for reuse by new threads but keeps its content until
+ * then, so dumps include threads that are already gone.
+ * Dumps may run concurrently to writers (e.g. from a crash handler). The
+ * reader copies a record, then re-checks @tail and discards the copy if the
+ * writer overwrote it meanwhile. This is best-effort; torn records of a thread
+ * that is writing during the dump are detected by sanity checks only.
+ */
+
+struct log_fr {
+	struct log_fr *next;
+	int owner;
+	pid_t tid;
+	uint64_t head;
+	uint64_t tail;
+	size_t size;
+	uint8_t buf[];
+};
+
+static __thread struct log_fr *log__fr_local;
+
+static struct {
+	struct log_fr *list;
+	size_t size;
+	int fd;
+	pthread_key_t key;
+	bool key_init;
+	struct sigaction old[5];
+} log__fr = {
+	.fd = -1,
+};
+
+bool log__fr_enabled;
+
+static const int log__fr_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+};
+
+static void log__fr_release(void *data)
+{
+	struct log_fr *fr = data;
+
+	log__fr_local = NULL;
+	__atomic_store_n(&fr->owner, 0, __ATOMIC_RELEASE);
+}
+
+static struct log_fr *log__fr_get(void)
+{
+	struct log_fr *fr = log__fr_local;
+	int zero;
+
+	if (fr)
+		return fr;
+
+	/* reuse the buffer of an exited thread if there is one */
+	fr = __atomic_load_n(&log__fr.list, __ATOMIC_ACQUIRE);
+	for ( ; fr; fr = fr->next) {
+		zero = 0;
+		if (fr->size == log__fr.size &&
+		    __atomic_compare_exchange_n(&fr->owner, &zero, 1, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!fr) {
+		fr = malloc(sizeof(*fr) + log__fr.size);
+		if (!fr)
+			return NULL;
+
+		fr->owner = 1;
+		fr->size = log__fr.size;
+		fr->next = __atomic_load_n(&log__fr.list, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&log__fr.list, &fr->next, fr,
+						    true, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+
+	__atomic_store_n(&fr->tail, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&fr->head, 0, __ATOMIC_RELEASE);
+	fr->tid = syscall(SYS_gettid);
+
+	pthread_setspecific(log__fr.key, fr);
+	log__fr_local = fr;
+	return fr;
+}
+
+static void log__fr_write(struct log_fr *fr, uint64_t pos, const void *data,
+			  size_t len)
+{
+	size_t off = pos & (fr->size - 1), n;
+
+	n = shl_min(len, fr->size - off);
+	memcpy(fr->buf + off, data, n);
+	memcpy(fr->buf, (const uint8_t*)data + n, len - n);
+}
+
+static void log__fr_read(struct log_fr *fr, uint64_t pos, void *data,
+			 size_t len)
+{
+	size_t off = pos & (fr->size - 1), n;
+
+	n = shl_min(len, fr->size - off);
+	memcpy(data, fr->buf + off, n);
+	memcpy((uint8_t*)data + n, fr->buf, len - n);
+}
+
+static void log__fr_push(const uint8_t *rec, uint32_t len)
+{
+	struct log_fr *fr;
+	uint64_t head, tail;
+	uint32_t l;
+
+	fr = log__fr_get();
+	if (!fr)
+		return;
+
+	if (sizeof(len) + len > fr->size)
+		return;
+
+	head = fr->head;
+	tail = fr->tail;
+
+	while (head + sizeof(len) + len - tail > fr->size) {
+		log__fr_read(fr, tail, &l, sizeof(l));
+		tail += sizeof(l) + l;
+	}
+
+	/* publish the new tail before overwriting anything */
+	__atomic_store_n(&fr->tail, tail, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	log__fr_write(fr, head, &len, sizeof(len));
+	log__fr_write(fr, head + sizeof(len), rec, len);
+	__atomic_store_n(&fr->head, head + sizeof(len) + len,
+			 __ATOMIC_RELEASE);
+}
+
+static void log__fr_dump_one(struct log_fr *fr, int fd)
+{
+	uint8_t rec[LOG_LINE_MAX];
+	char line[LOG_LINE_MAX];
+	struct log_drec drec;
+	uint64_t head, pos, tail;
+	uint32_t len;
+	size_t l;
+	int saved_errno = errno;
+
+	head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+	pos = __atomic_load_n(&fr->tail, __ATOMIC_ACQUIRE);
+
+	l = snprintf(line, sizeof(line), "-- flight recorder: thread %d --\n",
+		     (int)fr->tid);
+	log__write(fd, &(struct iovec){ .iov_base = line, .iov_len = l }, 1);
+
+	while (pos < head) {
+		log__fr_read(fr, pos, &len, sizeof(len));
+		if (len < sizeof(drec) || len > sizeof(rec))
+			break;
+
+		log__fr_read(fr, pos + sizeof(len), rec, len);
+
+		/* skip the record if it got overwritten while we copied it */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&fr->tail, __ATOMIC_RELAXED);
+		if (tail > pos) {
+			pos = tail;
+			continue;
+		}
+
+		memcpy(&drec, rec, sizeof(drec));
+		if (drec.len != len || !drec.format)
+			break;
+
+		l = log__defer_decode(rec, line);
+		log__write(fd, &(struct iovec){ .iov_base = line,
+						.iov_len = l }, 1);
+		pos += sizeof(len) + len;
+	}
+
+	errno = saved_errno;
+}
+
+void log_fr_dump(int fd)
+{
+	struct log_fr *fr;
+
+	fr = __atomic_load_n(&log__fr.list, __ATOMIC_ACQUIRE);
+	for ( ; fr; fr = fr->next)
+		log__fr_dump_one(fr, fd);
+}
+
+static void log__fr_crash(int sig, siginfo_t *si, void *uctx)
+{
+	size_t i;
+
+	log_fr_dump(log__fr.fd);
+
+	/* chain to the handler that was installed before log_fr_start() */
+	for (i = 0; i < SHL_ARRAY_LENGTH(log__fr_signals); ++i)
+		if (log__fr_signals[i] == sig)
+			sigaction(sig, &log__fr.old[i], NULL);
+
+	/* Faults raised by the kernel re-trigger once we return, so the old
+	 * handler gets the original siginfo. Everything else is re-raised. */
+	if (si->si_code <= 0)
+		raise(sig);
+}
+
+int log_fr_start(size_t size, int fd)
+{
+	struct sigaction sa;
+	size_t i;
+	int r;
+
+	if (log__fr_enabled)
+		return -EALREADY;
+	if (size < LOG_LINE_MAX || size > (1UL << 30))
+		return -EINVAL;
+
+	if (!log__fr.key_init) {
+		r = pthread_key_create(&log__fr.key, log__fr_release);
+		if (r)
+			return -r;
+		log__fr.key_init = true;
+	}
+
+	/* round up to a power of two so offsets can be masked */
+	log__fr.size = 1;
+	while (log__fr.size < size)
+		log__fr.size <<= 1;
+
+	log__fr.fd = fd;
+	if (fd >= 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = log__fr_crash;
+		sa.sa_flags = SA_SIGINFO | SA_RESETHAND | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		for (i = 0; i < SHL_ARRAY_LENGTH(log__fr_signals); ++i)
+			sigaction(log__fr_signals[i], &sa, &log__fr.old[i]);
+	}
+
+	__atomic_store_n(&log__fr_enabled, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_fr_stop(void)
+{
+	size_t i;
+
+	if (!log__fr_enabled)
+		return;
+
+	__atomic_store_n(&log__fr_enabled, false, __ATOMIC_RELEASE);
+
+	if (log__fr.fd >= 0) {
+		for (i = 0; i < SHL_ARRAY_LENGTH(log__fr_signals); ++i)
+			sigaction(log__fr_signals[i], &log__fr.old[i], NULL);
+		log__fr.fd = -1;
+	}
+}
+
+static void log__fr_record(const char *file,
+			   int line,
+			   const char *func,
+			   const char *subs,
+			   unsigned int sev,
+			   long long sec,
+			   long long usec,
+			   int err,
+			   const char *format,
+			   va_list args)
+{
+	size_t len;
+
+	len = log__defer_encode(file, line, func, subs, sev, sec, usec, err,
+				format, args);
+	if (len)
+		log__fr_push(log__rbuf, len);
+}
+
+void log_fr_llog(void *data,
+		 const char *file,
+		 int line,
+		 const char *func,
+		 const char *subs,
+		 unsigned int sev,
+		 const char *format,
+		 va_list args)
+{
+	int saved_errno = errno;
+	long long sec, usec;
+
+	if (!__atomic_load_n(&log__fr_enabled, __ATOMIC_ACQUIRE))
+		return;
+
+	log__time(&sec, &usec);
+	log__fr_record(file, line, func, subs, sev, sec, usec, saved_errno,
+		       format, args);
+	errno = saved_errno;
+}
+
+/*
+ * Journal
+ * Messages are sent to journald via its native protocol: a single datagram
+ * with one "FIELD=value\n" line per field, sent via sendmsg() straight from an
+ * iovec array, so neither we nor journald need to format or parse anything.
+ * Values with newlines use the binary form "FIELD\n" + le64 length + value +
+ * "\n". If the datagram is too big for the socket, the same payload is written
+ * into a sealed memfd and only the fd is passed to journald.
+ * The socket is non-blocking, so a stalled journald never blocks the logging
+ * threads. If its receive queue is full, the message is dropped and counted.
+ */
+
+#define LOG_JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+static struct {
+	int fd;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	unsigned long dropped;
+} log__journal = {
+	.fd = -1,
+};
+
+int log_journal_start(const char *path)
+{
+	size_t l;
+	int fd;
+
+	if (log__journal.fd >= 0)
+		return -EALREADY;
+
+	if (!path)
+		path = LOG_JOURNAL_SOCKET;
+
+	l = strlen(path);
+	if (!l || l >= sizeof(log__journal.addr.sun_path))
+		return -EINVAL;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&log__journal.addr, 0, sizeof(log__journal.addr));
+	log__journal.addr.sun_family = AF_UNIX;
+	memcpy(log__journal.addr.sun_path, path, l);
+	log__journal.addr_len = offsetof(struct sockaddr_un, sun_path) + l + 1;
+	log__journal.dropped = 0;
+
+	__atomic_store_n(&log__journal.fd, fd, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_journal_stop(void)
+{
+	int fd;
+
+	/* Threads that loaded the fd before might still send on it, so this
+	 * must not race with them; see shl_log.h. */
+	fd = __atomic_exchange_n(&log__journal.fd, -1, __ATOMIC_ACQ_REL);
+	if (fd >= 0)
+		close(fd);
+}
+
+unsigned long log_journal_dropped(void)
+{
+	return __atomic_load_n(&log__journal.dropped, __ATOMIC_RELAXED);
+}
+
+static void log__journal_send(int fd, struct iovec *iov, size_t num)
+{
+	union {
+		struct cmsghdr cmsg;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr mh = {
+		.msg_name = &log__journal.addr,
+		.msg_namelen = log__journal.addr_len,
+		.msg_iov = iov,
+		.msg_iovlen = num,
+	};
+	struct cmsghdr *cmsg;
+	int mfd;
+
+	if (sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0)
+		return;
+	if (errno != EMSGSIZE && errno != ENOBUFS)
+		goto drop;
+
+	mfd = memfd_create("shl-log", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mfd < 0)
+		goto drop;
+
+	log__write(mfd, iov, num);
+
+	/* journald refuses fds that are not sealed */
+	if (fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				    F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto out;
+
+	memset(&control, 0, sizeof(control));
+	mh.msg_iov = NULL;
+	mh.msg_iovlen = 0;
+	mh.msg_control = &control;
+	mh.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mfd, sizeof(int));
+
+	if (sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0) {
+		close(mfd);
+		return;
+	}
+
+out:
+	close(mfd);
+drop:
+	__atomic_add_fetch(&log__journal.dropped, 1, __ATOMIC_RELAXED);
+}
+
+#define LOG__IOV(_iov, _num, _base, _len) do {				\
+		(_iov)[(_num)].iov_base = (void*)(_base);		\
+		(_iov)[(_num)++].iov_len = (_len);			\
+	} while (0)
+
+#define LOG__IOV_STR(_iov, _num, _str) \
+	LOG__IOV((_iov), (_num), (_str), strlen(_str))
+
+static void log__journal_field(struct iovec *iov, size_t *num,
+			       const char *key, const char *value)
+{
+	LOG__IOV_STR(iov, *num, key);
+	LOG__IOV_STR(iov, *num, value);
+	LOG__IOV(iov, *num, "\n", 1);
+}
+
+static void log__journal_message(int fd,
+				 const char *file,
+				 int line,
+				 const char *func,
+				 const char *subs,
+				 unsigned int sev,
+				 const char *msg,
+				 size_t len)
+{
+	char pri[16], lbuf[32];
+	struct iovec iov[24];
+	size_t num = 0;
+	uint64_t le;
+
+	if (memchr(msg, '\n', len)) {
+		le = htole64(len);
+		LOG__IOV_STR(iov, num, "MESSAGE\n");
+		LOG__IOV(iov, num, &le, sizeof(le));
+		LOG__IOV(iov, num, msg, len);
+		LOG__IOV(iov, num, "\n", 1);
 	} else {
-		fprintf(out, "\n");
+		LOG__IOV_STR(iov, num, "MESSAGE=");
+		LOG__IOV(iov, num, msg, len);
+		LOG__IOV(iov, num, "\n", 1);
+	}
+
+	if (sev < LOG_SEV_NUM) {
+		snprintf(pri, sizeof(pri), "%u", sev);
+		log__journal_field(iov, &num, "PRIORITY=", pri);
+	}
+	if (file)
+		log__journal_field(iov, &num, "CODE_FILE=", file);
+	if (line > 0) {
+		snprintf(lbuf, sizeof(lbuf), "%d", line);
+		log__journal_field(iov, &num, "CODE_LINE=", lbuf);
+	}
+	if (func)
+		log__journal_field(iov, &num, "CODE_FUNC=", func);
+	if (subs)
+		log__journal_field(iov, &num, "LOG_SUBSYSTEM=", subs);
+	log__journal_field(iov, &num, "SYSLOG_IDENTIFIER=",
+			   program_invocation_short_name);
+
+	log__journal_send(fd, iov, num);
+}
+
+static void log__journal_submit(int fd,
+				const char *file,
+				int line,
+				const char *func,
+				const char *subs,
+				unsigned int sev,
+				int err,
+				const char *format,
+				va_list args)
+{
+	char *msg = log__buf, *large = NULL;
+	va_list copy;
+	size_t len;
+	int l;
+
+	va_copy(copy, args);
+	errno = err;
+	l = vsnprintf(msg, LOG_LINE_MAX, format, args);
+	len = shl_max(l, 0);
+
+	/* the journal takes messages of any size, so don't truncate */
+	if (len >= LOG_LINE_MAX) {
+		large = malloc(len + 1);
+		if (large) {
+			errno = err;
+			vsnprintf(large, len + 1, format, copy);
+			msg = large;
+		} else {
+			len = LOG_LINE_MAX - 1;
+		}
+	}
+	va_end(copy);
+
+	log__journal_message(fd, file, line, func, subs, sev, msg, len);
+	free(large);
+}
+
+/* send a deferred record, false if the journal is not active */
+static bool log__journal_defer(const uint8_t *data, char *buf)
+{
+	struct log_drec rec;
+	size_t len;
+	int fd;
+
+	fd = __atomic_load_n(&log__journal.fd, __ATOMIC_ACQUIRE);
+	if (fd < 0)
+		return false;
+
+	memcpy(&rec, data, sizeof(rec));
+	len = log__defer_format(data, &rec, buf, 0, LOG_LINE_MAX - 1);
+	log__journal_message(fd, rec.file, rec.line, rec.func, rec.subs,
+			     rec.sev, buf, len);
+	return true;
+}
+
+static void log__submit(const char *file,
+			int line,
+			const char *func,
+			const char *subs,
+			unsigned int sev,
+			const char *format,
+			va_list args)
+{
+	int saved_errno = errno;
+	char *buf = log__buf;
+	size_t len, max = LOG_LINE_MAX - 1;
+	long long sec, usec;
+	bool record;
+	int l, fd;
+
+	/* check the severity first, suppressed messages must be cheap; the
+	 * flight recorder wants all of them, though */
+	record = __atomic_load_n(&log__fr_enabled, __ATOMIC_ACQUIRE);
+	if (!record && sev < LOG_SEV_NUM && sev > log__max_sev(subs))
+		return;
+
+	log__time(&sec, &usec);
+
+	if (record) {
+		log__fr_record(file, line, func, subs, sev, sec, usec,
+			       saved_errno, format, args);
+
+		if (sev == LOG_FATAL && log__fr.fd >= 0)
+			log_fr_dump(log__fr.fd);
+
+		if (sev < LOG_SEV_NUM && sev > log__max_sev(subs))
+			return;
+	}
+
+	if (__atomic_load_n(&log__defer.enabled, __ATOMIC_ACQUIRE)) {
+		len = log__defer_encode(file, line, func, subs, sev, sec, usec,
+					saved_errno, format, args);
+		if (len) {
+			log__defer_push(log__rbuf, len);
+			return;
+		}
 	}
+
+	fd = __atomic_load_n(&log__journal.fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0) {
+		log__journal_submit(fd, file, line, func, subs, sev,
+				    saved_errno, format, args);
+		return;
+	}
+
+	len = log__head(buf, max, sec, usec, sev, subs);
+
+	errno = saved_errno;
+	l = vsnprintf(buf + len, max - len, format, args);
+	len = shl_min(len + shl_max(l, 0), max - 1);
+
+	len = log__tail(buf, len, max, file, line, func, sev);
+	log__emit(buf, len);
 }
 
 void log_submit(const char *file,
@@ -181,10 +1806,7 @@ void log_submit(const char *file,
 {
 	int saved_errno = errno;
 
-	log_lock();
-	errno = saved_errno;
 	log__submit(file, line, func, subs, sev, format, args);
-	log_unlock();
 
 	errno = saved_errno;
 }
@@ -201,10 +1823,7 @@ void log_format(const char *file,
 	va_list list;
 
 	va_start(list, format);
-	log_lock();
-	errno = saved_errno;
 	log__submit(file, line, func, subs, sev, format, list);
-	log_unlock();
 	va_end(list);
 
 	errno = saved_errno;
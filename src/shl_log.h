@@ -19,7 +19,9 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 enum log_severity {
 #ifndef LOG_FATAL
@@ -58,6 +60,187 @@ enum log_severity {
 
 extern unsigned int log_max_sev;
 
+/*
+ * Subsystem Severities
+ * Each subsystem has a level slot that overrides log_max_sev for all its
+ * messages. Use it to silence chatty subsystems, or to enable debug messages
+ * for a single one at runtime. Slots are allocated on first use and initially
+ * inherit log_max_sev. At most 64 subsystems are supported; beyond that, new
+ * subsystems always inherit log_max_sev.
+ *
+ * log_set_subsystem_sev:
+ * Set the level of @subs. Pass LOG_SEV_NUM to inherit log_max_sev again.
+ * Returns -ENOSPC if the table is full.
+ *
+ * log_parse_levels:
+ * Apply a list of "subsystem=level" entries separated by commas or whitespace,
+ * like "dbus=debug,pty=warning,*=info". Levels are severity names, numbers or
+ * "inherit". "*" sets log_max_sev.
+ *
+ * log_load_levels:
+ * Same as log_parse_levels() but reads the entries from the file at @path.
+ * Lines starting with '#' are ignored. This is meant to be used as control
+ * file; for instance, call it whenever your signalfd reports SIGHUP.
+ */
+
+int log_set_subsystem_sev(const char *subs, unsigned int sev);
+int log_parse_levels(const char *spec);
+int log_load_levels(const char *path);
+
+/*
+ * Filters
+ * The log-helpers check the severity inline before evaluating any argument or
+ * calling into the log-subsystem. Each call-site resolves its subsystem to a
+ * level slot once and caches it in a static variable, so afterwards the check
+ * costs a single load. Hence, LOG_SUBSYSTEM must be constant for a call-site.
+ * While the flight recorder is running, all messages pass the inline check.
+ *
+ * Messages with a severity greater than LOG_SEV_FLOOR are removed at compile
+ * time. Define it before including this header, e.g. to LOG_INFO to drop all
+ * debug call-sites from a release build. It defaults to LOG_DEBUG, so nothing
+ * is removed.
+ */
+
+#ifndef LOG_SEV_FLOOR
+#define LOG_SEV_FLOOR LOG_DEBUG
+#endif
+
+struct log_site {
+	unsigned int *sev;
+};
+
+extern bool log__fr_enabled;
+
+unsigned int *log__site_resolve(struct log_site *site, const char *subs);
+
+static inline bool log__site_enabled(struct log_site *site, const char *subs,
+				     unsigned int sev)
+{
+	unsigned int *slot, max;
+
+	slot = __atomic_load_n(&site->sev, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(!slot, 0))
+		slot = log__site_resolve(site, subs);
+
+	max = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	if (max >= LOG_SEV_NUM)
+		max = log_max_sev;
+
+	return sev <= max || __atomic_load_n(&log__fr_enabled, __ATOMIC_RELAXED);
+}
+
+#define log__enabled(sev) \
+	((sev) >= LOG_SEV_NUM || \
+	 ((sev) <= LOG_SEV_FLOOR && ({ \
+		static struct log_site __log_site; \
+		log__site_enabled(&__log_site, LOG_SUBSYSTEM, (sev)); \
+	 })))
+
+/*
+ * Asynchronous Logging
+ * By default, messages are written synchronously to stderr by the calling
+ * thread. log_async_start() spawns a background thread that writes all further
+ * messages to @fd (stderr if negative). Loggers only format the message and
+ * enqueue it, so a slow reader on @fd never stalls them.
+ * At most @max_queued messages are kept in the queue. If it is full, @policy
+ * decides what happens to new messages:
+ *   LOG_ASYNC_DROP: discard the message, see log_async_dropped()
+ *   LOG_ASYNC_BLOCK: wait until the writer made room
+ *
+ * log_async_stop() flushes all queued messages, stops the background thread
+ * and switches back to synchronous logging. It must not race with other
+ * threads that still log; call it right before exit.
+ */
+
+enum log_async_policy {
+	LOG_ASYNC_DROP,
+	LOG_ASYNC_BLOCK,
+};
+
+int log_async_start(int fd, size_t max_queued, unsigned int policy);
+void log_async_stop(void);
+unsigned long log_async_dropped(void);
+
+/*
+ * Deferred Logging
+ * log_defer_start() makes all further messages skip formatting. Instead, the
+ * call-site and the raw arguments are stored as compact binary records in a
+ * ring of @size bytes. log_defer_flush() formats all stored records and writes
+ * them to @fd, or to the current log-target if @fd is negative. Call it from
+ * an idle or background thread. It returns the number of flushed messages.
+ * If the ring is full, new messages are dropped, see log_defer_dropped().
+ * log_defer_stop() flushes the ring and switches back to immediate formatting.
+ *
+ * Only pointers to the format string, file, func and subsystem are stored, so
+ * these must stay valid until flushed. This is true for string literals and
+ * the defaults of all log-helpers. Arguments for "%s" are copied.
+ */
+
+int log_defer_start(size_t size);
+void log_defer_stop(void);
+ssize_t log_defer_flush(int fd);
+unsigned long log_defer_dropped(void);
+
+/*
+ * Journal
+ * log_journal_start() sends all further messages to journald using its native
+ * protocol instead of writing text to stderr. Each message is one datagram
+ * carrying the fields MESSAGE, PRIORITY, CODE_FILE, CODE_LINE, CODE_FUNC,
+ * LOG_SUBSYSTEM and SYSLOG_IDENTIFIER, so journald indexes them without
+ * parsing. Messages are not truncated; if one does not fit into a datagram, it
+ * is passed to journald as sealed memfd.
+ * @path is the journal socket, or NULL for the default
+ * /run/systemd/journal/socket. Messages are sent from the calling thread, but
+ * never block it: if journald does not keep up, they are dropped, see
+ * log_journal_dropped(). Deferred messages flushed via log_defer_flush(-1)
+ * are sent to the journal, too.
+ * log_journal_stop() switches back to stderr. It closes the socket right away,
+ * so it must not race with other threads that still log; call it right before
+ * exit, or once all other threads stopped logging.
+ */
+
+int log_journal_start(const char *path);
+void log_journal_stop(void);
+unsigned long log_journal_dropped(void);
+
+/*
+ * Flight Recorder
+ * log_fr_start() enables an in-memory "black box": every message, including
+ * those filtered by severity, is recorded into a per-thread circular buffer of
+ * @size bytes (rounded up to a power of two). Old messages are overwritten.
+ * Messages are stored in the binary deferred encoding, so recording is cheap
+ * and needs no locks. Nothing is written anywhere until a dump is requested.
+ *
+ * log_fr_dump() formats the content of all buffers and writes it to @fd,
+ * grouped by thread. If @fd passed to log_fr_start() is non-negative, the
+ * recorder is dumped there on log_fatal() and on SIGSEGV, SIGBUS, SIGILL,
+ * SIGFPE and SIGABRT. After the dump, the signal is passed on to whatever
+ * handler was installed before log_fr_start(). The crash handlers are removed
+ * by log_fr_stop().
+ * The crash dump is best-effort only: it formats messages with snprintf(),
+ * which is not async-signal-safe, and runs on the crashing thread's stack
+ * without a sigaltstack. Stack overflows thus cannot be dumped, and a crash
+ * inside malloc() or stdio might deadlock the dump.
+ *
+ * log_fr_llog() is an llog callback which records into the flight recorder
+ * only. Pass it to libraries whose debug output you want kept, but not
+ * printed.
+ */
+
+int log_fr_start(size_t size, int fd);
+void log_fr_stop(void);
+void log_fr_dump(int fd);
+
+__attribute__((format(printf, 7, 0)))
+void log_fr_llog(void *data,
+		 const char *file,
+		 int line,
+		 const char *func,
+		 const char *subs,
+		 unsigned int sev,
+		 const char *format,
+		 va_list args);
+
 /*
  * Log-Functions
  * These functions pass a log-message to the log-subsystem. Handy helpers are
@@ -133,7 +316,8 @@ void log_dummyf(unsigned int sev, const char *format, ...)
  *              "your format string: %s %d", "some args", 5, ...);
  *
  * log_printf is the same as log_format(LOG_DEFAULT, sev, format, ...) and is
- * the most basic wrapper that you can use.
+ * the most basic wrapper that you can use. It filters inline, see above, and
+ * evaluates @sev more than once.
  */
 
 #ifndef LOG_SUBSYSTEM
@@ -144,7 +328,9 @@ extern const char *LOG_SUBSYSTEM;
 #define LOG_DEFAULT LOG_DEFAULT_BASE, LOG_SUBSYSTEM
 
 #define log_printf(sev, format, ...) \
-	log_format(LOG_DEFAULT, (sev), (format), ##__VA_ARGS__)
+	(log__enabled(sev) ? \
+		log_format(LOG_DEFAULT, (sev), (format), ##__VA_ARGS__) : \
+		(void)0)
 
 /*
  * Helpers
@@ -154,6 +340,8 @@ extern const char *LOG_SUBSYSTEM;
  * debugging and will not have any side-effects.
  * Even if disabled, parameters are evaluated! So it only produces zero code
  * if there are no side-effects and the compiler can optimized it away.
+ * All other helpers do not evaluate their parameters if the message is
+ * filtered, so don't rely on side-effects in log-arguments.
  */
 
 #ifdef BUILD_ENABLE_DEBUG
@@ -0,0 +1,110 @@
+/*
+ * SHL - Multi-Producer Single-Consumer Queue
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Multi-Producer Single-Consumer Queue
+ * The wake-up protocol uses q->pending as a flag. Producers set it after
+ * pushing and write the eventfd only if it was not set before. The consumer
+ * clears it _before_ draining. Hence, a producer that saw the flag set has
+ * pushed before the flag was cleared and its node is picked up by the drain
+ * that follows; a producer that saw it cleared writes the eventfd again.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "shl_macro.h"
+#include "shl_mpsc.h"
+
+void shl_mpsc_push(struct shl_mpsc *q, struct shl_mpsc_node *n)
+{
+	uint64_t v = 1;
+	ssize_t l;
+
+	shl_mpsc__push(q, n);
+
+	if (q->fd < 0 || __atomic_exchange_n(&q->pending, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	/* this cannot fail with a valid eventfd unless the counter overflows,
+	 * which cannot happen as we write at most once per dispatch */
+	l = write(q->fd, &v, sizeof(v));
+	(void)l;
+}
+
+size_t shl_mpsc_drain(struct shl_mpsc *q,
+		      void (*cb) (struct shl_mpsc_node *n, void *ctx),
+		      void *ctx)
+{
+	struct shl_mpsc_node *n, *last;
+	size_t num = 0;
+	bool busy;
+
+	/* Drain up to the node that is currently the last one. This might be
+	 * the stub, which pop skips, so stop once it reached the front. */
+	last = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		if (last == &q->stub && q->tail == &q->stub)
+			break;
+
+		n = shl_mpsc__pop(q, &busy);
+		if (!n) {
+			/* a producer got preempted between its two stores */
+			sched_yield();
+			continue;
+		}
+
+		++num;
+		if (cb)
+			cb(n, ctx);
+		if (n == last)
+			break;
+	}
+
+	return num;
+}
+
+int shl_mpsc_init_fd(struct shl_mpsc *q)
+{
+	int fd;
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0)
+		return -errno;
+
+	q->fd = fd;
+	return fd;
+}
+
+void shl_mpsc_deinit(struct shl_mpsc *q)
+{
+	if (q->fd >= 0) {
+		close(q->fd);
+		q->fd = -1;
+	}
+}
+
+ssize_t shl_mpsc_dispatch(struct shl_mpsc *q,
+			  void (*cb) (struct shl_mpsc_node *n, void *ctx),
+			  void *ctx)
+{
+	uint64_t v;
+	ssize_t l;
+
+	l = read(q->fd, &v, sizeof(v));
+	if (l < 0 && errno != EAGAIN && errno != EINTR)
+		return -errno;
+
+	__atomic_store_n(&q->pending, 0, __ATOMIC_SEQ_CST);
+
+	return shl_mpsc_drain(q, cb, ctx);
+}
@@ -0,0 +1,161 @@
+/*
+ * SHL - Multi-Producer Single-Consumer Queue
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Multi-Producer Single-Consumer Queue
+ * This is an intrusive, lock-free FIFO queue based on Dmitry Vyukov's
+ * non-intrusive MPSC node-based queue. Like shl_dlist, objects embed a
+ * "struct shl_mpsc_node" and you get them back via shl_mpsc_entry().
+ *
+ * Any number of threads may call shl_mpsc_push() concurrently. A push is a
+ * single atomic exchange plus a store, it never blocks and never fails. Only a
+ * single thread may pop from the queue at a time.
+ *
+ * A push is not visible to the consumer until the producer finished its
+ * second store. shl_mpsc_pop() returns NULL in that short window, so do not
+ * treat NULL as "queue is empty". shl_mpsc_drain() waits for such producers
+ * and is what you usually want.
+ *
+ * For use in epoll-loops, shl_mpsc_init_fd() attaches an eventfd to the queue.
+ * Producers write to it only on the transition from "no wake-up pending" to
+ * "wake-up pending", so a burst of pushes costs a single write(). Call
+ * shl_mpsc_dispatch() whenever the fd is readable.
+ */
+
+#ifndef SHL_MPSC_H
+#define SHL_MPSC_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "shl_macro.h"
+
+struct shl_mpsc_node {
+	struct shl_mpsc_node *next;
+};
+
+struct shl_mpsc {
+	struct shl_mpsc_node *head;	/* last pushed node, shared */
+	struct shl_mpsc_node *tail;	/* next node to pop, consumer only */
+	struct shl_mpsc_node stub;
+	int fd;
+	int pending;
+};
+
+#define shl_mpsc_entry(ptr, type, member) \
+	shl_container_of((ptr), type, member)
+
+static inline void shl_mpsc_init(struct shl_mpsc *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+	q->fd = -1;
+	q->pending = 0;
+}
+
+static inline void shl_mpsc__push(struct shl_mpsc *q, struct shl_mpsc_node *n)
+{
+	struct shl_mpsc_node *prev;
+
+	n->next = NULL;
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	/* consumer sees @n only after this store, see shl_mpsc_pop() */
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/* pop the oldest node; returns NULL with @busy set if a push is in flight */
+static inline struct shl_mpsc_node *shl_mpsc__pop(struct shl_mpsc *q,
+						  bool *busy)
+{
+	struct shl_mpsc_node *tail = q->tail, *next;
+
+	*busy = false;
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next) {
+			*busy = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) !=
+				tail;
+			return NULL;
+		}
+
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* @tail is the last linked node; if head moved, a producer is
+	 * between its exchange and its store */
+	if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != tail) {
+		*busy = true;
+		return NULL;
+	}
+
+	/* re-insert the stub so @tail gets a successor and can be popped */
+	shl_mpsc__push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	*busy = true;
+	return NULL;
+}
+
+/* Push @n to the end of @q. Safe against concurrent pushes. */
+void shl_mpsc_push(struct shl_mpsc *q, struct shl_mpsc_node *n);
+
+/*
+ * Pop the oldest node off @q. Returns NULL if the queue is empty or if the
+ * oldest node is still being pushed. Consumer only.
+ */
+static inline struct shl_mpsc_node *shl_mpsc_pop(struct shl_mpsc *q)
+{
+	bool busy;
+
+	return shl_mpsc__pop(q, &busy);
+}
+
+/*
+ * Pop all nodes off @q in FIFO order and call @cb for each. Unlike
+ * shl_mpsc_pop(), this waits for producers that are in the middle of a push.
+ * Only nodes pushed before this call are handled; nodes pushed meanwhile,
+ * including from within @cb, are left for the next call. Returns the number of
+ * nodes handled. Consumer only.
+ */
+size_t shl_mpsc_drain(struct shl_mpsc *q,
+		      void (*cb) (struct shl_mpsc_node *n, void *ctx),
+		      void *ctx);
+
+/*
+ * Attach an eventfd to @q for wake-ups. Call this after shl_mpsc_init() and
+ * before any push. Returns the fd on success, a negative error code on
+ * failure. shl_mpsc_deinit() closes it again.
+ */
+int shl_mpsc_init_fd(struct shl_mpsc *q);
+void shl_mpsc_deinit(struct shl_mpsc *q);
+
+/*
+ * Clear the eventfd of @q and drain the queue into @cb. Call this whenever the
+ * fd is readable. Returns the number of handled nodes or a negative error code
+ * if the eventfd could not be read. Consumer only.
+ */
+ssize_t shl_mpsc_dispatch(struct shl_mpsc *q,
+			  void (*cb) (struct shl_mpsc_node *n, void *ctx),
+			  void *ctx);
+
+#endif /* SHL_MPSC_H */
@@ -0,0 +1,367 @@
+/*
+ * SHL - Red-Black Tree
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Red-Black Tree
+ * Classic bottom-up red-black tree with parent pointers. NULL children are the
+ * black leaves. The node color is stored in the two low bits of the parent
+ * pointer; zero means "unlinked" so zeroed nodes need no initialization.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "shl_macro.h"
+#include "shl_rbtree.h"
+
+static inline bool shl_rbnode_red(struct shl_rbnode *n)
+{
+	return n && (n->__parent & SHL_RBNODE_RED);
+}
+
+static inline bool shl_rbnode_black(struct shl_rbnode *n)
+{
+	return !shl_rbnode_red(n);
+}
+
+static inline void shl_rbnode_set(struct shl_rbnode *n, struct shl_rbnode *p,
+				  uintptr_t color)
+{
+	n->__parent = (uintptr_t)p | color;
+}
+
+static inline void shl_rbnode_set_parent(struct shl_rbnode *n,
+					 struct shl_rbnode *p)
+{
+	shl_rbnode_set(n, p, n->__parent & SHL_RBNODE_MASK);
+}
+
+static inline void shl_rbnode_set_color(struct shl_rbnode *n, uintptr_t color)
+{
+	shl_rbnode_set(n, shl_rbnode_parent(n), color);
+}
+
+/* replace @old by @new in the child-slot of @parent (or the root) */
+static inline void shl_rbtree_replace(struct shl_rbtree *tree,
+				      struct shl_rbnode *parent,
+				      struct shl_rbnode *old,
+				      struct shl_rbnode *new)
+{
+	if (!parent)
+		tree->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static void shl_rbtree_rotate_left(struct shl_rbtree *tree,
+				   struct shl_rbnode *n)
+{
+	struct shl_rbnode *r = n->right, *p = shl_rbnode_parent(n);
+
+	n->right = r->left;
+	if (r->left)
+		shl_rbnode_set_parent(r->left, n);
+
+	shl_rbnode_set_parent(r, p);
+	shl_rbtree_replace(tree, p, n, r);
+
+	r->left = n;
+	shl_rbnode_set_parent(n, r);
+}
+
+static void shl_rbtree_rotate_right(struct shl_rbtree *tree,
+				    struct shl_rbnode *n)
+{
+	struct shl_rbnode *l = n->left, *p = shl_rbnode_parent(n);
+
+	n->left = l->right;
+	if (l->right)
+		shl_rbnode_set_parent(l->right, n);
+
+	shl_rbnode_set_parent(l, p);
+	shl_rbtree_replace(tree, p, n, l);
+
+	l->right = n;
+	shl_rbnode_set_parent(n, l);
+}
+
+void shl_rbtree_link(struct shl_rbtree *tree, struct shl_rbnode *n,
+		     struct shl_rbnode *parent, struct shl_rbnode **slot)
+{
+	struct shl_rbnode *gparent, *uncle;
+
+	n->left = NULL;
+	n->right = NULL;
+	shl_rbnode_set(n, parent, SHL_RBNODE_RED);
+	*slot = n;
+
+	while ((parent = shl_rbnode_parent(n)) && shl_rbnode_red(parent)) {
+		/* a red parent is never the root, so @gparent exists */
+		gparent = shl_rbnode_parent(parent);
+
+		if (parent == gparent->left) {
+			uncle = gparent->right;
+			if (shl_rbnode_red(uncle)) {
+				shl_rbnode_set_color(parent, SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(uncle, SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(gparent, SHL_RBNODE_RED);
+				n = gparent;
+				continue;
+			}
+
+			if (n == parent->right) {
+				shl_rbtree_rotate_left(tree, parent);
+				n = parent;
+				parent = shl_rbnode_parent(n);
+			}
+
+			shl_rbnode_set_color(parent, SHL_RBNODE_BLACK);
+			shl_rbnode_set_color(gparent, SHL_RBNODE_RED);
+			shl_rbtree_rotate_right(tree, gparent);
+		} else {
+			uncle = gparent->left;
+			if (shl_rbnode_red(uncle)) {
+				shl_rbnode_set_color(parent, SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(uncle, SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(gparent, SHL_RBNODE_RED);
+				n = gparent;
+				continue;
+			}
+
+			if (n == parent->left) {
+				shl_rbtree_rotate_right(tree, parent);
+				n = parent;
+				parent = shl_rbnode_parent(n);
+			}
+
+			shl_rbnode_set_color(parent, SHL_RBNODE_BLACK);
+			shl_rbnode_set_color(gparent, SHL_RBNODE_RED);
+			shl_rbtree_rotate_left(tree, gparent);
+		}
+	}
+
+	shl_rbnode_set_color(tree->root, SHL_RBNODE_BLACK);
+}
+
+void shl_rbtree_insert(struct shl_rbtree *tree, struct shl_rbnode *n,
+		       shl_rbtree_cmp_t cmp)
+{
+	struct shl_rbnode **slot = &tree->root, *parent = NULL;
+
+	while (*slot) {
+		parent = *slot;
+		if (cmp(n, parent) < 0)
+			slot = &parent->left;
+		else
+			slot = &parent->right;
+	}
+
+	shl_rbtree_link(tree, n, parent, slot);
+}
+
+int shl_rbtree_insert_unique(struct shl_rbtree *tree, struct shl_rbnode *n,
+			     shl_rbtree_cmp_t cmp, struct shl_rbnode **out)
+{
+	struct shl_rbnode **slot = &tree->root, *parent = NULL;
+	int r;
+
+	while (*slot) {
+		parent = *slot;
+		r = cmp(n, parent);
+		if (r < 0) {
+			slot = &parent->left;
+		} else if (r > 0) {
+			slot = &parent->right;
+		} else {
+			if (out)
+				*out = parent;
+			return -EALREADY;
+		}
+	}
+
+	shl_rbtree_link(tree, n, parent, slot);
+	return 0;
+}
+
+static void shl_rbtree_remove_fixup(struct shl_rbtree *tree,
+				    struct shl_rbnode *n,
+				    struct shl_rbnode *parent)
+{
+	struct shl_rbnode *sibling;
+
+	/* @n carries an extra black; @parent is valid even if @n is NULL */
+	while (n != tree->root && shl_rbnode_black(n)) {
+		if (n == parent->left) {
+			sibling = parent->right;
+			if (shl_rbnode_red(sibling)) {
+				shl_rbnode_set_color(sibling, SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(parent, SHL_RBNODE_RED);
+				shl_rbtree_rotate_left(tree, parent);
+				sibling = parent->right;
+			}
+
+			if (shl_rbnode_black(sibling->left) &&
+			    shl_rbnode_black(sibling->right)) {
+				shl_rbnode_set_color(sibling, SHL_RBNODE_RED);
+				n = parent;
+				parent = shl_rbnode_parent(n);
+				continue;
+			}
+
+			if (shl_rbnode_black(sibling->right)) {
+				shl_rbnode_set_color(sibling->left,
+						     SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(sibling, SHL_RBNODE_RED);
+				shl_rbtree_rotate_right(tree, sibling);
+				sibling = parent->right;
+			}
+
+			shl_rbnode_set_color(sibling,
+					     parent->__parent & SHL_RBNODE_MASK);
+			shl_rbnode_set_color(parent, SHL_RBNODE_BLACK);
+			shl_rbnode_set_color(sibling->right, SHL_RBNODE_BLACK);
+			shl_rbtree_rotate_left(tree, parent);
+		} else {
+			sibling = parent->left;
+			if (shl_rbnode_red(sibling)) {
+				shl_rbnode_set_color(sibling, SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(parent, SHL_RBNODE_RED);
+				shl_rbtree_rotate_right(tree, parent);
+				sibling = parent->left;
+			}
+
+			if (shl_rbnode_black(sibling->left) &&
+			    shl_rbnode_black(sibling->right)) {
+				shl_rbnode_set_color(sibling, SHL_RBNODE_RED);
+				n = parent;
+				parent = shl_rbnode_parent(n);
+				continue;
+			}
+
+			if (shl_rbnode_black(sibling->left)) {
+				shl_rbnode_set_color(sibling->right,
+						     SHL_RBNODE_BLACK);
+				shl_rbnode_set_color(sibling, SHL_RBNODE_RED);
+				shl_rbtree_rotate_left(tree, sibling);
+				sibling = parent->left;
+			}
+
+			shl_rbnode_set_color(sibling,
+					     parent->__parent & SHL_RBNODE_MASK);
+			shl_rbnode_set_color(parent, SHL_RBNODE_BLACK);
+			shl_rbnode_set_color(sibling->left, SHL_RBNODE_BLACK);
+			shl_rbtree_rotate_right(tree, parent);
+		}
+
+		n = tree->root;
+		break;
+	}
+
+	if (n)
+		shl_rbnode_set_color(n, SHL_RBNODE_BLACK);
+}
+
+void shl_rbtree_remove(struct shl_rbtree *tree, struct shl_rbnode *n)
+{
+	struct shl_rbnode *child, *parent, *next;
+	bool black;
+
+	if (!n->left || !n->right) {
+		child = n->left ? n->left : n->right;
+		parent = shl_rbnode_parent(n);
+		black = shl_rbnode_black(n);
+
+		if (child)
+			shl_rbnode_set_parent(child, parent);
+		shl_rbtree_replace(tree, parent, n, child);
+	} else {
+		/* move the successor into the position of @n */
+		next = n->right;
+		while (next->left)
+			next = next->left;
+
+		child = next->right;
+		black = shl_rbnode_black(next);
+
+		if (shl_rbnode_parent(next) == n) {
+			parent = next;
+		} else {
+			parent = shl_rbnode_parent(next);
+			parent->left = child;
+			if (child)
+				shl_rbnode_set_parent(child, parent);
+
+			next->right = n->right;
+			shl_rbnode_set_parent(n->right, next);
+		}
+
+		next->left = n->left;
+		shl_rbnode_set_parent(n->left, next);
+
+		shl_rbtree_replace(tree, shl_rbnode_parent(n), n, next);
+		next->__parent = n->__parent;
+	}
+
+	n->__parent = 0;
+	n->left = NULL;
+	n->right = NULL;
+
+	if (black)
+		shl_rbtree_remove_fixup(tree, child, parent);
+}
+
+struct shl_rbnode *shl_rbtree_lower_bound(struct shl_rbtree *tree,
+					  const void *key,
+					  shl_rbtree_key_cmp_t cmp)
+{
+	struct shl_rbnode *n = tree->root, *res = NULL;
+
+	while (n) {
+		if (cmp(key, n) <= 0) {
+			res = n;
+			n = n->left;
+		} else {
+			n = n->right;
+		}
+	}
+
+	return res;
+}
+
+struct shl_rbnode *shl_rbtree_upper_bound(struct shl_rbtree *tree,
+					  const void *key,
+					  shl_rbtree_key_cmp_t cmp)
+{
+	struct shl_rbnode *n = tree->root, *res = NULL;
+
+	while (n) {
+		if (cmp(key, n) < 0) {
+			res = n;
+			n = n->left;
+		} else {
+			n = n->right;
+		}
+	}
+
+	return res;
+}
+
+struct shl_rbnode *shl_rbtree_find(struct shl_rbtree *tree, const void *key,
+				   shl_rbtree_key_cmp_t cmp)
+{
+	struct shl_rbnode *n;
+
+	n = shl_rbtree_lower_bound(tree, key, cmp);
+	if (n && !cmp(key, n))
+		return n;
+
+	return NULL;
+}
@@ -0,0 +1,201 @@
+/*
+ * SHL - Red-Black Tree
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Red-Black Tree
+ * This is an intrusive, ordered container. Like shl_dlist, objects embed a
+ * "struct shl_rbnode" and you get the object back via shl_rbtree_entry(). The
+ * tree never allocates memory, so insertion and removal cannot fail.
+ *
+ * Unlike a sorted shl_dlist, insertion, removal and seeking are O(log n).
+ * Ordering is defined by a comparison callback that you pass to each operation
+ * that needs it. Equal nodes are allowed; they are kept in insertion order.
+ * Use shl_rbtree_insert_unique() if duplicates must be rejected.
+ *
+ * Zeroed nodes are treated as unlinked. Removed nodes are reset to zero so you
+ * can use shl_rbnode_linked() just like shl_dlist_linked().
+ */
+
+#ifndef SHL_RBTREE_H
+#define SHL_RBTREE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "shl_macro.h"
+
+/* red-black tree */
+
+struct shl_rbnode {
+	uintptr_t __parent;	/* parent pointer plus color bits */
+	struct shl_rbnode *left;
+	struct shl_rbnode *right;
+};
+
+struct shl_rbtree {
+	struct shl_rbnode *root;
+};
+
+#define SHL_RBTREE_INIT { NULL }
+
+#define SHL_RBNODE_RED 1UL
+#define SHL_RBNODE_BLACK 2UL
+#define SHL_RBNODE_MASK 3UL
+
+/* compare two linked nodes, returns <0, 0 or >0 like strcmp() */
+typedef int (*shl_rbtree_cmp_t) (const struct shl_rbnode *a,
+				 const struct shl_rbnode *b);
+
+/* compare a search-key with a node, returns <0, 0 or >0 like strcmp() */
+typedef int (*shl_rbtree_key_cmp_t) (const void *key,
+				     const struct shl_rbnode *n);
+
+static inline void shl_rbtree_init(struct shl_rbtree *tree)
+{
+	tree->root = NULL;
+}
+
+static inline bool shl_rbtree_empty(struct shl_rbtree *tree)
+{
+	return !tree->root;
+}
+
+static inline bool shl_rbnode_linked(struct shl_rbnode *n)
+{
+	return n->__parent & SHL_RBNODE_MASK;
+}
+
+static inline struct shl_rbnode *shl_rbnode_parent(struct shl_rbnode *n)
+{
+	return (struct shl_rbnode*)(n->__parent & ~SHL_RBNODE_MASK);
+}
+
+static inline struct shl_rbnode *shl_rbtree_first(struct shl_rbtree *tree)
+{
+	struct shl_rbnode *n = tree->root;
+
+	if (n)
+		while (n->left)
+			n = n->left;
+
+	return n;
+}
+
+static inline struct shl_rbnode *shl_rbtree_last(struct shl_rbtree *tree)
+{
+	struct shl_rbnode *n = tree->root;
+
+	if (n)
+		while (n->right)
+			n = n->right;
+
+	return n;
+}
+
+/* return in-order successor of @n or NULL */
+static inline struct shl_rbnode *shl_rbnode_next(struct shl_rbnode *n)
+{
+	struct shl_rbnode *p;
+
+	if (n->right) {
+		n = n->right;
+		while (n->left)
+			n = n->left;
+		return n;
+	}
+
+	while ((p = shl_rbnode_parent(n)) && n == p->right)
+		n = p;
+
+	return p;
+}
+
+/* return in-order predecessor of @n or NULL */
+static inline struct shl_rbnode *shl_rbnode_prev(struct shl_rbnode *n)
+{
+	struct shl_rbnode *p;
+
+	if (n->left) {
+		n = n->left;
+		while (n->right)
+			n = n->right;
+		return n;
+	}
+
+	while ((p = shl_rbnode_parent(n)) && n == p->left)
+		n = p;
+
+	return p;
+}
+
+/*
+ * Link @n into @tree as child of @parent at @slot and rebalance. @slot must be
+ * &parent->left or &parent->right (or &tree->root if @parent is NULL) and must
+ * be empty. This is the low-level helper behind shl_rbtree_insert(); use it if
+ * you need to do the descent yourself, for instance to avoid callbacks.
+ */
+void shl_rbtree_link(struct shl_rbtree *tree, struct shl_rbnode *n,
+		     struct shl_rbnode *parent, struct shl_rbnode **slot);
+
+/* insert @n; equal nodes are placed behind existing ones */
+void shl_rbtree_insert(struct shl_rbtree *tree, struct shl_rbnode *n,
+		       shl_rbtree_cmp_t cmp);
+
+/* insert @n unless an equal node exists; -EALREADY and @out are set then */
+int shl_rbtree_insert_unique(struct shl_rbtree *tree, struct shl_rbnode *n,
+			     shl_rbtree_cmp_t cmp, struct shl_rbnode **out);
+
+/* unlink @n from @tree and reset it to zero; @n must be linked in @tree */
+void shl_rbtree_remove(struct shl_rbtree *tree, struct shl_rbnode *n);
+
+/* return first node equal to @key or NULL */
+struct shl_rbnode *shl_rbtree_find(struct shl_rbtree *tree, const void *key,
+				   shl_rbtree_key_cmp_t cmp);
+
+/* return first node not less than @key or NULL */
+struct shl_rbnode *shl_rbtree_lower_bound(struct shl_rbtree *tree,
+					  const void *key,
+					  shl_rbtree_key_cmp_t cmp);
+
+/* return first node greater than @key or NULL */
+struct shl_rbnode *shl_rbtree_upper_bound(struct shl_rbtree *tree,
+					  const void *key,
+					  shl_rbtree_key_cmp_t cmp);
+
+#define shl_rbtree_entry(ptr, type, member) \
+	shl_container_of((ptr), type, member)
+
+#define shl_rbtree_first_entry(tree, type, member) \
+	shl_rbtree_entry(shl_rbtree_first(tree), type, member)
+
+#define shl_rbtree_last_entry(tree, type, member) \
+	shl_rbtree_entry(shl_rbtree_last(tree), type, member)
+
+#define shl_rbtree_for_each(iter, tree) \
+	for (iter = shl_rbtree_first(tree); iter; iter = shl_rbnode_next(iter))
+
+#define shl_rbtree_for_each_from(iter, start) \
+	for (iter = (start); iter; iter = shl_rbnode_next(iter))
+
+#define shl_rbtree_for_each_safe(iter, tmp, tree) \
+	for (iter = shl_rbtree_first(tree), \
+		tmp = iter ? shl_rbnode_next(iter) : NULL; \
+	     iter; \
+	     iter = tmp, tmp = iter ? shl_rbnode_next(iter) : NULL)
+
+#define shl_rbtree_for_each_reverse(iter, tree) \
+	for (iter = shl_rbtree_last(tree); iter; iter = shl_rbnode_prev(iter))
+
+#define shl_rbtree_for_each_reverse_safe(iter, tmp, tree) \
+	for (iter = shl_rbtree_last(tree), \
+		tmp = iter ? shl_rbnode_prev(iter) : NULL; \
+	     iter; \
+	     iter = tmp, tmp = iter ? shl_rbnode_prev(iter) : NULL)
+
+#endif /* SHL_RBTREE_H */
@@ -0,0 +1,341 @@
+/*
+ * SHL - Timer Wheel
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Timer Wheel
+ * The wheel has SHL_TIMER_LEVELS levels of 64 buckets each. Level 0 buckets
+ * cover one tick each, level 1 buckets 64 ticks, level 2 buckets 4096 ticks
+ * and so on. A timer is put on the lowest level that can represent its
+ * distance to the current tick. Whenever the current tick crosses the start of
+ * a non-empty higher-level bucket, the bucket is cascaded, that is, its timers
+ * are re-inserted relative to the new tick and thus move down the levels.
+ * Timers further away than the top level can represent are parked in the top
+ * level and re-inserted when it cascades.
+ *
+ * Each level keeps a 64bit bitmap of non-empty buckets. This lets us find the
+ * next tick we have to wake up for in O(levels), so we can skip idle periods
+ * instead of walking them tick by tick and can program the timerfd for exactly
+ * that tick.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "shl_dlist.h"
+#include "shl_macro.h"
+#include "shl_timer.h"
+#include "shl_util.h"
+
+#define SHL_TIMER_BITS 6
+#define SHL_TIMER_SLOTS (1U << SHL_TIMER_BITS)
+#define SHL_TIMER_MASK (SHL_TIMER_SLOTS - 1)
+#define SHL_TIMER_LEVELS 5
+#define SHL_TIMER_RANGE (1ULL << (SHL_TIMER_BITS * SHL_TIMER_LEVELS))
+#define SHL_TIMER_DEFAULT_TICK 1000ULL
+
+struct shl_timer_wheel {
+	int fd;
+	uint64_t tick;			/* tick length in usecs */
+	uint64_t now;			/* next tick to process */
+	uint64_t armed;			/* tick the timerfd is armed for */
+	unsigned int dispatching : 1;
+	uint64_t used[SHL_TIMER_LEVELS];
+	struct shl_dlist buckets[SHL_TIMER_LEVELS][SHL_TIMER_SLOTS];
+};
+
+static inline unsigned int shl_timer_shift(unsigned int level)
+{
+	return level * SHL_TIMER_BITS;
+}
+
+static inline uint64_t shl_timer_rotr(uint64_t v, unsigned int n)
+{
+	n &= 63;
+	return n ? (v >> n) | (v << (64 - n)) : v;
+}
+
+static uint64_t shl_timer_to_tick(struct shl_timer_wheel *w, uint64_t usecs)
+{
+	/* round up, timers must never fire early */
+	return usecs / w->tick + !!(usecs % w->tick);
+}
+
+static void shl_timer_place(struct shl_timer_wheel *w,
+			    struct shl_timer *timer)
+{
+	unsigned int level, slot;
+	uint64_t t, delta;
+
+	t = shl_timer_to_tick(w, timer->expires);
+	if (t < w->now)
+		t = w->now;
+
+	delta = t - w->now;
+	if (delta >= SHL_TIMER_RANGE) {
+		t = w->now + SHL_TIMER_RANGE - 1;
+		delta = SHL_TIMER_RANGE - 1;
+	}
+
+	for (level = 0; level < SHL_TIMER_LEVELS - 1; ++level)
+		if (delta < (1ULL << shl_timer_shift(level + 1)))
+			break;
+
+	slot = (t >> shl_timer_shift(level)) & SHL_TIMER_MASK;
+	shl_dlist_link_tail(&w->buckets[level][slot], &timer->list);
+	w->used[level] |= 1ULL << slot;
+	timer->slot = level * SHL_TIMER_SLOTS + slot;
+}
+
+static void shl_timer_unlink(struct shl_timer_wheel *w,
+			     struct shl_timer *timer)
+{
+	unsigned int level, slot;
+
+	level = timer->slot / SHL_TIMER_SLOTS;
+	slot = timer->slot % SHL_TIMER_SLOTS;
+
+	shl_dlist_unlink(&timer->list);
+	if (shl_dlist_empty(&w->buckets[level][slot]))
+		w->used[level] &= ~(1ULL << slot);
+}
+
+/* move all timers of a bucket to @to, which must be uninitialized */
+static void shl_timer_splice(struct shl_timer_wheel *w, unsigned int level,
+			     unsigned int slot, struct shl_dlist *to)
+{
+	struct shl_dlist *b = &w->buckets[level][slot];
+
+	shl_dlist_init(to);
+	if (!shl_dlist_empty(b)) {
+		to->next = b->next;
+		to->prev = b->prev;
+		to->next->prev = to;
+		to->prev->next = to;
+		shl_dlist_init(b);
+	}
+
+	w->used[level] &= ~(1ULL << slot);
+}
+
+/* return the next tick that has to be processed or UINT64_MAX if empty */
+static uint64_t shl_timer_next(struct shl_timer_wheel *w)
+{
+	unsigned int level, shift;
+	uint64_t r, t, next = UINT64_MAX;
+
+	if (w->used[0]) {
+		r = shl_timer_rotr(w->used[0], w->now);
+		next = w->now + __builtin_ctzll(r);
+	}
+
+	/* Higher level buckets are cascaded when their first tick is
+	 * processed, so start at the first bucket that begins at or after the
+	 * current tick and wake up at the start of the first used one. */
+	for (level = 1; level < SHL_TIMER_LEVELS; ++level) {
+		if (!w->used[level])
+			continue;
+
+		shift = shl_timer_shift(level);
+		t = (w->now + (1ULL << shift) - 1) >> shift;
+		r = shl_timer_rotr(w->used[level], t);
+		t = (t + __builtin_ctzll(r)) << shift;
+		if (t < next)
+			next = t;
+	}
+
+	return next;
+}
+
+static void shl_timer_cascade(struct shl_timer_wheel *w, unsigned int level,
+			      unsigned int slot)
+{
+	struct shl_dlist list;
+	struct shl_timer *timer;
+
+	shl_timer_splice(w, level, slot, &list);
+	while (!shl_dlist_empty(&list)) {
+		timer = shl_dlist_first_entry(&list, struct shl_timer, list);
+		shl_dlist_unlink(&timer->list);
+		shl_timer_place(w, timer);
+	}
+}
+
+static int shl_timer_rearm(struct shl_timer_wheel *w)
+{
+	struct itimerspec its;
+	uint64_t next, usecs;
+	int r;
+
+	next = shl_timer_next(w);
+	if (next == w->armed)
+		return 0;
+
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		usecs = next * w->tick;
+		its.it_value.tv_sec = usecs / 1000000ULL;
+		its.it_value.tv_nsec = (usecs % 1000000ULL) * 1000ULL;
+		/* a zero timespec disarms the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	r = timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL);
+	if (r < 0)
+		return -errno;
+
+	w->armed = next;
+	return 0;
+}
+
+int shl_timer_wheel_new(struct shl_timer_wheel **out, uint64_t tick_usec)
+{
+	struct shl_timer_wheel *w;
+	unsigned int level, slot;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	w->tick = tick_usec ? : SHL_TIMER_DEFAULT_TICK;
+	w->now = shl_now(CLOCK_MONOTONIC) / w->tick;
+	w->armed = UINT64_MAX;
+
+	for (level = 0; level < SHL_TIMER_LEVELS; ++level)
+		for (slot = 0; slot < SHL_TIMER_SLOTS; ++slot)
+			shl_dlist_init(&w->buckets[level][slot]);
+
+	w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd < 0) {
+		free(w);
+		return -errno;
+	}
+
+	*out = w;
+	return w->fd;
+}
+
+void shl_timer_wheel_free(struct shl_timer_wheel *w)
+{
+	unsigned int level, slot;
+	struct shl_dlist *b;
+
+	if (!w)
+		return;
+
+	/* reset timers so shl_timer_armed() stays valid for them */
+	for (level = 0; level < SHL_TIMER_LEVELS; ++level) {
+		for (slot = 0; slot < SHL_TIMER_SLOTS; ++slot) {
+			b = &w->buckets[level][slot];
+			while (!shl_dlist_empty(b))
+				shl_dlist_unlink(b->next);
+		}
+	}
+
+	close(w->fd);
+	free(w);
+}
+
+int shl_timer_wheel_get_fd(struct shl_timer_wheel *w)
+{
+	return w->fd;
+}
+
+int shl_timer_wheel_dispatch(struct shl_timer_wheel *w)
+{
+	struct shl_dlist list;
+	struct shl_timer *timer;
+	unsigned int level, slot;
+	uint64_t target, next, expirations;
+	ssize_t l;
+
+	/* we don't care about the expiration count, just clear it */
+	l = read(w->fd, &expirations, sizeof(expirations));
+	if (l < 0 && errno != EAGAIN && errno != EINTR)
+		return -errno;
+
+	w->armed = UINT64_MAX;
+	w->dispatching = 1;
+	target = shl_now(CLOCK_MONOTONIC) / w->tick;
+
+	while (w->now <= target) {
+		next = shl_timer_next(w);
+		if (next > target) {
+			w->now = target + 1;
+			break;
+		}
+
+		w->now = next;
+
+		/* cascade top-down, so timers can move multiple levels */
+		for (level = SHL_TIMER_LEVELS - 1; level > 0; --level) {
+			if (next & ((1ULL << shl_timer_shift(level)) - 1))
+				continue;
+
+			slot = (next >> shl_timer_shift(level)) & SHL_TIMER_MASK;
+			if (w->used[level] & (1ULL << slot))
+				shl_timer_cascade(w, level, slot);
+		}
+
+		/* Advance before running callbacks, so timers re-armed to the
+		 * past end up in the next tick instead of this one. */
+		shl_timer_splice(w, 0, next & SHL_TIMER_MASK, &list);
+		w->now = next + 1;
+
+		while (!shl_dlist_empty(&list)) {
+			timer = shl_dlist_first_entry(&list, struct shl_timer,
+						      list);
+			shl_dlist_unlink(&timer->list);
+			if (timer->cb)
+				timer->cb(timer, timer->data);
+		}
+	}
+
+	w->dispatching = 0;
+	return shl_timer_rearm(w);
+}
+
+int shl_timer_arm(struct shl_timer_wheel *w, struct shl_timer *timer,
+		  uint64_t expires)
+{
+	if (shl_timer_armed(timer))
+		shl_timer_unlink(w, timer);
+
+	timer->expires = expires;
+	shl_timer_place(w, timer);
+
+	/* the dispatcher rearms the timerfd once it is done */
+	if (w->dispatching || shl_timer_to_tick(w, expires) >= w->armed)
+		return 0;
+
+	return shl_timer_rearm(w);
+}
+
+int shl_timer_arm_rel(struct shl_timer_wheel *w, struct shl_timer *timer,
+		      uint64_t usecs)
+{
+	uint64_t now;
+
+	now = shl_now(CLOCK_MONOTONIC);
+	if (usecs > UINT64_MAX - now)
+		usecs = UINT64_MAX - now;
+
+	return shl_timer_arm(w, timer, now + usecs);
+}
+
+void shl_timer_cancel(struct shl_timer_wheel *w, struct shl_timer *timer)
+{
+	/* The timerfd is left untouched, the spurious wake-up is cheaper
+	 * than reprogramming it for each cancellation. */
+	if (shl_timer_armed(timer))
+		shl_timer_unlink(w, timer);
+}
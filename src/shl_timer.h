@@ -0,0 +1,104 @@
+/*
+ * SHL - Timer Wheel
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain
+ */
+
+/*
+ * Timer Wheel
+ * A hierarchical timer wheel that multiplexes an arbitrary number of timers
+ * onto a single timerfd. Timers are intrusive: embed "struct shl_timer" in
+ * your object and get it back via shl_timer_entry() in the callback. Timers
+ * are linked into shl_dlist buckets, so arming and canceling a timer is O(1)
+ * and never allocates.
+ *
+ * Time is measured in usecs of CLOCK_MONOTONIC, as returned by
+ * shl_now(CLOCK_MONOTONIC). The wheel rounds expiration times up to its tick
+ * (1ms by default), so timers never fire early but may fire up to one tick
+ * late.
+ *
+ * shl_timer_wheel_new() returns a file-descriptor. Whenever it is readable,
+ * call shl_timer_wheel_dispatch() to run all expired timers.
+ */
+
+#ifndef SHL_TIMER_H
+#define SHL_TIMER_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "shl_dlist.h"
+#include "shl_macro.h"
+
+struct shl_timer;
+struct shl_timer_wheel;
+
+typedef void (*shl_timer_cb) (struct shl_timer *timer, void *data);
+
+struct shl_timer {
+	struct shl_dlist list;
+	uint64_t expires;
+	unsigned int slot;
+	shl_timer_cb cb;
+	void *data;
+};
+
+#define shl_timer_entry(ptr, type, member) \
+	shl_container_of((ptr), type, member)
+
+/* initialize a timer; zeroed timers just lack a callback */
+static inline void shl_timer_init(struct shl_timer *timer, shl_timer_cb cb,
+				  void *data)
+{
+	timer->list.next = NULL;
+	timer->list.prev = NULL;
+	timer->expires = 0;
+	timer->slot = 0;
+	timer->cb = cb;
+	timer->data = data;
+}
+
+static inline bool shl_timer_armed(struct shl_timer *timer)
+{
+	return shl_dlist_linked(&timer->list);
+}
+
+/*
+ * Create a new timer wheel with a tick of @tick_usec usecs (0 selects the
+ * default of 1ms). Returns the file-descriptor of the wheel on success and
+ * stores the wheel in @out. Returns a negative error code on failure.
+ */
+int shl_timer_wheel_new(struct shl_timer_wheel **out, uint64_t tick_usec);
+
+/* Free the wheel and close its fd. Armed timers are silently dropped. */
+void shl_timer_wheel_free(struct shl_timer_wheel *w);
+
+int shl_timer_wheel_get_fd(struct shl_timer_wheel *w);
+
+/*
+ * Run all timers that expired. Call this whenever the wheel fd is readable.
+ * Timers are disarmed before their callback is run. Callbacks may arm and
+ * cancel any timer, including the one that is currently run. Timers that are
+ * re-armed to an already expired time run once per tick, so a callback
+ * re-arming its own timer cannot stall the dispatcher.
+ */
+int shl_timer_wheel_dispatch(struct shl_timer_wheel *w);
+
+/*
+ * Arm @timer to expire at @expires (absolute CLOCK_MONOTONIC usecs). If the
+ * timer is already armed, it is moved. This only touches the timerfd if the
+ * new timer expires before any other timer, and only this can fail.
+ */
+int shl_timer_arm(struct shl_timer_wheel *w, struct shl_timer *timer,
+		  uint64_t expires);
+
+/* same as shl_timer_arm() but relative to the current time */
+int shl_timer_arm_rel(struct shl_timer_wheel *w, struct shl_timer *timer,
+		      uint64_t usecs);
+
+/* Cancel @timer. This is a no-op if the timer is not armed. */
+void shl_timer_cancel(struct shl_timer_wheel *w, struct shl_timer *timer);
+
+#endif /* SHL_TIMER_H */
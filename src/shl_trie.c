@@ -33,18 +33,28 @@
  * ->otherbits is a bitmask with the most significant bit-position that differs
  * not set. So ->byte and ->otherbits can be used to identify the exact bit at
  * which the prefixes of the left and right trie start to differ.
+ *
+ * Keys are binary and may contain zero bytes. Their lengths are stored in the
+ * parent node next to the child pointer (or in the trie head for a root entry)
+ * so the final comparison is a plain length-check plus memcmp().
  */
 
 #include <errno.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "shl_trie.h"
 
+/* Keys are binary and their lengths are stored next to the child pointers.
+ * @lens[i] is only valid if @childs[i] is an entry. The length of a root-entry
+ * is stored in the trie head. Lengths and @byte are 32bit so a node stays at
+ * 32 bytes; keys are thus limited to UINT32_MAX bytes. */
 struct shl_trie_node {
 	void *childs[2];
-	size_t byte;
-	uint8_t otherbits;
+	uint32_t lens[2];
+	uint32_t byte;
+	uint16_t otherbits;
 };
 
 /* We use a struct to simplify iterations. But it must be equivalent to a
@@ -108,6 +118,18 @@ static inline struct shl_trie_entry *shl_trie_get_entry(void *ptr)
 	return (struct shl_trie_entry*)addr;
 }
 
+/* casts @ptr to the key-pointer the user inserted; caller must guarantee that
+ * @ptr is an entry. Use this instead of taking the address of the packed
+ * entry->key, the pointer the user passed in is properly aligned. */
+static inline uint8_t **shl_trie_get_key(void *ptr)
+{
+	unsigned long addr;
+
+	addr = (unsigned long)ptr;
+	addr &= ~(0x2UL);
+	return (uint8_t**)addr;
+}
+
 /* cast @node into a node pointer for use in trie objects */
 static inline void *shl_trie_make_node(struct shl_trie_node *node)
 {
@@ -158,6 +180,90 @@ static inline void *shl_trie_mark_visited(void *ptr)
 	return (void*)addr;
 }
 
+/*
+ * Keys are binary, so we cannot use a terminating zero to tell shorter keys
+ * apart from longer ones. Instead, each byte is extended to a 9-bit symbol
+ * with the 9th bit set as presence marker. Every key is followed by an
+ * infinite string of zero-symbols. Hence, shorter keys always sort before
+ * longer keys with the same prefix, and "a" differs from "a\0" in the
+ * presence-bit of the second symbol.
+ * Nodes store the crit-bit as 9-bit mask with only the critical bit _not_ set.
+ */
+static inline uint16_t shl_trie_sym(const uint8_t *key, size_t keylen,
+				    size_t byte)
+{
+	return (byte < keylen) ? (0x100 | key[byte]) : 0;
+}
+
+/* Get direction. (node->otherbits | c) is either a full 9bit mask or a mask
+ * with 1 bit unset. If we add 1 to a full mask, we get 0x200. If we add 1 to a
+ * mask with only 1 bit unset, we get at most 0x1ff. Hence, a right-shift will
+ * give us either 0 or 1, which is the direction we go to. */
+static inline unsigned int shl_trie_dir(const struct shl_trie_node *node,
+					const uint8_t *key, size_t keylen)
+{
+	uint16_t c;
+
+	c = shl_trie_sym(key, keylen, node->byte);
+	return (1 + (unsigned int)(node->otherbits | c)) >> 9;
+}
+
+/* Turn the first differing symbols at @byte of keys @a and @b into a 9-bit
+ * bitmask with only the most significant differing bit _not_ set. */
+static inline uint16_t shl_trie_otherbits(const uint8_t *a, size_t alen,
+					  const uint8_t *b, size_t blen,
+					  size_t byte)
+{
+	uint16_t x;
+
+	x = shl_trie_sym(a, alen, byte) ^ shl_trie_sym(b, blen, byte);
+	x |= x >> 1;
+	x |= x >> 2;
+	x |= x >> 4;
+	x |= x >> 8;
+	return (x & ~(x >> 1)) ^ 0x1ff;
+}
+
+/* Return the index of the first byte that differs between @a and @b, or @len
+ * if the first @len bytes are equal. Compares a word at a time. */
+static size_t shl_trie_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	uint64_t x, y;
+	size_t i;
+
+	for (i = 0; i + sizeof(x) <= len; i += sizeof(x)) {
+		memcpy(&x, &a[i], sizeof(x));
+		memcpy(&y, &b[i], sizeof(y));
+		if (x != y)
+			break;
+	}
+
+	for ( ; i < len; ++i)
+		if (a[i] != b[i])
+			break;
+
+	return i;
+}
+
+/* final verification of a found entry */
+static inline bool shl_trie_match(const struct shl_trie_entry *entry,
+				  size_t entrylen, const uint8_t *key,
+				  size_t keylen)
+{
+	return entrylen == keylen && !memcmp(entry->key, key, keylen);
+}
+
+/* return true if @entry is a prefix of @key, given that their first @matched
+ * bytes are already known to be equal */
+static inline bool shl_trie_extends(const struct shl_trie_entry *entry,
+				    size_t entrylen, const uint8_t *key,
+				    size_t keylen, size_t matched)
+{
+	return entrylen <= keylen && entrylen >= matched &&
+	       !memcmp(&entry->key[matched], &key[matched],
+		       entrylen - matched);
+}
+
 /* allocate objects with alignment restrictions */
 static inline int shl_trie_alloc(void **out, size_t size)
 {
@@ -167,51 +273,305 @@ static inline int shl_trie_alloc(void **out, size_t size)
 	return ret ? -ENOMEM : 0;
 }
 
+/*
+ * Arena Allocator
+ * In arena mode, nodes are carved from big slabs. Slabs are linked in a
+ * single-linked list, the head is the slab we currently allocate from. Removed
+ * nodes are put on a free-list (linked via ->childs[0]) and reused before we
+ * carve new nodes from the current slab.
+ * Slabs are allocated with SHL_TRIE_ALIGNMENT and nodes are a multiple of it in
+ * size. So carved nodes satisfy the same alignment as separately allocated
+ * nodes and we can use the LSBs for tagging.
+ */
+
+#define SHL_TRIE_SLAB_NODES 1024
+
+struct shl_trie_slab {
+	struct shl_trie_slab *next;
+	size_t used;
+	size_t size;
+	struct shl_trie_node nodes[];
+};
+
+static int shl_trie_alloc_slab(struct shl_trie *trie, size_t size)
+{
+	struct shl_trie_slab *slab;
+	int ret;
+
+	ret = shl_trie_alloc((void**)&slab, sizeof(*slab) +
+					     size * sizeof(*slab->nodes));
+	if (ret)
+		return ret;
+
+	slab->used = 0;
+	slab->size = size;
+	slab->next = trie->slabs;
+	trie->slabs = slab;
+	return 0;
+}
+
+static void shl_trie_free_slabs(struct shl_trie *trie)
+{
+	struct shl_trie_slab *slab;
+
+	while ((slab = trie->slabs)) {
+		trie->slabs = slab->next;
+		free(slab);
+	}
+
+	trie->free_nodes = NULL;
+}
+
+static int shl_trie_arena_alloc(struct shl_trie *trie,
+				struct shl_trie_node **out)
+{
+	struct shl_trie_node *node;
+	struct shl_trie_slab *slab;
+	int ret;
+
+	if (trie->free_nodes) {
+		node = trie->free_nodes;
+		trie->free_nodes = node->childs[0];
+		*out = node;
+		return 0;
+	}
+
+	slab = trie->slabs;
+	if (!slab || slab->used >= slab->size) {
+		ret = shl_trie_alloc_slab(trie, SHL_TRIE_SLAB_NODES);
+		if (ret)
+			return ret;
+
+		slab = trie->slabs;
+	}
+
+	*out = &slab->nodes[slab->used++];
+	return 0;
+}
+
 /* allocate node with alignment restrictions */
-static inline int shl_trie_alloc_node(struct shl_trie_node **out)
+static inline int shl_trie_alloc_node(struct shl_trie *trie,
+				      struct shl_trie_node **out)
 {
+	if (trie->arena)
+		return shl_trie_arena_alloc(trie, out);
+
 	return shl_trie_alloc((void**)out, sizeof(**out));
 }
 
-bool shl_trie_lookup(struct shl_trie *trie, const uint8_t *key, size_t keylen,
-		     uint8_t ***out)
+/* release node allocated via shl_trie_alloc_node() */
+static inline void shl_trie_release_node(struct shl_trie *trie,
+					 struct shl_trie_node *node)
+{
+	if (trie->arena) {
+		node->childs[0] = trie->free_nodes;
+		trie->free_nodes = node;
+	} else {
+		free(node);
+	}
+}
+
+/*
+ * Concurrent Mode
+ * In concurrent mode, readers may run in parallel to a single writer. Readers
+ * never modify the trie (visits use cursors) and writers never modify a node
+ * that is reachable by readers, except for single child-pointers and their
+ * key-lengths:
+ *  - Inserts fully initialize the new node and then publish it with a single
+ *    release-store into its parent slot.
+ *  - Removals replace the parent slot of the removed node with the sibling.
+ *    If the sibling is an entry, its key-length is stored before the pointer.
+ *    The removed node is not freed but retired until shl_trie_reclaim().
+ * A reader loads a child-pointer and, if it is an entry, its key-length. As
+ * the length is stored separately, the reader loads the pointer again and
+ * retries if it changed in between. A writer always changes the pointer of a
+ * slot before it changes the length again, so a changed length is always
+ * detected.
+ * Retired nodes are still read by readers, so we cannot link them through
+ * their own fields. Instead, we use an array which is grown during insert so it
+ * can hold every live node. Removals thus never allocate memory.
+ */
+
+static inline void shl_trie_publish(void **slot, void *ptr)
+{
+	__atomic_store_n(slot, ptr, __ATOMIC_RELEASE);
+}
+
+static inline void shl_trie_publish_len(uint32_t *slot, size_t len)
+{
+	__atomic_store_n(slot, len, __ATOMIC_RELEASE);
+}
+
+/* Read child-pointer @slot and, if it is an entry, its length @lenslot. @len
+ * is 0 for nodes. Tries that are not in concurrent mode use plain loads.
+ * Callers read trie->concurrent once and pass it down, so the check is hoisted
+ * out of the descent. */
+static inline void *shl_trie_read(bool concurrent, void **slot,
+				  uint32_t *lenslot, size_t *len)
+{
+	void *ptr;
+
+	if (!concurrent) {
+		ptr = *slot;
+		*len = shl_trie_is_node(ptr) ? 0 : *lenslot;
+		return ptr;
+	}
+
+	do {
+		ptr = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (shl_trie_is_node(ptr)) {
+			*len = 0;
+			break;
+		}
+		*len = __atomic_load_n(lenslot, __ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(slot, __ATOMIC_RELAXED) != ptr);
+
+	return ptr;
+}
+
+/*
+ * Operations which descend more than once need a consistent view of the trie.
+ * Writers increment @seq before and after modifying a concurrent trie, so it is
+ * odd during modifications. Readers retry if @seq changed.
+ * A reader that sees an odd @seq has to wait for the writer. Modifications are
+ * short, so we spin a few rounds first, but then yield the CPU in case the
+ * writer got preempted.
+ */
+
+#define SHL_TRIE_SPINS 64
+
+static inline void shl_trie_write_begin(struct shl_trie *trie)
+{
+	if (trie->concurrent) {
+		__atomic_store_n(&trie->seq, trie->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+}
+
+static inline void shl_trie_write_end(struct shl_trie *trie)
+{
+	if (trie->concurrent)
+		__atomic_store_n(&trie->seq, trie->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long shl_trie_read_begin(struct shl_trie *trie)
+{
+	unsigned long seq;
+	unsigned int spins = 0;
+
+	if (!trie->concurrent)
+		return 0;
+
+	while ((seq = __atomic_load_n(&trie->seq, __ATOMIC_ACQUIRE)) & 1UL)
+		if (++spins >= SHL_TRIE_SPINS)
+			sched_yield();
+
+	return seq;
+}
+
+static inline bool shl_trie_read_retry(struct shl_trie *trie,
+				       unsigned long seq)
+{
+	if (!trie->concurrent)
+		return false;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&trie->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* make sure removals can retire @num more nodes without allocating memory */
+static int shl_trie_reserve(struct shl_trie *trie, size_t num)
+{
+	void **t;
+
+	if (!trie->concurrent)
+		return 0;
+
+	num += trie->n_retired + trie->n_nodes;
+	if (num <= trie->max_retired)
+		return 0;
+
+	num = (num < 64) ? 64 : num * 2;
+	t = realloc(trie->retired, num * sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	trie->retired = t;
+	trie->max_retired = num;
+	return 0;
+}
+
+/* free node allocated via shl_trie_alloc_node(), or retire it */
+static inline void shl_trie_free_node(struct shl_trie *trie,
+				      struct shl_trie_node *node)
+{
+	if (trie->concurrent) {
+		--trie->n_nodes;
+		trie->retired[trie->n_retired++] = node;
+	} else {
+		shl_trie_release_node(trie, node);
+	}
+}
+
+void shl_trie_reclaim(struct shl_trie *trie)
+{
+	while (trie->n_retired > 0)
+		shl_trie_release_node(trie,
+				      trie->retired[--trie->n_retired]);
+
+	if (!trie->root)
+		shl_trie_free_slabs(trie);
+}
+
+/* Find the closest entry to @key and store its length in @len. This is
+ * always-inline so callers can specialize it for constant @concurrent. */
+static inline __attribute__((__always_inline__))
+void *shl_trie_find(struct shl_trie *trie, bool concurrent,
+		    const uint8_t *key, size_t keylen, size_t *len)
 {
 	struct shl_trie_node *node;
-	uint8_t c;
-	uint16_t direction;
+	unsigned int direction;
 	void *iter;
 
-	iter = trie->root;
+	iter = shl_trie_read(concurrent, &trie->root, &trie->root_len, len);
 
 	/* empty tries cannot contain @key */
 	if (!iter)
-		return false;
+		return NULL;
 
 	/* find closest match; iterate until we get an entry */
 	while (shl_trie_is_node(iter)) {
 		node = shl_trie_get_node(iter);
 
 		/* We assume every key is followed by an infinite string of
-		 * binary zeros. That is, shorter strings are always the left
-		 * child, longer strings the right. */
-		if (node->byte < keylen)
-			c = key[node->byte];
-		else
-			c = 0;
-
-		/* Get direction. (q->otherbits | c) is either a full 8bit mask
-		 * or a mask with 1 bit unset. If we add 1 to a full mask, we
-		 * get 0x100. If we add 1 to as mask with only 1 bit unset, we
-		 * get 0xff. Hence, a right-shift will give us either 0 or 1,
-		 * which is the direction we go to. */
-		direction = (1 + (uint16_t)(node->otherbits | c)) >> 8;
+		 * zero-symbols. That is, shorter keys are always the left
+		 * child, longer keys the right. See shl_trie_sym(). */
+		direction = shl_trie_dir(node, key, keylen);
 
-		iter = node->childs[direction];
+		iter = shl_trie_read(concurrent, &node->childs[direction],
+				     &node->lens[direction], len);
 	}
 
+	return iter;
+}
+
+bool shl_trie_lookup(struct shl_trie *trie, const uint8_t *key, size_t keylen,
+		     uint8_t ***out)
+{
+	size_t len;
+	void *iter;
+
+	/* separate descents, so the common case uses plain loads only */
+	if (trie->concurrent)
+		iter = shl_trie_find(trie, true, key, keylen, &len);
+	else
+		iter = shl_trie_find(trie, false, key, keylen, &len);
+
+	if (!iter)
+		return false;
+
 	/* Got an entry, but no clue whether it's correct. Test it! */
-	if (strcmp((const char*)key,
-		   (const char*)shl_trie_get_entry(iter)->key))
+	if (!shl_trie_match(shl_trie_get_entry(iter), len, key, keylen))
 		return false;
 
 	if (out)
@@ -219,6 +579,82 @@ bool shl_trie_lookup(struct shl_trie *trie, const uint8_t *key, size_t keylen,
 	return true;
 }
 
+/*
+ * Longest-prefix match
+ * A stored key which is a prefix of other stored keys always hangs off a node
+ * whose crit-bit is the presence-bit right behind it (that is, ->otherbits is
+ * 0xff). Its left child is this entry, the right child contains all longer
+ * keys. So while searching for @key, each such node where we go right is a
+ * candidate. Candidates are nested, each one extends the previous one. Hence,
+ * we only need to compare the bytes a candidate adds to the previous one. If
+ * they don't match @key, no deeper entry can be a prefix of @key and we stop.
+ * The entry we end up at is the last candidate.
+ * This needs a single descent and compares each byte of @key at most once.
+ */
+bool shl_trie_lookup_prefix(struct shl_trie *trie, const uint8_t *key,
+			    size_t keylen, uint8_t ***out, size_t *outlen)
+{
+	struct shl_trie_node *node;
+	struct shl_trie_entry *entry = NULL;
+	bool concurrent = trie->concurrent;
+	unsigned int direction;
+	size_t len, matched;
+	void *iter;
+
+retry:
+	matched = 0;
+	iter = shl_trie_read(concurrent, &trie->root, &trie->root_len, &len);
+
+	/* empty tries cannot contain a prefix of @key */
+	if (!iter)
+		return false;
+
+	while (shl_trie_is_node(iter)) {
+		node = shl_trie_get_node(iter);
+		direction = shl_trie_dir(node, key, keylen);
+
+		if (direction && node->otherbits == 0xff) {
+			iter = shl_trie_read(concurrent, &node->childs[0],
+					     &node->lens[0], &len);
+			if (shl_trie_is_node(iter))
+				goto done;
+			if (!shl_trie_extends(shl_trie_get_entry(iter), len,
+					      key, keylen, matched))
+				goto done;
+
+			entry = shl_trie_get_entry(iter);
+			matched = len;
+		}
+
+		iter = shl_trie_read(concurrent, &node->childs[direction],
+				     &node->lens[direction], &len);
+	}
+
+	if (!shl_trie_is_node(iter) &&
+	    shl_trie_extends(shl_trie_get_entry(iter), len, key, keylen,
+			     matched)) {
+		entry = shl_trie_get_entry(iter);
+		matched = len;
+	}
+
+done:
+	if (!entry)
+		return false;
+
+	/* Candidates are only nested if the trie didn't change during our
+	 * search. So in concurrent mode we have to verify the whole key. */
+	if (concurrent && memcmp(entry->key, key, matched)) {
+		entry = NULL;
+		goto retry;
+	}
+
+	if (out)
+		*out = shl_trie_get_key(entry);
+	if (outlen)
+		*outlen = matched;
+	return true;
+}
+
 int shl_trie_insert(struct shl_trie *trie, uint8_t **rkey, size_t keylen,
 		    uint8_t ***out)
 {
@@ -226,80 +662,73 @@ int shl_trie_insert(struct shl_trie *trie, uint8_t **rkey, size_t keylen,
 	struct shl_trie_entry *entry;
 	struct shl_trie_node *node, *new;
 	int ret;
-	uint8_t c, newotherbits;
-	uint16_t newdirection, direction;
-	size_t newbyte;
+	uint16_t newotherbits;
+	unsigned int newdirection, direction;
+	size_t newbyte, len;
+	uint32_t *wherelen;
 	void *iter, **where;
 
 	ret = shl_check_alignment(rkey);
 	if (ret < 0)
 		return ret;
+	if (keylen > UINT32_MAX)
+		return -E2BIG;
 
 	iter = trie->root;
 
 	/* Empty trie? Insert it as root. */
 	if (!iter) {
-		trie->root = shl_trie_make_entry((struct shl_trie_entry*)rkey);
+		shl_trie_write_begin(trie);
+		shl_trie_publish_len(&trie->root_len, keylen);
+		shl_trie_publish(&trie->root,
+			shl_trie_make_entry((struct shl_trie_entry*)rkey));
+		shl_trie_write_end(trie);
 		return 0;
 	}
 
 	/* iterate until we get an entry, see shl_trie_lookup() */
+	len = trie->root_len;
 	while (shl_trie_is_node(iter)) {
 		node = shl_trie_get_node(iter);
 
-		if (node->byte < keylen)
-			c = key[node->byte];
-		else
-			c = 0;
-
-		direction = (1 + (uint16_t)(node->otherbits | c)) >> 8;
+		direction = shl_trie_dir(node, key, keylen);
 		iter = node->childs[direction];
+		len = node->lens[direction];
 	}
 
 	entry = shl_trie_get_entry(iter);
 
-	/* We found the closest entry match @entry. Now find the first bit that
-	 * differs between @entry and @key. Both keys are 0-terminated, so we
-	 * can safely iterate @keylen. If @entry->key is shorter than @keylen,
-	 * they differ in the 0-terminating byte. */
-
-	for (newbyte = 0; newbyte < keylen; ++newbyte) {
-		if (entry->key[newbyte] != key[newbyte]) {
-			newotherbits = entry->key[newbyte] ^ key[newbyte];
-			goto insert_new;
-		}
-	}
-
-	/* The first @keylen bytes are equal, but maybe @entry->key is longer
-	 * than @key. */
-	if (entry->key[newbyte]) {
-		newotherbits = entry->key[newbyte];
-		goto insert_new;
+	/* We found the closest entry match @entry. Now find the first symbol
+	 * that differs between @entry and @key. If one key is a prefix of the
+	 * other, they differ in the presence-bit right behind the shorter
+	 * key. */
+	newbyte = shl_trie_mismatch(entry->key, key,
+				    (len < keylen) ? len : keylen);
+	if (newbyte == keylen && newbyte == len) {
+		if (out)
+			*out = &entry->key;
+		return -EALREADY;
 	}
 
-	if (out)
-		*out = &entry->key;
-	return -EALREADY;
-
-insert_new:
 	/* Here we know that @key is not present in our trie. Furthermore,
-	 * @newotherbits contain the XOR on the first differing byte between the
-	 * closest match and @key. Use some bit-magic to turn this into a 8-bit
-	 * bitmask with only the most significant differing bit _not_ set. */
-	newotherbits |= newotherbits >> 1;
-	newotherbits |= newotherbits >> 2;
-	newotherbits |= newotherbits >> 4;
-	newotherbits = (newotherbits & ~(newotherbits >> 1)) ^ 0xff;
+	 * @newotherbits is the crit-bit of the first differing symbol between
+	 * the closest match and @key. */
+	newotherbits = shl_trie_otherbits(entry->key, len, key, keylen,
+					  newbyte);
 
 	/* Calculate direction of the existing trie suffix. That is,
 	 * @newdirection is where the existing trie will hang off once we insert
 	 * a new node. Our new entry for @key will go into the other
 	 * direction. */
-	c = entry->key[newbyte];
-	newdirection = (1 + (uint16_t)(newotherbits | c)) >> 8;
+	newdirection = (1 + (unsigned int)(newotherbits |
+			shl_trie_sym(entry->key, len, newbyte))) >> 9;
 
 	/* allocate new node */
-	ret = shl_trie_alloc_node(&new);
+	ret = shl_trie_reserve(trie, 1);
+	if (ret)
+		return ret;
+
+	ret = shl_trie_alloc_node(trie, &new);
 	if (ret)
 		return ret;
 
@@ -310,6 +739,7 @@ insert_new:
 	new->byte = newbyte;
 	new->otherbits = newotherbits;
 	new->childs[newdirection ^ 1] = shl_trie_make_entry(entry);
+	new->lens[newdirection ^ 1] = keylen;
 
 	/* So earlier we searched for the closest match in the existing trie,
 	 * measured by number of prefix-changes. However, our new key might not
@@ -322,6 +752,7 @@ insert_new:
 	 * insert our new entry. */
 
 	where = &trie->root; /* guaranteed to be non-NULL */
+	wherelen = &trie->root_len;
 	while (shl_trie_is_node(*where)) {
 		node = shl_trie_get_node(*where);
 
@@ -332,31 +763,197 @@ insert_new:
 			break;
 
 		/* node shares the prefix, go one node down */
-		if (node->byte < keylen)
-			c = key[node->byte];
-		else
-			c = 0;
-
-		direction = (1 + (uint16_t)(node->otherbits | c)) >> 8;
+		direction = shl_trie_dir(node, key, keylen);
 		where = &node->childs[direction];
+		wherelen = &node->lens[direction];
 	}
 
 	/* insert our node at the given position */
 	new->childs[newdirection] = *where;
-	*where = shl_trie_make_node(new);
+	new->lens[newdirection] = *wherelen;
+	shl_trie_write_begin(trie);
+	shl_trie_publish(where, shl_trie_make_node(new));
+	shl_trie_write_end(trie);
+	if (trie->concurrent)
+		++trie->n_nodes;
 
 	if (out)
 		*out = &entry->key;
 	return 0;
 }
 
+/*
+ * Bulk Loading
+ * A crit-bit trie of sorted keys is a Cartesian tree over the crit-bits of
+ * neighbouring keys: the crit-bit between the i'th and (i+1)'th key is the
+ * node that separates both, and nodes with more significant crit-bits are
+ * closer to the root. We build it left to right, keeping the right spine of
+ * the tree on a stack. The stack is linked via ->childs[1], which is not yet
+ * set for spine nodes. Each node is pushed and popped once, so this is O(n).
+ *
+ * All nodes are allocated upfront. In arena mode, they're carved from a single
+ * slab that fits exactly. Otherwise, they're linked via ->childs[0] until
+ * used.
+ */
+
+static inline size_t shl_trie_load_len(uint8_t ***entries, const size_t *lens,
+				       size_t i)
+{
+	return lens ? lens[i] : strlen((const char*)*entries[i]);
+}
+
+static int shl_trie_load_nodes(struct shl_trie *trie, size_t num,
+			       struct shl_trie_node **out)
+{
+	struct shl_trie_node *list = NULL, *node;
+	struct shl_trie_slab *slab;
+	size_t i;
+	int ret;
+
+	if (trie->arena) {
+		ret = shl_trie_alloc_slab(trie, num);
+		if (ret)
+			return ret;
+
+		slab = trie->slabs;
+		for (i = 0; i < num; ++i) {
+			node = &slab->nodes[slab->used++];
+			node->childs[0] = list;
+			list = node;
+		}
+	} else {
+		for (i = 0; i < num; ++i) {
+			ret = shl_trie_alloc((void**)&node, sizeof(*node));
+			if (ret) {
+				while ((node = list)) {
+					list = node->childs[0];
+					free(node);
+				}
+				return ret;
+			}
+
+			node->childs[0] = list;
+			list = node;
+		}
+	}
+
+	*out = list;
+	return 0;
+}
+
+int shl_trie_load(struct shl_trie *trie, uint8_t ***entries,
+		  const size_t *lens, size_t num)
+{
+	struct shl_trie_node *list, *node, *stack;
+	uint16_t otherbits;
+	size_t i, byte, len, nextlen, curlen;
+	uint8_t *key, *next;
+	void *cur;
+	int ret;
+
+	if (trie->root)
+		return -EINVAL;
+	if (!num)
+		return 0;
+
+	/* verify alignment and order before we allocate anything */
+	len = shl_trie_load_len(entries, lens, 0);
+	for (i = 0; i < num; ++i) {
+		ret = shl_check_alignment(entries[i]);
+		if (ret < 0)
+			return ret;
+		if (len > UINT32_MAX)
+			return -E2BIG;
+
+		if (i + 1 >= num)
+			break;
+
+		key = *entries[i];
+		next = *entries[i + 1];
+		nextlen = shl_trie_load_len(entries, lens, i + 1);
+		byte = shl_trie_mismatch(key, next,
+					 (len < nextlen) ? len : nextlen);
+		if (byte == nextlen)
+			return -EINVAL;
+		if (byte < len && key[byte] > next[byte])
+			return -EINVAL;
+
+		len = nextlen;
+	}
+
+	ret = shl_trie_reserve(trie, num - 1);
+	if (ret)
+		return ret;
+
+	ret = shl_trie_load_nodes(trie, num - 1, &list);
+	if (ret)
+		return ret;
+
+	stack = NULL;
+	len = shl_trie_load_len(entries, lens, 0);
+	cur = shl_trie_make_entry((struct shl_trie_entry*)entries[0]);
+	curlen = len;
+
+	for (i = 0; i + 1 < num; ++i) {
+		key = *entries[i];
+		next = *entries[i + 1];
+		nextlen = shl_trie_load_len(entries, lens, i + 1);
+
+		byte = shl_trie_mismatch(key, next,
+					 (len < nextlen) ? len : nextlen);
+		otherbits = shl_trie_otherbits(key, len, next, nextlen, byte);
+
+		/* pop all spine nodes with less significant crit-bits; they
+		 * become part of the left sub-trie of the new node */
+		while (stack && (stack->byte > byte ||
+				 (stack->byte == byte &&
+				  stack->otherbits > otherbits))) {
+			node = stack;
+			stack = node->childs[1];
+			node->childs[1] = cur;
+			node->lens[1] = curlen;
+			cur = shl_trie_make_node(node);
+		}
+
+		node = list;
+		list = node->childs[0];
+		node->byte = byte;
+		node->otherbits = otherbits;
+		node->childs[0] = cur;
+		node->lens[0] = curlen;
+		node->childs[1] = stack;
+		stack = node;
+
+		cur = shl_trie_make_entry((struct shl_trie_entry*)entries[i + 1]);
+		curlen = nextlen;
+		len = nextlen;
+	}
+
+	while (stack) {
+		node = stack;
+		stack = node->childs[1];
+		node->childs[1] = cur;
+		node->lens[1] = curlen;
+		cur = shl_trie_make_node(node);
+	}
+
+	shl_trie_write_begin(trie);
+	shl_trie_publish_len(&trie->root_len, curlen);
+	shl_trie_publish(&trie->root, cur);
+	shl_trie_write_end(trie);
+	if (trie->concurrent)
+		trie->n_nodes += num - 1;
+
+	return 0;
+}
+
 bool shl_trie_remove(struct shl_trie *trie, const uint8_t *key, size_t keylen,
 		     uint8_t ***out)
 {
 	struct shl_trie_node *node;
 	struct shl_trie_entry *entry;
-	uint8_t c;
-	uint16_t direction;
+	unsigned int direction;
+	uint32_t *wherelen, *grandparentlen;
 	void **where, **grandparent;
 
 	/* empty tries cannot contain @key */
@@ -364,34 +961,40 @@ bool shl_trie_remove(struct shl_trie *trie, const uint8_t *key, size_t keylen,
 		return false;
 
 	grandparent = NULL;
+	grandparentlen = NULL;
 	where = &trie->root;
+	wherelen = &trie->root_len;
 	while (shl_trie_is_node(*where)) {
 		grandparent = where;
+		grandparentlen = wherelen;
 		node = shl_trie_get_node(*where);
 
-		if (node->byte < keylen)
-			c = key[node->byte];
-		else
-			c = 0;
-
-		direction = (1 + (uint16_t)(node->otherbits | c)) >> 8;
+		direction = shl_trie_dir(node, key, keylen);
 		where = &node->childs[direction];
+		wherelen = &node->lens[direction];
 	}
 
 	entry = shl_trie_get_entry(*where);
 
 	/* Got an entry, but no clue whether it's correct. Test it! */
-	if (strcmp((const char*)key,
-		   (const char*)entry->key))
+	if (!shl_trie_match(entry, *wherelen, key, keylen))
 		return false;
 
-	/* unlink entry from trie */
+	/* Unlink entry from trie; empty arena-tries drop their slabs. In
+	 * concurrent mode, readers might still use them, so we drop them in
+	 * shl_trie_reclaim(). The length must be stored before the pointer,
+	 * see shl_trie_read(). */
+	shl_trie_write_begin(trie);
 	if (!grandparent) {
-		trie->root = NULL;
+		shl_trie_publish(&trie->root, NULL);
+		if (!trie->concurrent)
+			shl_trie_free_slabs(trie);
 	} else {
-		*grandparent = node->childs[direction ^ 1];
-		free(node);
+		shl_trie_publish_len(grandparentlen, node->lens[direction ^ 1]);
+		shl_trie_publish(grandparent, node->childs[direction ^ 1]);
+		shl_trie_free_node(trie, node);
 	}
+	shl_trie_write_end(trie);
 
 	/* save entry so caller can access it */
 	if (out)
@@ -403,6 +1006,7 @@ bool shl_trie_remove(struct shl_trie *trie, const uint8_t *key, size_t keylen,
 enum shl_trie_traverse_flags {
 	SHL_TRIE_FREE		= 0x1,
 	SHL_TRIE_SKIP_ROOT	= 0x2,
+	SHL_TRIE_DROP		= 0x4,
 };
 
 static void shl_trie_traverse(void *sub_trie,
@@ -470,9 +1074,11 @@ static void shl_trie_traverse(void *sub_trie,
 		if (shl_trie_is_visited(node->childs[1])) {
 			iter = shl_trie_clear_visited(node->childs[1]);
 
+			/* SHL_TRIE_DROP means the nodes are released by the
+			 * caller afterwards, so we don't restore them. */
 			if (flags & SHL_TRIE_FREE)
 				free(node);
-			else
+			else if (!(flags & SHL_TRIE_DROP))
 				node->childs[1] = shl_trie_clear_visited(parent);
 
 			/* @node may be freed, but we never deref it */
@@ -512,20 +1118,42 @@ void shl_trie_clear(struct shl_trie *trie,
 		    void (*free_cb) (uint8_t **key, void *ctx),
 		    void *ctx)
 {
-	shl_trie_traverse(trie->root, free_cb, ctx, SHL_TRIE_FREE);
+	/* release retired nodes before the slabs are dropped */
+	shl_trie_reclaim(trie);
+	free(trie->retired);
+	trie->retired = NULL;
+	trie->max_retired = 0;
+	trie->n_nodes = 0;
+
+	/* Arena nodes are released all at once together with their slabs. We
+	 * only need to traverse the trie if the caller wants to see the
+	 * entries. */
+	if (!trie->arena)
+		shl_trie_traverse(trie->root, free_cb, ctx, SHL_TRIE_FREE);
+	else if (free_cb)
+		shl_trie_traverse(trie->root, free_cb, ctx, SHL_TRIE_DROP);
+
 	trie->root = NULL;
+	shl_trie_free_slabs(trie);
 }
 
+static void shl_trie_visit_cursor(struct shl_trie *trie,
+				  const uint8_t *prefix, size_t plen,
+				  void (*do_cb) (uint8_t **key, void *ctx),
+				  void *ctx);
+
 void shl_trie_visit(struct shl_trie *trie, const uint8_t *prefix, size_t plen,
 		    void (*do_cb) (uint8_t **key, void *ctx),
 		    void *ctx)
 {
 	void *iter, *top;
 	struct shl_trie_node *node;
-	struct shl_trie_entry *entry;
-	uint8_t c;
-	uint16_t direction;
-	size_t i;
+	unsigned int direction;
+	size_t len;
+
+	/* concurrent tries must not be modified, use cursors instead */
+	if (trie->concurrent)
+		return shl_trie_visit_cursor(trie, prefix, plen, do_cb, ctx);
 
 	/* empty tries are boring */
 	if (!trie->root)
@@ -533,7 +1161,7 @@ void shl_trie_visit(struct shl_trie *trie, const uint8_t *prefix, size_t plen,
 
 	/* if no prefix given, traverse the whole trie */
 	if (!prefix || !plen)
-		return shl_trie_traverse(trie, do_cb, ctx, 0);
+		return shl_trie_traverse(trie->root, do_cb, ctx, 0);
 
 	/* If a prefix is given, we search the trie for the longest common
 	 * prefix and remember it as @top. We continue to find the best match so
@@ -541,29 +1169,641 @@ void shl_trie_visit(struct shl_trie *trie, const uint8_t *prefix, size_t plen,
 	 * matching entry in the whole trie. Otherwise, we simply traverse the
 	 * given sub-tree. */
 	iter = trie->root;
+	len = trie->root_len;
 	top = iter;
 	while (shl_trie_is_node(iter)) {
 		node = shl_trie_get_node(iter);
 
-		if (node->byte < plen)
-			c = prefix[node->byte];
-		else
-			c = 0;
-
-		direction = (1 + (uint16_t)(node->otherbits | c)) >> 8;
+		direction = shl_trie_dir(node, prefix, plen);
 		iter = node->childs[direction];
+		len = node->lens[direction];
 
 		/* update @top only if the prefix is still in common */
 		if (node->byte < plen)
 			top = iter;
 	}
 
-	entry = shl_trie_get_entry(iter);
-
 	/* if the prefix doesn't match, we have no matching entries */
-	for (i = 0; i < plen; ++i)
-		if (prefix[i] != entry->key[i])
-			return;
+	if (len < plen || memcmp(prefix, shl_trie_get_entry(iter)->key, plen))
+		return;
 
 	return shl_trie_traverse(top, do_cb, ctx, 0);
 }
+
+/*
+ * Cursors
+ * Cursors never modify the trie. Instead of storing a path, a cursor only
+ * remembers its current entry. To move it, we search the trie for the current
+ * key again and use the crit-bit structure to find the neighbour. This costs
+ * two descents per step, but needs no memory and works even if other entries
+ * were inserted or removed in between.
+ */
+
+/* Follow @iter down to its left-most (@dir == 0) or right-most (@dir == 1)
+ * entry and store it in @cur. @len is the key-length of @iter if it is an
+ * entry itself. */
+static bool shl_trie_cursor_set(struct shl_trie_cursor *cur, void *iter,
+				size_t len, unsigned int dir)
+{
+	bool concurrent = cur->trie->concurrent;
+	struct shl_trie_node *node;
+
+	if (!iter) {
+		cur->entry = NULL;
+		cur->len = 0;
+		return false;
+	}
+
+	while (shl_trie_is_node(iter)) {
+		node = shl_trie_get_node(iter);
+		iter = shl_trie_read(concurrent, &node->childs[dir],
+				     &node->lens[dir], &len);
+	}
+
+	cur->entry = shl_trie_get_key(iter);
+	cur->len = len;
+	return true;
+}
+
+/*
+ * Find the neighbour of @key in direction @want (1 for the next bigger key, 0
+ * for the next smaller key). If @strict is false and @key is present, @key
+ * itself is returned.
+ * We first find the closest entry and the crit-bit where it differs from @key.
+ * Then we descend again until we reach this crit-bit. All entries below it
+ * share the same prefix and @key sorts either before or after all of them.
+ * While descending, we remember the last sibling sub-trie in direction @want,
+ * which contains the neighbours if @key sorts past the sub-trie.
+ */
+static bool shl_trie_cursor_search(struct shl_trie_cursor *cur,
+				   const uint8_t *key, size_t keylen,
+				   unsigned int want, bool strict)
+{
+	struct shl_trie *trie = cur->trie;
+	bool concurrent = trie->concurrent;
+	struct shl_trie_node *node;
+	struct shl_trie_entry *entry;
+	unsigned int direction, keydirection = 0;
+	uint16_t newotherbits = 0;
+	size_t newbyte, len, altlen = 0;
+	void *iter, *alt = NULL;
+	bool exact;
+
+	iter = shl_trie_read(concurrent, &trie->root, &trie->root_len, &len);
+	if (!iter)
+		return shl_trie_cursor_set(cur, NULL, 0, 0);
+
+	/* find closest match, see shl_trie_lookup() */
+	while (shl_trie_is_node(iter)) {
+		node = shl_trie_get_node(iter);
+		direction = shl_trie_dir(node, key, keylen);
+		iter = shl_trie_read(concurrent, &node->childs[direction],
+				     &node->lens[direction], &len);
+	}
+
+	entry = shl_trie_get_entry(iter);
+	newbyte = shl_trie_mismatch(entry->key, key,
+				    (len < keylen) ? len : keylen);
+	exact = (newbyte == keylen && newbyte == len);
+
+	if (exact && !strict)
+		return shl_trie_cursor_set(cur, iter, len, 0);
+
+	/* compute crit-bit like shl_trie_insert() does */
+	if (!exact) {
+		newotherbits = shl_trie_otherbits(entry->key, len, key, keylen,
+						  newbyte);
+		keydirection = (1 + (unsigned int)(newotherbits |
+				shl_trie_sym(key, keylen, newbyte))) >> 9;
+	}
+
+	iter = shl_trie_read(concurrent, &trie->root, &trie->root_len, &len);
+	while (shl_trie_is_node(iter)) {
+		node = shl_trie_get_node(iter);
+
+		if (!exact) {
+			if (node->byte > newbyte)
+				break;
+			if (node->byte == newbyte &&
+			    node->otherbits > newotherbits)
+				break;
+		}
+
+		direction = shl_trie_dir(node, key, keylen);
+		if (direction != want)
+			alt = shl_trie_read(concurrent, &node->childs[want],
+					    &node->lens[want], &altlen);
+
+		iter = shl_trie_read(concurrent, &node->childs[direction],
+				     &node->lens[direction], &len);
+	}
+
+	/* @iter is the sub-trie which shares the prefix with @key. If @key
+	 * sorts past it in direction @want, we continue in the sibling. */
+	if (exact || keydirection == want) {
+		iter = alt;
+		len = altlen;
+	}
+
+	return shl_trie_cursor_set(cur, iter, len, !want);
+}
+
+/* The two descents of shl_trie_cursor_search() must see the same trie. In
+ * concurrent mode, we retry if a writer modified the trie in between. */
+static bool shl_trie_cursor_find(struct shl_trie_cursor *cur,
+				 const uint8_t *key, size_t keylen,
+				 unsigned int want, bool strict)
+{
+	unsigned long seq;
+	bool r;
+
+	do {
+		seq = shl_trie_read_begin(cur->trie);
+		r = shl_trie_cursor_search(cur, key, keylen, want, strict);
+	} while (shl_trie_read_retry(cur->trie, seq));
+
+	return r;
+}
+
+bool shl_trie_cursor_first(struct shl_trie_cursor *cur,
+			   struct shl_trie *trie)
+{
+	bool concurrent = trie->concurrent;
+	size_t len = 0;
+	void *iter;
+
+	cur->trie = trie;
+	iter = shl_trie_read(concurrent, &trie->root, &trie->root_len, &len);
+	return shl_trie_cursor_set(cur, iter, len, 0);
+}
+
+bool shl_trie_cursor_last(struct shl_trie_cursor *cur, struct shl_trie *trie)
+{
+	bool concurrent = trie->concurrent;
+	size_t len = 0;
+	void *iter;
+
+	cur->trie = trie;
+	iter = shl_trie_read(concurrent, &trie->root, &trie->root_len, &len);
+	return shl_trie_cursor_set(cur, iter, len, 1);
+}
+
+bool shl_trie_cursor_seek(struct shl_trie_cursor *cur, struct shl_trie *trie,
+			  const uint8_t *key, size_t keylen)
+{
+	cur->trie = trie;
+	return shl_trie_cursor_find(cur, key, keylen, 1, false);
+}
+
+bool shl_trie_cursor_next(struct shl_trie_cursor *cur)
+{
+	if (!cur->entry)
+		return false;
+
+	return shl_trie_cursor_find(cur, *cur->entry, cur->len, 1, true);
+}
+
+bool shl_trie_cursor_prev(struct shl_trie_cursor *cur)
+{
+	if (!cur->entry)
+		return false;
+
+	return shl_trie_cursor_find(cur, *cur->entry, cur->len, 0, true);
+}
+
+void shl_trie_visit_range(struct shl_trie *trie,
+			  const uint8_t *from, size_t fromlen,
+			  const uint8_t *to, size_t tolen,
+			  void (*do_cb) (uint8_t **entry, void *ctx),
+			  void *ctx)
+{
+	struct shl_trie_cursor cur;
+	size_t len;
+	bool r;
+	int cmp;
+
+	if (from)
+		r = shl_trie_cursor_seek(&cur, trie, from, fromlen);
+	else
+		r = shl_trie_cursor_first(&cur, trie);
+
+	for ( ; r; r = shl_trie_cursor_next(&cur)) {
+		if (to) {
+			len = (cur.len < tolen) ? cur.len : tolen;
+			cmp = memcmp(*cur.entry, to, len);
+			if (cmp > 0 || (!cmp && cur.len >= tolen))
+				break;
+		}
+
+		if (do_cb)
+			do_cb(cur.entry, ctx);
+	}
+}
+
+/* same as shl_trie_visit() but via cursors, so the trie is not modified */
+static void shl_trie_visit_cursor(struct shl_trie *trie,
+				  const uint8_t *prefix, size_t plen,
+				  void (*do_cb) (uint8_t **key, void *ctx),
+				  void *ctx)
+{
+	struct shl_trie_cursor cur;
+	bool r;
+
+	if (!prefix)
+		plen = 0;
+
+	for (r = shl_trie_cursor_seek(&cur, trie, prefix, plen); r;
+	     r = shl_trie_cursor_next(&cur)) {
+		if (cur.len < plen || (plen && memcmp(*cur.entry, prefix, plen)))
+			break;
+
+		if (do_cb)
+			do_cb(cur.entry, ctx);
+	}
+}
+
+/*
+ * Frozen Tries
+ * A frozen trie is a flat, pointer-free copy of a trie. It consists of a
+ * header, an array of nodes, an array of entries and the concatenated keys.
+ * Children are referenced by index, entries have the SHL_TRIE_FROZEN_ENTRY
+ * bit set. Entries are stored in lexicographic order and nodes are stored in
+ * the same order: node i is the crit-bit between entry i and entry i+1.
+ * Hence, all entries of a sub-trie are a contiguous range of indices.
+ * All fields are in host byte-order. The header contains a byte-order mark
+ * so images from other hosts are rejected.
+ */
+
+#define SHL_TRIE_FROZEN_MAGIC "SHLTRIE"
+#define SHL_TRIE_FROZEN_BOM 0x01020304U
+#define SHL_TRIE_FROZEN_ENTRY 0x80000000U
+#define SHL_TRIE_FROZEN_NONE 0xffffffffU
+
+struct shl_trie_frozen_header {
+	char magic[8];
+	uint32_t bom;
+	uint32_t root;
+	uint64_t n_entries;
+	uint64_t n_keybytes;
+};
+
+struct shl_trie_frozen_node {
+	uint32_t childs[2];
+	uint32_t byte;
+	uint16_t otherbits;
+	uint16_t unused;
+};
+
+struct shl_trie_frozen_entry {
+	uint32_t off;
+	uint32_t len;
+};
+
+/* In-order walk over all nodes and entries of a trie. @node is NULL for
+ * entries. Unlike shl_trie_traverse() this doesn't modify the trie, but needs
+ * a stack. */
+static int shl_trie_walk(struct shl_trie *trie,
+			 void (*cb) (void *ctx, struct shl_trie_node *node,
+				     const uint8_t *key, size_t len),
+			 void *ctx)
+{
+	struct shl_trie_node **stack = NULL, **t, *node;
+	size_t depth = 0, max = 0, len;
+	void *iter;
+
+	iter = trie->root;
+	len = trie->root_len;
+	if (!iter)
+		return 0;
+
+	for (;;) {
+		while (shl_trie_is_node(iter)) {
+			node = shl_trie_get_node(iter);
+			if (depth >= max) {
+				max = max ? max * 2 : 64;
+				t = realloc(stack, max * sizeof(*t));
+				if (!t) {
+					free(stack);
+					return -ENOMEM;
+				}
+				stack = t;
+			}
+
+			stack[depth++] = node;
+			len = node->lens[0];
+			iter = node->childs[0];
+		}
+
+		cb(ctx, NULL, shl_trie_get_entry(iter)->key, len);
+		if (!depth)
+			break;
+
+		node = stack[--depth];
+		cb(ctx, node, NULL, 0);
+		len = node->lens[1];
+		iter = node->childs[1];
+	}
+
+	free(stack);
+	return 0;
+}
+
+struct shl_trie_freeze {
+	struct shl_trie_frozen_node *nodes;
+	struct shl_trie_frozen_entry *entries;
+	uint8_t *keys;
+	size_t n_entries;
+	size_t n_nodes;
+	size_t n_keybytes;
+	bool overflow;
+};
+
+static void shl_trie_freeze_count(void *ctx, struct shl_trie_node *node,
+				  const uint8_t *key, size_t len)
+{
+	struct shl_trie_freeze *f = ctx;
+
+	if (node)
+		return;
+
+	if (len > UINT32_MAX)
+		f->overflow = true;
+	++f->n_entries;
+	f->n_keybytes += len;
+}
+
+static void shl_trie_freeze_fill(void *ctx, struct shl_trie_node *node,
+				 const uint8_t *key, size_t len)
+{
+	struct shl_trie_freeze *f = ctx;
+	struct shl_trie_frozen_entry *e;
+	struct shl_trie_frozen_node *n;
+
+	if (node) {
+		n = &f->nodes[f->n_nodes++];
+		n->byte = node->byte;
+		n->otherbits = node->otherbits;
+		n->unused = 0;
+	} else {
+		e = &f->entries[f->n_entries++];
+		e->off = f->n_keybytes;
+		e->len = len;
+		memcpy(&f->keys[f->n_keybytes], key, len);
+		f->n_keybytes += len;
+	}
+}
+
+int shl_trie_freeze(struct shl_trie *trie, void **out, size_t *size)
+{
+	struct shl_trie_freeze f = { };
+	struct shl_trie_frozen_header *h;
+	struct shl_trie_frozen_node *n;
+	uint32_t i, top, stack, cur;
+	size_t num, nodes;
+	int ret;
+
+	ret = shl_trie_walk(trie, shl_trie_freeze_count, &f);
+	if (ret)
+		return ret;
+
+	if (f.overflow || f.n_entries >= SHL_TRIE_FROZEN_ENTRY ||
+	    f.n_keybytes > UINT32_MAX)
+		return -E2BIG;
+
+	num = f.n_entries;
+	nodes = num ? num - 1 : 0;
+	h = malloc(sizeof(*h) + nodes * sizeof(*f.nodes) +
+		   num * sizeof(*f.entries) + f.n_keybytes);
+	if (!h)
+		return -ENOMEM;
+
+	f.nodes = (void*)(h + 1);
+	f.entries = (void*)(f.nodes + nodes);
+	f.keys = (void*)(f.entries + num);
+	f.n_entries = 0;
+	f.n_keybytes = 0;
+
+	ret = shl_trie_walk(trie, shl_trie_freeze_fill, &f);
+	if (ret) {
+		free(h);
+		return ret;
+	}
+
+	/* Link the nodes. This is the same Cartesian-tree construction as in
+	 * shl_trie_load(), the right spine is linked via ->childs[1]. */
+	stack = SHL_TRIE_FROZEN_NONE;
+	cur = num ? SHL_TRIE_FROZEN_ENTRY : SHL_TRIE_FROZEN_NONE;
+	for (i = 0; i < nodes; ++i) {
+		n = &f.nodes[i];
+
+		while (stack != SHL_TRIE_FROZEN_NONE &&
+		       (f.nodes[stack].byte > n->byte ||
+			(f.nodes[stack].byte == n->byte &&
+			 f.nodes[stack].otherbits > n->otherbits))) {
+			top = stack;
+			stack = f.nodes[top].childs[1];
+			f.nodes[top].childs[1] = cur;
+			cur = top;
+		}
+
+		n->childs[0] = cur;
+		n->childs[1] = stack;
+		stack = i;
+		cur = SHL_TRIE_FROZEN_ENTRY | (i + 1);
+	}
+
+	while (stack != SHL_TRIE_FROZEN_NONE) {
+		top = stack;
+		stack = f.nodes[top].childs[1];
+		f.nodes[top].childs[1] = cur;
+		cur = top;
+	}
+
+	memcpy(h->magic, SHL_TRIE_FROZEN_MAGIC, sizeof(h->magic));
+	h->bom = SHL_TRIE_FROZEN_BOM;
+	h->root = cur;
+	h->n_entries = num;
+	h->n_keybytes = f.n_keybytes;
+
+	*out = h;
+	*size = sizeof(*h) + nodes * sizeof(*f.nodes) +
+		num * sizeof(*f.entries) + f.n_keybytes;
+	return 0;
+}
+
+int shl_trie_frozen_open(struct shl_trie_frozen *f, const void *data,
+			 size_t size)
+{
+	const struct shl_trie_frozen_header *h = data;
+	uint64_t num, nodes;
+
+	if (size < sizeof(*h) ||
+	    memcmp(h->magic, SHL_TRIE_FROZEN_MAGIC, sizeof(h->magic)) ||
+	    h->bom != SHL_TRIE_FROZEN_BOM ||
+	    h->n_entries >= SHL_TRIE_FROZEN_ENTRY)
+		return -EINVAL;
+
+	num = h->n_entries;
+	nodes = num ? num - 1 : 0;
+	if (size - sizeof(*h) != nodes * sizeof(struct shl_trie_frozen_node) +
+				 num * sizeof(struct shl_trie_frozen_entry) +
+				 h->n_keybytes)
+		return -EINVAL;
+	if (num ? h->root == SHL_TRIE_FROZEN_NONE :
+		  h->root != SHL_TRIE_FROZEN_NONE)
+		return -EINVAL;
+
+	f->root = h->root;
+	f->n_entries = num;
+	f->nodes = (const struct shl_trie_frozen_node*)(h + 1);
+	f->entries = (const struct shl_trie_frozen_entry*)(f->nodes + nodes);
+	f->keys = (const uint8_t*)(f->entries + num);
+	return 0;
+}
+
+const uint8_t *shl_trie_frozen_key(const struct shl_trie_frozen *f,
+				   size_t index, size_t *len)
+{
+	const struct shl_trie_frozen_entry *e = &f->entries[index];
+
+	if (len)
+		*len = e->len;
+	return &f->keys[e->off];
+}
+
+/* direction to follow at node @n, see shl_trie_dir() */
+static inline uint32_t shl_trie_frozen_dir(const struct shl_trie_frozen_node *n,
+					   const uint8_t *key, size_t keylen)
+{
+	uint16_t c;
+
+	c = shl_trie_sym(key, keylen, n->byte);
+	return (1 + (unsigned int)(n->otherbits | c)) >> 9;
+}
+
+/* follow @ref to the left-most (@dir == 0) or right-most entry */
+static size_t shl_trie_frozen_extreme(const struct shl_trie_frozen *f,
+				      uint32_t ref, unsigned int dir)
+{
+	while (!(ref & SHL_TRIE_FROZEN_ENTRY))
+		ref = f->nodes[ref].childs[dir];
+
+	return ref & ~SHL_TRIE_FROZEN_ENTRY;
+}
+
+bool shl_trie_frozen_lookup(const struct shl_trie_frozen *f,
+			    const uint8_t *key, size_t keylen, size_t *index)
+{
+	const struct shl_trie_frozen_node *n;
+	const uint8_t *k;
+	uint32_t ref;
+	size_t len;
+
+	ref = f->root;
+	if (ref == SHL_TRIE_FROZEN_NONE)
+		return false;
+
+	while (!(ref & SHL_TRIE_FROZEN_ENTRY)) {
+		n = &f->nodes[ref];
+		ref = n->childs[shl_trie_frozen_dir(n, key, keylen)];
+	}
+
+	ref &= ~SHL_TRIE_FROZEN_ENTRY;
+	k = shl_trie_frozen_key(f, ref, &len);
+	if (len != keylen || memcmp(k, key, keylen))
+		return false;
+
+	if (index)
+		*index = ref;
+	return true;
+}
+
+/* see shl_trie_lookup_prefix() */
+bool shl_trie_frozen_lookup_prefix(const struct shl_trie_frozen *f,
+				   const uint8_t *key, size_t keylen,
+				   size_t *index)
+{
+	const struct shl_trie_frozen_node *n;
+	const uint8_t *k;
+	size_t len, matched = 0, best = SIZE_MAX;
+	unsigned int direction;
+	uint32_t ref, c;
+
+	ref = f->root;
+	if (ref == SHL_TRIE_FROZEN_NONE)
+		return false;
+
+	while (!(ref & SHL_TRIE_FROZEN_ENTRY)) {
+		n = &f->nodes[ref];
+		direction = shl_trie_frozen_dir(n, key, keylen);
+
+		if (direction && n->otherbits == 0xff) {
+			c = n->childs[0] & ~SHL_TRIE_FROZEN_ENTRY;
+			k = shl_trie_frozen_key(f, c, &len);
+			if (len > keylen || len < matched ||
+			    memcmp(&k[matched], &key[matched], len - matched))
+				goto done;
+
+			best = c;
+			matched = len;
+		}
+
+		ref = n->childs[direction];
+	}
+
+	ref &= ~SHL_TRIE_FROZEN_ENTRY;
+	k = shl_trie_frozen_key(f, ref, &len);
+	if (len <= keylen && len >= matched &&
+	    !memcmp(&k[matched], &key[matched], len - matched))
+		best = ref;
+
+done:
+	if (best == SIZE_MAX)
+		return false;
+
+	if (index)
+		*index = best;
+	return true;
+}
+
+void shl_trie_frozen_visit(const struct shl_trie_frozen *f,
+			   const uint8_t *prefix, size_t plen,
+			   void (*do_cb) (size_t index, const uint8_t *key,
+					  size_t keylen, void *ctx),
+			   void *ctx)
+{
+	const struct shl_trie_frozen_node *n;
+	const uint8_t *k;
+	uint32_t ref, top;
+	size_t i, first, last, len;
+
+	ref = f->root;
+	if (ref == SHL_TRIE_FROZEN_NONE)
+		return;
+
+	if (!prefix)
+		plen = 0;
+
+	/* find the sub-trie of @prefix, see shl_trie_visit() */
+	top = ref;
+	while (!(ref & SHL_TRIE_FROZEN_ENTRY)) {
+		n = &f->nodes[ref];
+		ref = n->childs[shl_trie_frozen_dir(n, prefix, plen)];
+		if (n->byte < plen)
+			top = ref;
+	}
+
+	k = shl_trie_frozen_key(f, ref & ~SHL_TRIE_FROZEN_ENTRY, &len);
+	if (len < plen || (plen && memcmp(k, prefix, plen)))
+		return;
+
+	/* entries of a sub-trie are contiguous */
+	first = shl_trie_frozen_extreme(f, top, 0);
+	last = shl_trie_frozen_extreme(f, top, 1);
+
+	for (i = first; i <= last; ++i) {
+		k = shl_trie_frozen_key(f, i, &len);
+		if (do_cb)
+			do_cb(i, k, len, ctx);
+	}
+}
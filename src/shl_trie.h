@@ -10,6 +10,10 @@
  * This is a fast implementation of crit-bit tries. It is used to store
  * string->data associastions. It supports fast inserts, removals and lookups.
  * Furthermore, fast prefix-searches are supported.
+ *
+ * Keys are binary. The *_str() helpers use strlen() for the key-length, but
+ * the generic functions accept any key including embedded zero bytes. Shorter
+ * keys sort before longer keys with the same prefix.
  */
 
 #ifndef SHL_TRIE_H
@@ -34,8 +38,24 @@
  * Embed this structure in your objects where you want the trie head to reside.
  * You can either initialize the memory to 0 or use shl_trie_zero() to do that.
  */
+struct shl_trie_slab;
+
 struct shl_trie {
 	void *root;
+	uint32_t root_len;
+
+	/* arena allocator, only used if @arena is set */
+	struct shl_trie_slab *slabs;
+	void *free_nodes;
+	bool arena;
+
+	/* retired nodes, only used if @concurrent is set */
+	void **retired;
+	size_t n_retired;
+	size_t max_retired;
+	size_t n_nodes;
+	unsigned long seq;
+	bool concurrent;
 };
 
 /*
@@ -52,8 +72,69 @@ struct shl_trie {
 static inline void shl_trie_zero(struct shl_trie *trie)
 {
 	trie->root = NULL;
+	trie->root_len = 0;
+	trie->slabs = NULL;
+	trie->free_nodes = NULL;
+	trie->arena = false;
+	trie->retired = NULL;
+	trie->n_retired = 0;
+	trie->max_retired = 0;
+	trie->n_nodes = 0;
+	trie->seq = 0;
+	trie->concurrent = false;
+}
+
+/*
+ * Zero out an Arena-Trie
+ * Same as shl_trie_zero() but puts the trie into arena mode. Instead of
+ * allocating each node separately, nodes are carved from big slabs which are
+ * owned by the trie. Removed nodes are kept for reuse. This makes building
+ * big tries a lot faster and shl_trie_clear() only needs to free the slabs
+ * instead of each single node. If you pass no callback to shl_trie_clear(),
+ * the trie isn't even traversed.
+ *
+ * Like normal tries, an arena-trie has no more allocated memory once all
+ * elements are removed.
+ */
+static inline void shl_trie_zero_arena(struct shl_trie *trie)
+{
+	shl_trie_zero(trie);
+	trie->arena = true;
 }
 
+/*
+ * Zero out a Concurrent Trie
+ * Same as shl_trie_zero() but puts the trie into concurrent mode. In this mode,
+ * lookups, longest-prefix matches, cursors and visits may run in parallel to
+ * each other and to one writer. Readers take no locks and only writers (insert
+ * and remove) need to be serialized by the caller. Readers never modify the
+ * trie, so shl_trie_visit() callbacks may perform lookups, too.
+ *
+ * Lookups never wait for writers. Longest-prefix matches retry if a writer
+ * modified the trie concurrently. Cursors, and thus visits, need a consistent
+ * view of the trie: each step waits for a modification that is in progress to
+ * finish (yielding the CPU if it takes long) and retries if the trie changed.
+ *
+ * Removed nodes are not freed immediately as readers might still access them.
+ * Call shl_trie_reclaim() once all readers which were running during the
+ * removal have finished. The same applies to the removed entries, you must not
+ * free or modify them before. shl_trie_clear() must not run in parallel to
+ * any reader.
+ */
+static inline void shl_trie_zero_concurrent(struct shl_trie *trie)
+{
+	shl_trie_zero(trie);
+	trie->concurrent = true;
+}
+
+/*
+ * Reclaim retired nodes
+ * This frees all nodes that were removed from a concurrent trie since the last
+ * call. The caller must make sure no reader can still access them, see
+ * shl_trie_zero_concurrent(). This is a no-op for other tries.
+ */
+void shl_trie_reclaim(struct shl_trie *trie);
+
 /*
  * Clear a Trie
  * This traverses the given trie and calls @free_cb() on each node.
@@ -66,7 +147,8 @@ static inline void shl_trie_zero(struct shl_trie *trie)
  *
  * Once you cleared the trie, there is no more memory allocated. You're free to
  * destroy it or start inserting elements again. No need to call shl_trie_zero()
- * again.
+ * again. Arena-tries stay in arena mode and concurrent tries stay in concurrent
+ * mode.
  */
 void shl_trie_clear(struct shl_trie *trie,
 		    void (*free_cb) (uint8_t **e, void *ctx),
@@ -85,9 +167,8 @@ static inline void shl_trie_clear_str(struct shl_trie *trie,
 
 /*
  * Lookup an element
- * This searches the trie for a string @key. @keylen is the string-length of
- * @key. Note that @key must be zero-terminated. The length is only needed for
- * performance reasons. You may use strlen().
+ * This searches the trie for a key @key of length @keylen. The key may contain
+ * arbitrary binary data, it doesn't have to be zero-terminated.
  *
  * Returns false if the element couldn't be found. Otherwise, true is returned
  * and a pointer to the entry is returned in @out.
@@ -108,13 +189,36 @@ static inline bool shl_trie_lookup_str(struct shl_trie *trie, const char *str,
 			       (uint8_t***)out);
 }
 
+/*
+ * Longest-prefix Match
+ * This searches the trie for the longest stored key that is a prefix of @key
+ * (with length @keylen). This includes @key itself.
+ *
+ * Returns false if no stored key is a prefix of @key. Otherwise, true is
+ * returned and the entry is stored in @out (see shl_trie_lookup()) and its
+ * key-length in @outlen. Both may be NULL.
+ *
+ * This is about as fast as two lookups and does not allocate any memory.
+ */
+bool shl_trie_lookup_prefix(struct shl_trie *trie, const uint8_t *key,
+			    size_t keylen, uint8_t ***out, size_t *outlen);
+
+/* Same as shl_trie_lookup_prefix() but simplified for string operations. */
+static inline bool shl_trie_lookup_prefix_str(struct shl_trie *trie,
+					      const char *str, char ***out)
+{
+	return shl_trie_lookup_prefix(trie, (const uint8_t*)str, strlen(str),
+				      (uint8_t***)out, NULL);
+}
+
 /*
  * Insert an element
- * Insert a new element into the trie. The key is a zero-terminated string @key
- * (with string-length @keylen).
+ * Insert a new element into the trie. The key is @key with length @keylen. It
+ * may contain arbitrary binary data including zero bytes.
  * This function fails with -EALREADY if the key is already present and returns
  * the found duplicate in @out.
- * Returns 0 on success, -ENOMEM if out of memory.
+ * Returns 0 on success, -ENOMEM if out of memory, -E2BIG if @keylen exceeds
+ * UINT32_MAX.
  *
  * Note that the storage of @key must be valid as long as the element is stored
  * in the trie. The key is _not_ copied into the trie. In fact, even the storage
@@ -132,6 +236,32 @@ static inline int shl_trie_insert_str(struct shl_trie *trie, char **str,
 			       (uint8_t***)out);
 }
 
+/*
+ * Bulk-load a Trie
+ * Insert @num entries into the empty trie @trie. @entries is an array of
+ * entries, that is, pointers to the key-pointers (see shl_trie_insert()). @lens
+ * contains the key-lengths. If @lens is NULL, strlen() is used.
+ * The keys must be sorted in lexicographic order (shorter keys first) without
+ * duplicates.
+ *
+ * This builds the trie bottom-up in O(n) instead of searching the trie for each
+ * key. All nodes are allocated at once. For arena-tries, they are packed into a
+ * single slab.
+ *
+ * Returns 0 on success, -EINVAL if the trie is not empty or the keys are not
+ * sorted, -EFAULT if an entry is misaligned, -E2BIG if a key is longer than
+ * UINT32_MAX or -ENOMEM if out of memory. The trie is unchanged on failure.
+ */
+int shl_trie_load(struct shl_trie *trie, uint8_t ***entries,
+		  const size_t *lens, size_t num);
+
+/* Same as shl_trie_load() but simplified for strings. */
+static inline int shl_trie_load_str(struct shl_trie *trie, char ***entries,
+				    size_t num)
+{
+	return shl_trie_load(trie, (uint8_t***)entries, NULL, num);
+}
+
 /*
  * Remove an element
  * Search the trie for @key (with key-length @keylen). If not found, return
@@ -153,13 +283,15 @@ static inline bool shl_trie_remove_str(struct shl_trie *trie, const char *str,
 /*
  * Visit matching elements
  * This traverses the trie and visits elements with the given prefix @prefix
- * (with string-length @plen). If @prefix is NULL, @plen is ignored and the
- * whole trie is visited.
+ * (with length @plen). If @prefix is NULL, @plen is ignored and the whole trie
+ * is visited.
  * For each matching element, the callback do_cb() (if non-NULL) is called. You
  * can pass a context @ctx to the callbacks. It is left untouched by this code.
  *
  * You must not call any trie function from within the callbacks. The trie
  * itself is in an inconsistent state during the callback (to track state).
+ * Concurrent tries are an exception, they are visited via cursors and are
+ * never modified. See shl_trie_zero_concurrent().
  *
  * Note that prefix-search is _fast_. In fact, all elements with a common prefix
  * share the same sub-tree. So all this function does is find this sub-tree and
@@ -181,4 +313,159 @@ static inline void shl_trie_visit_str(struct shl_trie *trie,
 			      ctx);
 }
 
+/*
+ * Cursors
+ * A cursor points to a single entry of a trie and can be moved forwards and
+ * backwards in lexicographic order. Unlike shl_trie_visit(), cursors never
+ * modify the trie. So they can be paused and resumed at any time and you may
+ * use lookups and other cursors in parallel. You may even insert and remove
+ * entries between two cursor operations, as long as the entry the cursor
+ * points to stays valid.
+ *
+ * @entry is the current entry (see shl_trie_lookup()) or NULL if the cursor
+ * moved past the end of the trie. @len is the key-length of @entry. Do not
+ * modify these fields.
+ *
+ * Each cursor operation needs two descents into the trie, so it costs about
+ * as much as two lookups. No memory is allocated.
+ */
+struct shl_trie_cursor {
+	struct shl_trie *trie;
+	uint8_t **entry;
+	size_t len;
+};
+
+/*
+ * Position Cursors
+ * shl_trie_cursor_first() and shl_trie_cursor_last() move @cur to the smallest
+ * and biggest entry in @trie. shl_trie_cursor_seek() moves @cur to the
+ * smallest entry that is equal to or bigger than @key (with length @keylen).
+ * All return false if there is no such entry.
+ */
+bool shl_trie_cursor_first(struct shl_trie_cursor *cur,
+			   struct shl_trie *trie);
+bool shl_trie_cursor_last(struct shl_trie_cursor *cur, struct shl_trie *trie);
+bool shl_trie_cursor_seek(struct shl_trie_cursor *cur, struct shl_trie *trie,
+			  const uint8_t *key, size_t keylen);
+
+/* Same as shl_trie_cursor_seek() but with "const char" as key type. */
+static inline bool shl_trie_cursor_seek_str(struct shl_trie_cursor *cur,
+					    struct shl_trie *trie,
+					    const char *str)
+{
+	return shl_trie_cursor_seek(cur, trie, (const uint8_t*)str,
+				    strlen(str));
+}
+
+/*
+ * Move Cursors
+ * Move @cur to the next bigger or smaller entry. Returns false if there is no
+ * such entry. In this case @cur->entry is NULL and further calls are no-ops.
+ */
+bool shl_trie_cursor_next(struct shl_trie_cursor *cur);
+bool shl_trie_cursor_prev(struct shl_trie_cursor *cur);
+
+/*
+ * Visit a Range
+ * Visit all entries in the range [@from, @to) in lexicographic order. If @from
+ * is NULL, the range starts at the first entry. If @to is NULL, the range ends
+ * at the last entry.
+ * This uses cursors internally, so the trie is not modified. You may perform
+ * lookups from within the callback, but you must not free the storage of the
+ * current entry.
+ */
+void shl_trie_visit_range(struct shl_trie *trie,
+			  const uint8_t *from, size_t fromlen,
+			  const uint8_t *to, size_t tolen,
+			  void (*do_cb) (uint8_t **entry, void *ctx),
+			  void *ctx);
+
+/* Same as shl_trie_visit_range() but with "const char" as key type. */
+static inline void shl_trie_visit_range_str(struct shl_trie *trie,
+					    const char *from, const char *to,
+					    void (*do_cb) (char **entry,
+							   void *ctx),
+					    void *ctx)
+{
+	return shl_trie_visit_range(trie, (const uint8_t*)from,
+				    from ? strlen(from) : 0,
+				    (const uint8_t*)to, to ? strlen(to) : 0,
+				    (void(*)(uint8_t**, void*))do_cb,
+				    ctx);
+}
+
+/*
+ * Frozen Tries
+ * A trie can be frozen into a flat, pointer-free and read-only image. The image
+ * contains copies of all keys and can be written to a file and mmap()ed again.
+ * Lookups, prefix-visits and longest-prefix matches work directly on the image
+ * without any further setup or allocation.
+ *
+ * As user-entries are not part of the image, entries are identified by their
+ * index. Entries are numbered in lexicographic order starting at 0. So you
+ * can store your data in an array next to the image.
+ *
+ * Images are in host byte-order and are rejected on hosts with a different
+ * byte-order. Only the header and size of an image are verified when opened,
+ * so you must only open images you created yourself.
+ */
+struct shl_trie_frozen_node;
+struct shl_trie_frozen_entry;
+
+struct shl_trie_frozen {
+	uint32_t root;
+	size_t n_entries;
+	const struct shl_trie_frozen_node *nodes;
+	const struct shl_trie_frozen_entry *entries;
+	const uint8_t *keys;
+};
+
+/*
+ * Freeze a Trie
+ * Create an image of @trie. The image is allocated via malloc() and returned
+ * in @out, its size in @size. You must free() it when done.
+ * The trie is not modified, but writers must not run in parallel.
+ *
+ * Returns 0 on success, -ENOMEM if out of memory or -E2BIG if the trie is too
+ * big for the image format (2^31 entries or 4GiB of keys).
+ */
+int shl_trie_freeze(struct shl_trie *trie, void **out, size_t *size);
+
+/*
+ * Open a Frozen Trie
+ * Initialize @f to access the image @data of size @size. @data must be aligned
+ * to 8 bytes (which is true for malloc() and mmap()) and must stay valid as
+ * long as @f is used.
+ * Returns 0 on success or -EINVAL if @data is not a valid image.
+ */
+int shl_trie_frozen_open(struct shl_trie_frozen *f, const void *data,
+			 size_t size);
+
+/* Return the key (and its length in @len) of entry @index. */
+const uint8_t *shl_trie_frozen_key(const struct shl_trie_frozen *f,
+				   size_t index, size_t *len);
+
+/*
+ * Lookup in a Frozen Trie
+ * Same as shl_trie_lookup() and shl_trie_lookup_prefix() but the index of
+ * the found entry is returned in @index.
+ */
+bool shl_trie_frozen_lookup(const struct shl_trie_frozen *f,
+			    const uint8_t *key, size_t keylen, size_t *index);
+bool shl_trie_frozen_lookup_prefix(const struct shl_trie_frozen *f,
+				   const uint8_t *key, size_t keylen,
+				   size_t *index);
+
+/*
+ * Visit a Frozen Trie
+ * Same as shl_trie_visit() but the callback gets the index and key of each
+ * matching entry. Entries with a common prefix are stored next to each
+ * other, so this only needs to find the first and last of them.
+ */
+void shl_trie_frozen_visit(const struct shl_trie_frozen *f,
+			   const uint8_t *prefix, size_t plen,
+			   void (*do_cb) (size_t index, const uint8_t *key,
+					  size_t keylen, void *ctx),
+			   void *ctx);
+
 #endif  /* SHL_TRIE_H */
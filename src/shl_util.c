@@ -10,9 +10,11 @@
  */
 
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,9 +22,15 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 #include "shl_macro.h"
 #include "shl_util.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SIZEOF_INT128__)
+#include <cpuid.h>
+#define SHL_HAVE_TSC 1
+#endif
+
 /*
  * Strict atoi()
  * These helpers implement a strict version of atoi() (or strtol()). They only
@@ -90,6 +98,117 @@ static unsigned int shl__skip_base(const char **str, size_t *len)
 	return 10;
 }
 
+/*
+ * SWAR Digit Blocks
+ * For base 10 and 16 we parse blocks of 8 digits at once. The block is loaded
+ * as little-endian u64 and validated/converted with plain integer arithmetic,
+ * so the first character ends up in the lowest byte. A block is only used if
+ * all 8 bytes are valid digits, anything else is left to the per-digit loop.
+ * The per-byte range checks below rely on bytes being <0x80, which guarantees
+ * that no carry or borrow crosses byte boundaries.
+ */
+
+#define SHL__SWAR_L 0x0101010101010101ULL
+#define SHL__SWAR_H 0x8080808080808080ULL
+
+static inline uint64_t shl__swar_load(const char *str)
+{
+	uint64_t v;
+
+	memcpy(&v, str, sizeof(v));
+	return le64toh(v);
+}
+
+static inline bool shl__swar_dec8(uint64_t x, unsigned long long *out)
+{
+	uint64_t v;
+
+	/* high nibble must be 3 and low nibble must not exceed 9 */
+	if ((x & (0xf0 * SHL__SWAR_L)) != 0x30 * SHL__SWAR_L ||
+	    ((x + 0x06 * SHL__SWAR_L) & (0xf0 * SHL__SWAR_L)) !=
+							0x30 * SHL__SWAR_L)
+		return false;
+
+	/* combine pairs, quads and finally both halves */
+	v = x - 0x30 * SHL__SWAR_L;
+	v = v * 10 + (v >> 8);
+	v = ((v & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32)) +
+	     ((v >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32))) >> 32;
+
+	*out = v;
+	return true;
+}
+
+static inline bool shl__swar_hex8(uint64_t x, unsigned long long *out)
+{
+	uint64_t v, y, digit, alpha;
+
+	if (x & SHL__SWAR_H)
+		return false;
+
+	/* 0x80 bit is set in each byte that is within the range */
+	y = x | 0x20 * SHL__SWAR_L;
+	digit = ((x | SHL__SWAR_H) - 0x30 * SHL__SWAR_L) &
+		(0xb9 * SHL__SWAR_L - x) & SHL__SWAR_H;
+	alpha = ((y | SHL__SWAR_H) - 0x61 * SHL__SWAR_L) &
+		(0xe6 * SHL__SWAR_L - y) & SHL__SWAR_H;
+	if ((digit | alpha) != SHL__SWAR_H)
+		return false;
+
+	v = (x & 0x0f * SHL__SWAR_L) + (alpha >> 7) * 9;
+	v = ((v << 4) + (v >> 8)) & 0x00ff00ff00ff00ffULL;
+	v = ((v << 8) + (v >> 16)) & 0x0000ffff0000ffffULL;
+	v = ((v << 16) + (v >> 32)) & 0x00000000ffffffffULL;
+
+	*out = v;
+	return true;
+}
+
+/* parse leading 8-digit blocks, returns number of consumed characters */
+static size_t shl__atoi_swar(const char *str,
+			     size_t len,
+			     unsigned int base,
+			     unsigned long long *out,
+			     int *err)
+{
+	unsigned long long val, block;
+	size_t pos;
+	bool valid;
+
+	val = 0;
+
+	for (pos = 0; pos + 8 <= len; pos += 8) {
+		if (base == 10)
+			valid = shl__swar_dec8(shl__swar_load(&str[pos]),
+					       &block);
+		else
+			valid = shl__swar_hex8(shl__swar_load(&str[pos]),
+					       &block);
+		if (!valid)
+			break;
+
+		/* keep consuming digits on overflow, like the slow-path */
+		if (*err < 0)
+			continue;
+
+		if (base == 10) {
+			if (val > ULLONG_MAX / 100000000ULL ||
+			    val * 100000000ULL + block < val * 100000000ULL)
+				*err = -ERANGE;
+			else
+				val = val * 100000000ULL + block;
+		} else {
+			if (val >> 32)
+				*err = -ERANGE;
+			else
+				val = (val << 32) | block;
+		}
+	}
+
+	*out = val;
+	return pos;
+}
+
 int shl_atoi_ulln(const char *str,
 		  size_t len,
 		  unsigned int base,
@@ -122,7 +241,17 @@ int shl_atoi_ulln(const char *str,
 	if (base == 0)
 		base = shl__skip_base(&str, &len);
 
-	for (pos = 0; pos < len; ++pos) {
+	/* fast-path for common bases, one overflow check per 8 digits */
+	pos = 0;
+	if (base == 10 || base == 16) {
+		pos = shl__atoi_swar(str, len, base, &val2, &r);
+		if (val2 > UINT32_MAX)
+			huge = true;
+		else
+			val1 = val2;
+	}
+
+	for ( ; pos < len; ++pos) {
 		c = shl_ctoi(str[pos], base);
 		if (c < 0)
 			break;
@@ -144,6 +273,8 @@ int shl_atoi_ulln(const char *str,
 			r = shl_mult_ull(&val2, base);
 			if (r >= 0 && val2 + c >= val2)
 				val2 += c;
+			else
+				r = -ERANGE;
 		}
 	}
 
@@ -218,6 +349,122 @@ int shl_atoi_zn(const char *str,
 	return r;
 }
 
+/*
+ * Batch atoi()
+ * The vector variants parse a whole @sep-separated list of numbers into @out
+ * in a single pass, without splitting the string first. Each field must be a
+ * single number as accepted by shl_atoi_ulln() with the given base, so empty
+ * fields or trailing garbage are -EINVAL. An empty string has no fields.
+ * At most @max numbers are parsed. @num receives the number of parsed fields
+ * and @next points to the character after the last parsed field (the next
+ * separator or the end of the string), so callers can resume from there.
+ * If @errs is NULL, parsing stops at the first invalid field. @next then points
+ * to the start of that field and its error code is returned. Otherwise, the
+ * error of each field is stored in @errs, @out receives 0 or the saturated
+ * value for failed fields, and parsing always continues. The first error is
+ * still returned in that case.
+ */
+
+static int shl__atoi_vn(const char *str,
+			size_t len,
+			unsigned int base,
+			char sep,
+			const char **next,
+			unsigned long long limit,
+			unsigned long long *out_ull,
+			size_t *out_z,
+			size_t max,
+			size_t *num,
+			int *errs)
+{
+	const char *pos, *end, *lim;
+	unsigned long long v;
+	size_t n;
+	int r, err;
+
+	r = 0;
+	n = 0;
+	lim = str + len;
+	pos = str;
+	end = str;
+
+	while (len > 0 && n < max) {
+		err = shl_atoi_ulln(pos, lim - pos, base, &end, &v);
+		if (err >= 0 && (end == pos || (end < lim && *end != sep)))
+			err = -EINVAL;
+		if (err >= 0 && v > limit)
+			err = -ERANGE;
+
+		if (err < 0) {
+			if (!errs) {
+				r = err;
+				end = pos;
+				break;
+			}
+
+			if (r >= 0)
+				r = err;
+			if (err == -EINVAL)
+				v = 0;
+
+			/* skip the remainder of the invalid field */
+			if (end < lim && *end != sep) {
+				end = memchr(end, sep, lim - end);
+				if (!end)
+					end = lim;
+			}
+		}
+
+		if (out_ull)
+			out_ull[n] = v;
+		if (out_z)
+			out_z[n] = shl_min(v, limit);
+		if (errs)
+			errs[n] = err;
+		++n;
+
+		if (end >= lim)
+			break;
+
+		pos = end + 1;
+	}
+
+	if (next)
+		*next = end;
+	if (num)
+		*num = n;
+
+	return r;
+}
+
+int shl_atoi_ullvn(const char *str,
+		   size_t len,
+		   unsigned int base,
+		   char sep,
+		   const char **next,
+		   unsigned long long *out,
+		   size_t max,
+		   size_t *num,
+		   int *errs)
+{
+	return shl__atoi_vn(str, len, base, sep, next, ULLONG_MAX, out, NULL,
+			    max, num, errs);
+}
+
+int shl_atoi_zvn(const char *str,
+		 size_t len,
+		 unsigned int base,
+		 char sep,
+		 const char **next,
+		 size_t *out,
+		 size_t max,
+		 size_t *num,
+		 int *errs)
+{
+	return shl__atoi_vn(str, len, base, sep, next, SIZE_MAX, NULL, out,
+			    max, num, errs);
+}
+
 /*
  * Greedy Realloc
  * The greedy-realloc helpers simplify power-of-2 buffer allocations. If you
@@ -364,6 +611,105 @@ char *shl_strjoin(const char *first, ...) {
 	return str;
 }
 
+/*
+ * String Splitting
+ * All split helpers treat @sep as a set of separator characters and ignore
+ * empty tokens. The span-based helpers do not copy anything but return
+ * pointer/length pairs into the original string. They are built on top of
+ * shl_strsplit_iter, which uses memchr() for single-character separators and
+ * a 256-bit lookup table otherwise.
+ * shl_strsplit_packed_n() is like shl_strsplit_n() but puts the array and all
+ * strings into a single allocation. Free it with free(), not shl_strv_free().
+ */
+
+static inline bool shl__split_is_sep(struct shl_strsplit_iter *iter, char c)
+{
+	unsigned char u = c;
+
+	if (iter->sep)
+		return c == iter->sep;
+
+	return iter->map[u / 64] & (1ULL << (u % 64));
+}
+
+void shl_strsplit_iter_init(struct shl_strsplit_iter *iter,
+			    const char *str,
+			    size_t len,
+			    const char *sep)
+{
+	unsigned char u;
+
+	if (!str) {
+		str = "";
+		len = 0;
+	}
+
+	iter->pos = str;
+	iter->end = str + len;
+	iter->sep = 0;
+	memset(iter->map, 0, sizeof(iter->map));
+
+	if (sep[0] && !sep[1]) {
+		iter->sep = sep[0];
+	} else {
+		for ( ; *sep; ++sep) {
+			u = *sep;
+			iter->map[u / 64] |= 1ULL << (u % 64);
+		}
+	}
+}
+
+bool shl_strsplit_iter_next(struct shl_strsplit_iter *iter,
+			    struct shl_span *out)
+{
+	const char *pos, *end;
+
+	/* ignore empty tokens */
+	for (pos = iter->pos; pos < iter->end; ++pos)
+		if (!shl__split_is_sep(iter, *pos))
+			break;
+
+	if (pos >= iter->end) {
+		iter->pos = iter->end;
+		return false;
+	}
+
+	if (iter->sep) {
+		end = memchr(pos, iter->sep, iter->end - pos);
+		if (!end)
+			end = iter->end;
+	} else {
+		for (end = pos; end < iter->end; ++end)
+			if (shl__split_is_sep(iter, *end))
+				break;
+	}
+
+	out->str = pos;
+	out->len = end - pos;
+	iter->pos = end < iter->end ? end + 1 : end;
+
+	return true;
+}
+
+size_t shl_strsplit_span_n(const char *str,
+			   size_t len,
+			   const char *sep,
+			   struct shl_span *spans,
+			   size_t max)
+{
+	struct shl_strsplit_iter iter;
+	struct shl_span span;
+	size_t num;
+
+	/* like snprintf() we return the total number of tokens */
+	shl_strsplit_iter_init(&iter, str, len, sep);
+	for (num = 0; shl_strsplit_iter_next(&iter, &span); ++num)
+		if (num < max)
+			spans[num] = span;
+
+	return num;
+}
+
 static int shl__split_push(char ***strv,
 			   size_t *strv_num,
 			   size_t *strv_size,
@@ -378,6 +724,9 @@ static int shl__split_push(char ***strv,
 		return -ENOMEM;
 
 	ns = malloc(len + 1);
+	if (!ns)
+		return -ENOMEM;
+
 	memcpy(ns, str, len);
 	ns[len] = 0;
 
@@ -389,15 +738,14 @@ static int shl__split_push(char ***strv,
 
 int shl_strsplit_n(const char *str, size_t len, const char *sep, char ***out)
 {
+	struct shl_strsplit_iter iter;
+	struct shl_span span;
 	char **strv;
-	size_t i, j, strv_num, strv_size;
-	const char *pos;
+	size_t i, strv_num, strv_size;
 	int r;
 
 	if (!out || !sep)
 		return -EINVAL;
-	if (!str)
-		str = "";
 
 	strv_num = 0;
 	strv_size = sizeof(*strv);
@@ -405,36 +753,13 @@ int shl_strsplit_n(const char *str, size_t len, const char *sep, char ***out)
 	if (!strv)
 		return -ENOMEM;
 
-	pos = str;
-
-	for (i = 0; i < len; ++i) {
-		for (j = 0; sep[j]; ++j) {
-			if (str[i] != sep[j])
-				continue;
-
-			/* ignore empty tokens */
-			if (pos != &str[i]) {
-				r = shl__split_push(&strv,
-						    &strv_num,
-						    &strv_size,
-						    pos,
-						    &str[i] - pos);
-				if (r < 0)
-					goto error;
-			}
-
-			pos = &str[i + 1];
-			break;
-		}
-	}
-
-	/* copy trailing token if available */
-	if (i > 0 && pos != &str[i]) {
+	shl_strsplit_iter_init(&iter, str, len, sep);
+	while (shl_strsplit_iter_next(&iter, &span)) {
 		r = shl__split_push(&strv,
 				    &strv_num,
 				    &strv_size,
-				    pos,
-				    &str[i] - pos);
+				    span.str,
+				    span.len);
 		if (r < 0)
 			goto error;
 	}
@@ -460,6 +785,55 @@ int shl_strsplit(const char *str, const char *sep, char ***out)
 	return shl_strsplit_n(str, str ? strlen(str) : 0, sep, out);
 }
 
+int shl_strsplit_packed_n(const char *str,
+			  size_t len,
+			  const char *sep,
+			  char ***out)
+{
+	struct shl_strsplit_iter iter;
+	struct shl_span span;
+	size_t num, size;
+	char **strv, *p;
+
+	if (!out || !sep)
+		return -EINVAL;
+
+	/* count first, so the whole vector fits into one allocation */
+	num = 0;
+	size = 0;
+	shl_strsplit_iter_init(&iter, str, len, sep);
+	while (shl_strsplit_iter_next(&iter, &span)) {
+		++num;
+		size += span.len + 1;
+	}
+
+	if ((int)num < (ssize_t)num)
+		return -ENOMEM;
+
+	strv = malloc((num + 1) * sizeof(*strv) + size);
+	if (!strv)
+		return -ENOMEM;
+
+	p = (char*)&strv[num + 1];
+	num = 0;
+	shl_strsplit_iter_init(&iter, str, len, sep);
+	while (shl_strsplit_iter_next(&iter, &span)) {
+		strv[num++] = p;
+		memcpy(p, span.str, span.len);
+		p += span.len;
+		*p++ = 0;
+	}
+
+	strv[num] = NULL;
+	*out = strv;
+	return num;
+}
+
+int shl_strsplit_packed(const char *str, const char *sep, char ***out)
+{
+	return shl_strsplit_packed_n(str, str ? strlen(str) : 0, sep, out);
+}
+
 /*
  * strv
  */
@@ -509,87 +883,261 @@ char shl_qstr_unescape_char(char c)
 	}
 }
 
-void shl_qstr_decode_n(char *str, size_t length)
+/* decode @len bytes, starting in the given quote/escape state */
+static size_t shl__qstr_decode(char *dst,
+			       const char *src,
+			       size_t len,
+			       char *quotedp,
+			       bool *escapedp)
 {
 	size_t i;
 	bool escaped;
 	char *pos, c, quoted;
 
-	quoted = 0;
-	escaped = false;
-	pos = str;
+	quoted = *quotedp;
+	escaped = *escapedp;
+	pos = dst;
 
-	for (i = 0; i < length; ++i) {
+	for (i = 0; i < len; ++i) {
 		if (escaped) {
 			escaped = false;
-			c = shl_qstr_unescape_char(str[i]);
+			c = shl_qstr_unescape_char(src[i]);
 			if (c) {
 				*pos++ = c;
-			} else if (!str[i]) {
+			} else if (!src[i]) {
 				/* ignore binary 0 */
 			} else {
 				*pos++ = '\\';
-				*pos++ = str[i];
+				*pos++ = src[i];
 			}
 		} else if (quoted) {
-			if (str[i] == '\\')
+			if (src[i] == '\\')
 				escaped = true;
-			else if (str[i] == '"' && quoted == '"')
+			else if (src[i] == '"' && quoted == '"')
 				quoted = 0;
-			else if (str[i] == '\'' && quoted == '\'')
+			else if (src[i] == '\'' && quoted == '\'')
 				quoted = 0;
-			else if (!str[i])
+			else if (!src[i])
 				/* ignore binary 0 */ ;
 			else
-				*pos++ = str[i];
+				*pos++ = src[i];
 		} else {
-			if (str[i] == '\\')
+			if (src[i] == '\\')
 				escaped = true;
-			else if (str[i] == '"' || str[i] == '\'')
-				quoted = str[i];
-			else if (!str[i])
+			else if (src[i] == '"' || src[i] == '\'')
+				quoted = src[i];
+			else if (!src[i])
 				/* ignore binary 0 */ ;
 			else
-				*pos++ = str[i];
+				*pos++ = src[i];
 		}
 	}
 
+	*quotedp = quoted;
+	*escapedp = escaped;
+	return pos - dst;
+}
+
+void shl_qstr_decode_n(char *str, size_t length)
+{
+	size_t len;
+	bool escaped;
+	char quoted;
+
+	quoted = 0;
+	escaped = false;
+
+	len = shl__qstr_decode(str, str, length, &quoted, &escaped);
 	if (escaped)
-		*pos++ = '\\';
+		str[len++] = '\\';
+
+	str[len] = 0;
+}
+
+/*
+ * Streaming Tokenizer
+ * shl_qstr_tok splits a stream of quoted strings into tokens without copying
+ * or allocating anything. Input can be passed in arbitrary chunks; the state
+ * is carried over so a token, quote or escape sequence may cross chunk
+ * boundaries. Each call to shl_qstr_tok_next() returns a span into the current
+ * chunk. A token might thus be split into several spans, the last of which has
+ * SHL_QSTR_END set. If a chunk ends inside a token, the remainder is returned
+ * as partial span, so the chunk can be released right away.
+ * Spans without SHL_QSTR_RAW can be used verbatim, everything else has to be
+ * passed through shl_qstr_span_decode() (which can be done lazily, as the span
+ * carries the quote/escape state it started with).
+ * With SHL_QSTR_TOK_LINES, unquoted newlines terminate tokens, too, and are
+ * reported as empty span with only SHL_QSTR_EOL set.
+ */
+
+void shl_qstr_tok_init(struct shl_qstr_tok *tok, unsigned int flags)
+{
+	memset(tok, 0, sizeof(*tok));
+	tok->flags = flags;
+}
+
+bool shl_qstr_tok_next(struct shl_qstr_tok *tok,
+		       const char **buf,
+		       size_t *len,
+		       struct shl_qstr_span *out)
+{
+	const char *p, *e, *start;
+	bool lines, raw;
+	char c;
+
+	p = *buf;
+	e = p + *len;
+	lines = tok->flags & SHL_QSTR_TOK_LINES;
+
+	if (!tok->active) {
+		/* ignore multiple separators */
+		while (p < e && *p == ' ')
+			++p;
+
+		if (p < e && *p == '\n' && lines) {
+			out->str = p++;
+			out->len = 0;
+			out->flags = SHL_QSTR_EOL;
+			out->quoted = 0;
+			out->escaped = false;
+			goto done;
+		}
+
+		if (p >= e) {
+			*buf = p;
+			*len = 0;
+			return false;
+		}
+
+		tok->active = true;
+	} else if (p >= e) {
+		return false;
+	}
+
+	start = p;
+	out->quoted = tok->quoted;
+	out->escaped = tok->escaped;
+	raw = tok->quoted || tok->escaped;
+
+	for ( ; p < e; ++p) {
+		c = *p;
+
+		if (tok->escaped) {
+			tok->escaped = false;
+		} else if (c == '\\') {
+			tok->escaped = true;
+			raw = true;
+		} else if (tok->quoted) {
+			if (c == tok->quoted)
+				tok->quoted = 0;
+		} else if (c == '"' || c == '\'') {
+			tok->quoted = c;
+			raw = true;
+		} else if (c == ' ' || (c == '\n' && lines)) {
+			break;
+		} else if (!c) {
+			/* binary 0 is dropped during decoding */
+			raw = true;
+		}
+	}
+
+	out->str = start;
+	out->len = p - start;
+	out->flags = raw ? SHL_QSTR_RAW : 0;
+
+	if (p < e) {
+		out->flags |= SHL_QSTR_END;
+		tok->active = false;
+
+		/* newlines are reported separately on the next call */
+		if (*p == ' ')
+			++p;
+	}
+
+done:
+	*buf = p;
+	*len = e - p;
+	return true;
+}
+
+bool shl_qstr_tok_finish(struct shl_qstr_tok *tok, struct shl_qstr_span *out)
+{
+	if (!tok->active)
+		return false;
+
+	out->str = "";
+	out->len = 0;
+	out->flags = SHL_QSTR_END;
+	out->quoted = tok->quoted;
+	out->escaped = tok->escaped;
+	if (tok->quoted || tok->escaped)
+		out->flags |= SHL_QSTR_RAW;
+
+	shl_qstr_tok_init(tok, tok->flags);
+	return true;
+}
+
+size_t shl_qstr_span_decode(const struct shl_qstr_span *span, char *dst)
+{
+	size_t len;
+	bool escaped;
+	char quoted;
 
-	*pos = 0;
+	if (!(span->flags & SHL_QSTR_RAW)) {
+		memcpy(dst, span->str, span->len);
+		return span->len;
+	}
+
+	quoted = span->quoted;
+	escaped = span->escaped;
+
+	len = shl__qstr_decode(dst, span->str, span->len, &quoted, &escaped);
+	if (escaped && (span->flags & SHL_QSTR_END))
+		dst[len++] = '\\';
+
+	return len;
 }
 
 static int shl__qstr_push(char ***strv,
 			  size_t *strv_num,
 			  size_t *strv_size,
-			  const char *str,
-			  size_t len)
+			  char **token,
+			  size_t *token_len,
+			  const struct shl_qstr_span *span)
 {
 	size_t strv_need;
 	char *ns;
 
+	/* decoding grows by at most one byte, plus terminating 0 */
+	ns = realloc(*token, *token_len + span->len + 2);
+	if (!ns)
+		return -ENOMEM;
+
+	*token = ns;
+	*token_len += shl_qstr_span_decode(span, &ns[*token_len]);
+	ns[*token_len] = 0;
+
+	if (!(span->flags & SHL_QSTR_END))
+		return 0;
+
 	strv_need = (*strv_num + 2) * sizeof(**strv);
 	if (!shl_greedy_realloc0((void**)strv, strv_size, strv_need))
 		return -ENOMEM;
 
-	ns = malloc(len + 1);
-	memcpy(ns, str, len);
-	ns[len] = 0;
-
-	shl_qstr_decode_n(ns, len);
 	(*strv)[*strv_num] = ns;
 	*strv_num += 1;
+	*token = NULL;
+	*token_len = 0;
 
 	return 0;
 }
 
 int shl_qstr_tokenize_n(const char *str, size_t length, char ***out)
 {
-	char **strv, quoted;
-	size_t i, strv_num, strv_size;
-	const char *pos;
-	bool escaped;
+	struct shl_qstr_tok tok;
+	struct shl_qstr_span span;
+	char **strv, *token;
+	size_t i, strv_num, strv_size, token_len;
 	int r;
 
 	if (!out)
@@ -603,47 +1151,18 @@ int shl_qstr_tokenize_n(const char *str, size_t length, char ***out)
 	if (!strv)
 		return -ENOMEM;
 
-	quoted = 0;
-	escaped = false;
-	pos = str;
-
-	for (i = 0; i < length; ++i) {
-		if (escaped) {
-			escaped = false;
-		} else if (str[i] == '\\') {
-			escaped = true;
-		} else if (quoted) {
-			if (str[i] == '"' && quoted == '"')
-				quoted = 0;
-			else if (str[i] == '\'' && quoted == '\'')
-				quoted = 0;
-		} else if (str[i] == '"' && quoted == '"') {
-			quoted = '"';
-		} else if (str[i] == '\'' && quoted == '\'') {
-			quoted = '\'';
-		} else if (str[i] == ' ') {
-			/* ignore multiple separators */
-			if (pos != &str[i]) {
-				r = shl__qstr_push(&strv,
-						   &strv_num,
-						   &strv_size,
-						   pos,
-						   &str[i] - pos);
-				if (r < 0)
-					goto error;
-			}
-
-			pos = &str[i + 1];
-		}
-	}
+	token = NULL;
+	token_len = 0;
+	shl_qstr_tok_init(&tok, 0);
 
-	/* copy trailing token if available */
-	if (i > 0 && pos != &str[i]) {
+	while (shl_qstr_tok_next(&tok, &str, &length, &span) ||
+	       shl_qstr_tok_finish(&tok, &span)) {
 		r = shl__qstr_push(&strv,
 				   &strv_num,
 				   &strv_size,
-				   pos,
-				   &str[i] - pos);
+				   &token,
+				   &token_len,
+				   &span);
 		if (r < 0)
 			goto error;
 	}
@@ -658,6 +1177,7 @@ int shl_qstr_tokenize_n(const char *str, size_t length, char ***out)
 	return strv_num;
 
 error:
+	free(token);
 	for (i = 0; i < strv_num; ++i)
 		free(strv[i]);
 	free(strv);
@@ -894,6 +1414,273 @@ uint64_t shl_now(clockid_t clock)
 	       (uint64_t)ts.tv_nsec / 1000LL;
 }
 
+/*
+ * Clock Sources
+ * All sources return CLOCK_MONOTONIC microseconds. The TSC source is
+ * calibrated against CLOCK_MONOTONIC when selected: we sample both clocks,
+ * sleep 50ms and sample again. Afterwards, a timestamp is the anchor plus the
+ * TSC delta scaled by a 32.32 fixed-point factor, so reading it costs a rdtsc
+ * and a multiplication. We only allow it on CPUs with invariant TSC,
+ * otherwise frequency scaling would skew it.
+ * All math is done in nanoseconds, results are only truncated to microseconds
+ * on return. Still, a short calibration is off by a few ppm, so once a reader
+ * sees the anchor is older than a second, it re-anchors: the factor is
+ * re-measured over the whole interval since the last reference sample, and
+ * the remaining offset to CLOCK_MONOTONIC is slewed out over the next
+ * interval instead of stepping, so the clock never goes backwards. If
+ * CLOCK_MONOTONIC is more than SHL_TSC_STEP ahead (e.g., after suspend), we
+ * step forward. If it is that far behind, we cannot step back, so the clock
+ * runs at half speed until CLOCK_MONOTONIC caught up.
+ * The anchor is protected by a sequence count; readers never block, and a
+ * reader that loses the race to re-anchor just uses the old anchor.
+ */
+
+unsigned int shl__clock_source = SHL_CLOCK_PRECISE;
+__thread uint64_t shl__clock_cached;
+
+#ifdef SHL_HAVE_TSC
+
+#define SHL_TSC_WINDOW (50ULL * 1000ULL * 1000ULL)
+#define SHL_TSC_STEP (1000LL * 1000LL)
+
+static struct {
+	unsigned long seq;
+	uint64_t base_tsc;		/* output anchor */
+	uint64_t base_nsec;
+	uint64_t ref_tsc;		/* last reference sample */
+	uint64_t ref_nsec;
+	uint64_t mult;			/* nsecs per tick, 32.32 */
+	uint64_t rate;			/* @mult without slewing */
+	uint64_t period;		/* ticks between re-anchors, ~1s */
+} shl__tsc;
+
+static inline uint64_t shl__rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t shl__nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* sample both clocks; the TSC is the midpoint around the clock read */
+static void shl__tsc_sample(uint64_t *tsc, uint64_t *nsec)
+{
+	uint64_t c0, c1;
+
+	c0 = shl__rdtsc();
+	*nsec = shl__nsec();
+	c1 = shl__rdtsc();
+	*tsc = c0 + (c1 - c0) / 2;
+}
+
+/* nsecs at @tsc relative to the anchor; TSCs of other CPUs may lag a bit */
+static uint64_t shl__tsc_scale(uint64_t tsc,
+			       uint64_t base_tsc,
+			       uint64_t base_nsec,
+			       uint64_t mult)
+{
+	if (tsc <= base_tsc)
+		return base_nsec;
+
+	return base_nsec +
+	       (uint64_t)(((unsigned __int128)(tsc - base_tsc) * mult) >> 32);
+}
+
+static bool shl__tsc_lock(unsigned long seq)
+{
+	if (seq & 1)
+		return false;
+	if (!__atomic_compare_exchange_n(&shl__tsc.seq, &seq, seq + 1, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return true;
+}
+
+static void shl__tsc_store(uint64_t base_tsc,
+			   uint64_t base_nsec,
+			   uint64_t ref_tsc,
+			   uint64_t ref_nsec,
+			   uint64_t mult,
+			   uint64_t rate,
+			   uint64_t period)
+{
+	__atomic_store_n(&shl__tsc.base_tsc, base_tsc, __ATOMIC_RELAXED);
+	__atomic_store_n(&shl__tsc.base_nsec, base_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&shl__tsc.ref_tsc, ref_tsc, __ATOMIC_RELAXED);
+	__atomic_store_n(&shl__tsc.ref_nsec, ref_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&shl__tsc.mult, mult, __ATOMIC_RELAXED);
+	__atomic_store_n(&shl__tsc.rate, rate, __ATOMIC_RELAXED);
+	__atomic_store_n(&shl__tsc.period, period, __ATOMIC_RELAXED);
+
+	/* we own the odd count, so a plain increment releases the lock */
+	__atomic_add_fetch(&shl__tsc.seq, 1, __ATOMIC_RELEASE);
+}
+
+static int shl__tsc_calibrate(void)
+{
+	struct timespec ts = { .tv_nsec = SHL_TSC_WINDOW };
+	unsigned int a, b, c, d;
+	uint64_t t0, t1, c0, c1, mult;
+
+	/* invariant TSC is reported in CPUID 0x80000007 EDX bit 8 */
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1U << 8)))
+		return -EOPNOTSUPP;
+
+	shl__tsc_sample(&c0, &t0);
+	nanosleep(&ts, NULL);
+	shl__tsc_sample(&c1, &t1);
+
+	if (c1 <= c0 || t1 <= t0)
+		return -EOPNOTSUPP;
+
+	mult = (uint64_t)(((unsigned __int128)(t1 - t0) << 32) / (c1 - c0));
+	if (!mult)
+		return -EOPNOTSUPP;
+
+	while (!shl__tsc_lock(__atomic_load_n(&shl__tsc.seq, __ATOMIC_RELAXED)))
+		sched_yield();
+
+	shl__tsc_store(c1, t1, c1, t1, mult, mult,
+		       (uint64_t)((1000000000ULL << 32) / mult));
+	return 0;
+}
+
+/* called by the reader that won the lock, with the anchor it read */
+static uint64_t shl__tsc_anchor(uint64_t base_tsc,
+				uint64_t base_nsec,
+				uint64_t ref_tsc,
+				uint64_t ref_nsec,
+				uint64_t mult)
+{
+	uint64_t tsc, nsec, now, period, rate;
+	__int128 adj;
+	int64_t off;
+
+	/* we own the sequence count, nobody else writes @rate */
+	rate = shl__tsc.rate;
+
+	shl__tsc_sample(&tsc, &nsec);
+
+	/* current reading of the old anchor, where we continue from */
+	now = shl__tsc_scale(tsc, base_tsc, base_nsec, mult);
+	off = (int64_t)(nsec - now);
+
+	if (off > SHL_TSC_STEP || off < -SHL_TSC_STEP) {
+		/* the interval is bogus, too, so keep the rate */
+		period = (uint64_t)((1000000000ULL << 32) / rate);
+		if (off > 0) {
+			now = nsec;
+			mult = rate;
+		} else {
+			/* at half speed, we catch up after 2 * @off nsecs */
+			mult = rate / 2;
+			period = shl_min(period,
+				(uint64_t)(((unsigned __int128)-off << 33) /
+					   rate));
+		}
+	} else {
+		if (tsc > ref_tsc && nsec > ref_nsec)
+			rate = (uint64_t)(((unsigned __int128)(nsec - ref_nsec)
+					   << 32) / (tsc - ref_tsc));
+		period = (uint64_t)((1000000000ULL << 32) / rate);
+
+		/* slew @off out over the next period */
+		mult = rate;
+		adj = (__int128)off * ((__int128)1 << 32) / (__int128)period;
+		if ((__int128)mult + adj > 0)
+			mult = (uint64_t)((__int128)mult + adj);
+	}
+
+	shl__tsc_store(tsc, now, tsc, nsec, mult, rate, period);
+	return now;
+}
+
+static uint64_t shl__tsc_now(void)
+{
+	uint64_t tsc, base_tsc, base_nsec, ref_tsc, ref_nsec, mult, period;
+	unsigned long seq;
+
+	do {
+		seq = __atomic_load_n(&shl__tsc.seq, __ATOMIC_ACQUIRE);
+		base_tsc = __atomic_load_n(&shl__tsc.base_tsc,
+					   __ATOMIC_RELAXED);
+		base_nsec = __atomic_load_n(&shl__tsc.base_nsec,
+					    __ATOMIC_RELAXED);
+		ref_tsc = __atomic_load_n(&shl__tsc.ref_tsc, __ATOMIC_RELAXED);
+		ref_nsec = __atomic_load_n(&shl__tsc.ref_nsec,
+					   __ATOMIC_RELAXED);
+		mult = __atomic_load_n(&shl__tsc.mult, __ATOMIC_RELAXED);
+		period = __atomic_load_n(&shl__tsc.period, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&shl__tsc.seq, __ATOMIC_RELAXED));
+
+	tsc = shl__rdtsc();
+	if (tsc > base_tsc + period && shl__tsc_lock(seq))
+		return shl__tsc_anchor(base_tsc, base_nsec, ref_tsc, ref_nsec,
+				       mult) / 1000;
+
+	return shl__tsc_scale(tsc, base_tsc, base_nsec, mult) / 1000;
+}
+
+#endif
+
+int shl_clock_select(unsigned int source)
+{
+	int r;
+
+	switch (source) {
+	case SHL_CLOCK_PRECISE:
+	case SHL_CLOCK_COARSE:
+	case SHL_CLOCK_CACHED:
+		break;
+	case SHL_CLOCK_TSC:
+#ifdef SHL_HAVE_TSC
+		r = shl__tsc_calibrate();
+		if (r < 0)
+			return r;
+		break;
+#else
+		return -EOPNOTSUPP;
+#endif
+	default:
+		return -EINVAL;
+	}
+
+	__atomic_store_n(&shl__clock_source, source, __ATOMIC_RELEASE);
+	return 0;
+}
+
+uint64_t shl__clock_read(unsigned int source)
+{
+	switch (source) {
+	case SHL_CLOCK_COARSE:
+		return shl_now(CLOCK_MONOTONIC_COARSE);
+#ifdef SHL_HAVE_TSC
+	case SHL_CLOCK_TSC:
+		return shl__tsc_now();
+#endif
+	default:
+		return shl_now(CLOCK_MONOTONIC);
+	}
+}
+
+uint64_t shl_clock_update(void)
+{
+	shl__clock_cached = shl_now(CLOCK_MONOTONIC);
+	return shl__clock_cached;
+}
+
 /*
  * Ratelimit
  * Modelled after Linux' lib/ratelimit.c by Dave Young
@@ -902,24 +1689,121 @@ uint64_t shl_now(clockid_t clock)
 
 bool shl_ratelimit_test(struct shl_ratelimit *r)
 {
-	uint64_t ts;
+	uint64_t ts, begin;
+	unsigned num;
 
 	if (!r || r->interval <= 0 || r->burst <= 0)
 		return true;
 
-	ts = shl_now(CLOCK_MONOTONIC);
+	ts = shl_clock_now();
+	begin = __atomic_load_n(&r->begin, __ATOMIC_ACQUIRE);
 
-	if (r->begin <= 0 || r->begin + r->interval < ts) {
-		r->begin = ts;
-		r->num = 0;
-		goto good;
-	} else if (r->num < r->burst) {
-		goto good;
+	/* only the thread that moves @begin opens the new window */
+	if (begin <= 0 || begin + r->interval < ts) {
+		if (__atomic_compare_exchange_n(&r->begin, &begin, ts, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&r->num, 1, __ATOMIC_RELEASE);
+			return true;
+		}
 	}
 
-	return false;
+	/* never count past @burst so @num cannot wrap around */
+	num = __atomic_load_n(&r->num, __ATOMIC_RELAXED);
+	do {
+		if (num >= r->burst)
+			return false;
+	} while (!__atomic_compare_exchange_n(&r->num, &num, num + 1, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
 
-good:
-	++r->num;
 	return true;
 }
+
+/*
+ * Token Bucket
+ * This is the "generic cell rate algorithm": instead of a token count we store
+ * the time at which the bucket would be full again (@tat). Taking @num tokens
+ * moves it @num steps into the future, but never starts from the past. The
+ * request is denied if @tat would end up more than a full bucket ahead of now.
+ */
+
+bool shl_tokenbucket_take(struct shl_tokenbucket *tb, uint64_t num)
+{
+	uint64_t now, tat, next, cost;
+
+	if (!tb->step)
+		return true;
+
+	cost = num * tb->step;
+	if (cost > tb->depth || (num && cost / num != tb->step))
+		return false;
+
+	now = shl_clock_now() * 1000ULL;
+	tat = __atomic_load_n(&tb->tat, __ATOMIC_RELAXED);
+	do {
+		next = shl_max(tat, now) + cost;
+		if (next - now > tb->depth)
+			return false;
+	} while (!__atomic_compare_exchange_n(&tb->tat, &tat, next, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	return true;
+}
+
+int shl_tokenbucket_sharded_init(struct shl_tokenbucket_sharded *s,
+				 uint64_t interval,
+				 unsigned int burst,
+				 size_t shards)
+{
+	long cpus;
+	size_t i;
+	void *mem;
+	int r;
+
+	if (!burst)
+		return -EINVAL;
+
+	if (!shards) {
+		cpus = sysconf(_SC_NPROCESSORS_CONF);
+		shards = cpus > 0 ? cpus : 1;
+	}
+
+	/* each shard needs at least one token */
+	shards = shl_min(shards, (size_t)burst);
+
+	r = posix_memalign(&mem, sizeof(*s->shards),
+			   shards * sizeof(*s->shards));
+	if (r)
+		return -r;
+
+	s->num = shards;
+	s->shards = mem;
+
+	/* spread the burst so the shards add up to exactly @burst */
+	for (i = 0; i < shards; ++i)
+		SHL_TOKENBUCKET_INIT(s->shards[i].tb, interval,
+				     burst / shards + (i < burst % shards));
+
+	return 0;
+}
+
+void shl_tokenbucket_sharded_deinit(struct shl_tokenbucket_sharded *s)
+{
+	free(s->shards);
+	s->shards = NULL;
+	s->num = 0;
+}
+
+bool shl_tokenbucket_sharded_take(struct shl_tokenbucket_sharded *s,
+				  uint64_t num)
+{
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+
+	return shl_tokenbucket_take(&s->shards[cpu % s->num].tb, num);
+}
@@ -77,6 +77,51 @@ static inline int shl_atoi_z(const char *str,
 	return shl_atoi_zn(str, strlen(str), base, next, out);
 }
 
+int shl_atoi_ullvn(const char *str,
+		   size_t len,
+		   unsigned int base,
+		   char sep,
+		   const char **next,
+		   unsigned long long *out,
+		   size_t max,
+		   size_t *num,
+		   int *errs);
+int shl_atoi_zvn(const char *str,
+		 size_t len,
+		 unsigned int base,
+		 char sep,
+		 const char **next,
+		 size_t *out,
+		 size_t max,
+		 size_t *num,
+		 int *errs);
+
+static inline int shl_atoi_ullv(const char *str,
+				unsigned int base,
+				char sep,
+				const char **next,
+				unsigned long long *out,
+				size_t max,
+				size_t *num,
+				int *errs)
+{
+	return shl_atoi_ullvn(str, strlen(str), base, sep, next, out, max, num,
+			      errs);
+}
+
+static inline int shl_atoi_zv(const char *str,
+			      unsigned int base,
+			      char sep,
+			      const char **next,
+			      size_t *out,
+			      size_t max,
+			      size_t *num,
+			      int *errs)
+{
+	return shl_atoi_zvn(str, strlen(str), base, sep, next, out, max, num,
+			    errs);
+}
+
 /* greedy alloc */
 
 void *shl_greedy_realloc(void **mem, size_t *size, size_t need);
@@ -95,6 +140,35 @@ char *shl_strcat(const char *first, const char *second);
 _shl_sentinel_ char *shl_strjoin(const char *first, ...);
 int shl_strsplit_n(const char *str, size_t len, const char *sep, char ***out);
 int shl_strsplit(const char *str, const char *sep, char ***out);
+int shl_strsplit_packed_n(const char *str,
+			  size_t len,
+			  const char *sep,
+			  char ***out);
+int shl_strsplit_packed(const char *str, const char *sep, char ***out);
+
+struct shl_span {
+	const char *str;
+	size_t len;
+};
+
+struct shl_strsplit_iter {
+	const char *pos;
+	const char *end;
+	char sep;
+	uint64_t map[4];
+};
+
+void shl_strsplit_iter_init(struct shl_strsplit_iter *iter,
+			    const char *str,
+			    size_t len,
+			    const char *sep);
+bool shl_strsplit_iter_next(struct shl_strsplit_iter *iter,
+			    struct shl_span *out);
+size_t shl_strsplit_span_n(const char *str,
+			   size_t len,
+			   const char *sep,
+			   struct shl_span *spans,
+			   size_t max);
 
 static inline bool shl_isempty(const char *str)
 {
@@ -128,6 +202,41 @@ int shl_qstr_tokenize_n(const char *str, size_t length, char ***out);
 int shl_qstr_tokenize(const char *str, char ***out);
 int shl_qstr_join(char **strv, char **out);
 
+/* streaming tokenizer */
+
+enum shl_qstr_tok_flags {
+	SHL_QSTR_TOK_LINES	= (1 << 0),	/* newlines terminate lines */
+};
+
+enum shl_qstr_span_flags {
+	SHL_QSTR_RAW		= (1 << 0),	/* needs decoding */
+	SHL_QSTR_END		= (1 << 1),	/* last span of a token */
+	SHL_QSTR_EOL		= (1 << 2),	/* end of line, no token */
+};
+
+struct shl_qstr_span {
+	const char *str;
+	size_t len;
+	unsigned int flags;
+	char quoted;
+	bool escaped;
+};
+
+struct shl_qstr_tok {
+	unsigned int flags;
+	char quoted;
+	bool escaped;
+	bool active;
+};
+
+void shl_qstr_tok_init(struct shl_qstr_tok *tok, unsigned int flags);
+bool shl_qstr_tok_next(struct shl_qstr_tok *tok,
+		       const char **buf,
+		       size_t *len,
+		       struct shl_qstr_span *out);
+bool shl_qstr_tok_finish(struct shl_qstr_tok *tok, struct shl_qstr_span *out);
+size_t shl_qstr_span_decode(const struct shl_qstr_span *span, char *dst);
+
 /* mkdir */
 
 int shl_mkdir_p(const char *path, mode_t mode);
@@ -137,8 +246,56 @@ int shl_mkdir_p_prefix(const char *prefix, const char *path, mode_t mode);
 
 uint64_t shl_now(clockid_t clock);
 
+/*
+ * Clock Sources
+ * shl_clock_now() returns CLOCK_MONOTONIC microseconds from a process-wide
+ * selectable source, trading precision for speed:
+ *   SHL_CLOCK_PRECISE: clock_gettime(CLOCK_MONOTONIC), the default
+ *   SHL_CLOCK_COARSE: CLOCK_MONOTONIC_COARSE, lags by up to one kernel tick
+ *   SHL_CLOCK_TSC: calibrated TSC, re-anchored to CLOCK_MONOTONIC about once
+ *                  a second; x86 with invariant TSC only, otherwise
+ *                  shl_clock_select() fails with -EOPNOTSUPP. Selecting it
+ *                  blocks for the 50ms calibration.
+ *   SHL_CLOCK_CACHED: the value of the last shl_clock_update() call of the
+ *                     calling thread; call it once per event-loop iteration.
+ *                     Threads that never called it use SHL_CLOCK_PRECISE.
+ * shl_ratelimit_test() and the shl_log timestamps use shl_clock_now().
+ */
+
+enum shl_clock_source {
+	SHL_CLOCK_PRECISE,
+	SHL_CLOCK_COARSE,
+	SHL_CLOCK_TSC,
+	SHL_CLOCK_CACHED,
+};
+
+extern unsigned int shl__clock_source;
+extern __thread uint64_t shl__clock_cached;
+
+int shl_clock_select(unsigned int source);
+uint64_t shl_clock_update(void);
+uint64_t shl__clock_read(unsigned int source);
+
+static inline uint64_t shl_clock_now(void)
+{
+	unsigned int source;
+
+	source = __atomic_load_n(&shl__clock_source, __ATOMIC_ACQUIRE);
+	if (source == SHL_CLOCK_CACHED && shl__clock_cached)
+		return shl__clock_cached;
+
+	return shl__clock_read(source);
+}
+
 /* ratelimit */
 
+/*
+ * Ratelimit
+ * Fixed-window limiter: at most @burst events per @interval usecs. A single
+ * limiter may be shared between threads; the window reset is not exact under
+ * contention, so a few extra events might pass at window boundaries.
+ */
+
 struct shl_ratelimit {
 	uint64_t interval;
 	uint64_t begin;
@@ -147,7 +304,10 @@ struct shl_ratelimit {
 };
 
 #define SHL_RATELIMIT_DEFINE(_name, _interval, _burst) \
-	struct shl_ratelimit _name = { (_interval), (_burst), 0, 0 }
+	struct shl_ratelimit _name = { \
+		.interval = (_interval), \
+		.burst = (_burst), \
+	}
 
 #define SHL_RATELIMIT_INIT(_v, _interval, _burst) do { \
 		struct shl_ratelimit *_r = &(_v); \
@@ -165,4 +325,62 @@ struct shl_ratelimit {
 
 bool shl_ratelimit_test(struct shl_ratelimit *r);
 
+/*
+ * Token Bucket
+ * Lock-free token-bucket limiter. The bucket holds up to @burst tokens and is
+ * refilled continuously at @burst tokens per @interval usecs, so unlike
+ * shl_ratelimit there are no window boundaries and refill is fractional. The
+ * state is a single "theoretical arrival time" that is advanced via CAS, so any
+ * number of threads can share a bucket.
+ * @burst must be non-zero. If a token takes less than a nanosecond, the bucket
+ * never limits.
+ *
+ * For very high event rates, shl_tokenbucket_sharded splits the rate across
+ * per-CPU buckets on separate cache-lines. Each CPU then gets its share of the
+ * rate and burst, so the total is only exact if the load is spread evenly.
+ */
+
+struct shl_tokenbucket {
+	uint64_t tat;		/* theoretical arrival time in nsecs */
+	uint64_t step;		/* nsecs per token */
+	uint64_t depth;		/* bucket size in nsecs */
+};
+
+#define SHL_TOKENBUCKET_DEFINE(_name, _interval, _burst) \
+	struct shl_tokenbucket _name = { \
+		.step = (uint64_t)(_interval) * 1000ULL / (_burst), \
+		.depth = (uint64_t)(_interval) * 1000ULL, \
+	}
+
+#define SHL_TOKENBUCKET_INIT(_v, _interval, _burst) do { \
+		struct shl_tokenbucket *_t = &(_v); \
+		_t->tat = 0; \
+		_t->step = (uint64_t)(_interval) * 1000ULL / (_burst); \
+		_t->depth = (uint64_t)(_interval) * 1000ULL; \
+	} while (false)
+
+bool shl_tokenbucket_take(struct shl_tokenbucket *tb, uint64_t num);
+
+static inline bool shl_tokenbucket_test(struct shl_tokenbucket *tb)
+{
+	return shl_tokenbucket_take(tb, 1);
+}
+
+struct shl_tokenbucket_shard {
+	struct shl_tokenbucket tb;
+} __attribute__((__aligned__(64)));
+
+struct shl_tokenbucket_sharded {
+	size_t num;
+	struct shl_tokenbucket_shard *shards;
+};
+
+int shl_tokenbucket_sharded_init(struct shl_tokenbucket_sharded *s,
+				 uint64_t interval,
+				 unsigned int burst,
+				 size_t shards);
+void shl_tokenbucket_sharded_deinit(struct shl_tokenbucket_sharded *s);
+bool shl_tokenbucket_sharded_take(struct shl_tokenbucket_sharded *s,
+				  uint64_t num);
+
 #endif  /* SHL_UTIL_H */
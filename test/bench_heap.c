@@ -0,0 +1,275 @@
+/*
+ * SHL - Priority Queue Benchmark
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+/*
+ * Priority Queue Benchmark
+ * This compares shl_heap against shl_rbtree and a sorted shl_dlist when used
+ * as priority queue. For each structure we measure insert, update (change the
+ * key of a random element), remove (of random elements) and pop throughput.
+ * The sorted list is O(n) per insertion, so it is only run for small sizes.
+ *
+ * Results are printed in the same key=value format as bench_trie:
+ *   impl=heap n=100000 op=pop ns_per_op=96.3 ops_per_s=10384215
+ *
+ * Usage: bench_heap [num-elements]
+ *
+ * This is not part of the test-suite. Run it manually on an otherwise idle
+ * machine with an optimized build.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "shl_dlist.h"
+#include "shl_heap.h"
+#include "shl_rbtree.h"
+
+struct bench_obj {
+	uint64_t key;
+	struct shl_heap_node heap;
+	struct shl_rbnode rb;
+	struct shl_dlist list;
+};
+
+struct bench_ctx {
+	size_t n;
+	struct bench_obj *objs;
+	struct shl_heap heap;
+	struct shl_rbtree rb;
+	struct shl_dlist list;
+};
+
+struct bench_impl {
+	const char *name;
+	size_t max;
+	void (*insert) (struct bench_ctx *c, struct bench_obj *o);
+	void (*remove) (struct bench_ctx *c, struct bench_obj *o);
+	struct bench_obj *(*pop) (struct bench_ctx *c);
+};
+
+/*
+ * Helpers
+ */
+
+static uint64_t bench_rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t bench_rand(void)
+{
+	/* xorshift64*, deterministic so runs are comparable */
+	bench_rng ^= bench_rng >> 12;
+	bench_rng ^= bench_rng << 25;
+	bench_rng ^= bench_rng >> 27;
+	return bench_rng * 2685821657736338717ULL;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_print(const char *impl, size_t n, const char *op,
+			uint64_t ns, size_t ops)
+{
+	double per_op;
+
+	per_op = ops ? (double)ns / ops : 0;
+	printf("impl=%s n=%zu op=%s ns_per_op=%.1f ops_per_s=%.0f\n",
+	       impl, n, op, per_op, per_op > 0 ? 1e9 / per_op : 0);
+}
+
+/*
+ * Implementations
+ */
+
+static int bench_heap_cmp(const struct shl_heap_node *a,
+			  const struct shl_heap_node *b)
+{
+	uint64_t x = shl_heap_entry(a, struct bench_obj, heap)->key;
+	uint64_t y = shl_heap_entry(b, struct bench_obj, heap)->key;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_heap_insert(struct bench_ctx *c, struct bench_obj *o)
+{
+	if (shl_heap_insert(&c->heap, &o->heap) < 0)
+		abort();
+}
+
+static void bench_heap_remove(struct bench_ctx *c, struct bench_obj *o)
+{
+	shl_heap_remove(&c->heap, &o->heap);
+}
+
+static struct bench_obj *bench_heap_pop(struct bench_ctx *c)
+{
+	struct shl_heap_node *n;
+
+	n = shl_heap_pop(&c->heap);
+	return n ? shl_heap_entry(n, struct bench_obj, heap) : NULL;
+}
+
+static int bench_rb_cmp(const struct shl_rbnode *a, const struct shl_rbnode *b)
+{
+	uint64_t x = shl_rbtree_entry(a, struct bench_obj, rb)->key;
+	uint64_t y = shl_rbtree_entry(b, struct bench_obj, rb)->key;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_rb_insert(struct bench_ctx *c, struct bench_obj *o)
+{
+	shl_rbtree_insert(&c->rb, &o->rb, bench_rb_cmp);
+}
+
+static void bench_rb_remove(struct bench_ctx *c, struct bench_obj *o)
+{
+	shl_rbtree_remove(&c->rb, &o->rb);
+}
+
+static struct bench_obj *bench_rb_pop(struct bench_ctx *c)
+{
+	struct shl_rbnode *n;
+
+	n = shl_rbtree_first(&c->rb);
+	if (!n)
+		return NULL;
+
+	shl_rbtree_remove(&c->rb, n);
+	return shl_rbtree_entry(n, struct bench_obj, rb);
+}
+
+static void bench_list_insert(struct bench_ctx *c, struct bench_obj *o)
+{
+	struct shl_dlist *iter;
+
+	shl_dlist_for_each(iter, &c->list)
+		if (shl_dlist_entry(iter, struct bench_obj, list)->key > o->key)
+			break;
+
+	shl_dlist_link_tail(iter, &o->list);
+}
+
+static void bench_list_remove(struct bench_ctx *c, struct bench_obj *o)
+{
+	shl_dlist_unlink(&o->list);
+}
+
+static struct bench_obj *bench_list_pop(struct bench_ctx *c)
+{
+	struct bench_obj *o;
+
+	if (shl_dlist_empty(&c->list))
+		return NULL;
+
+	o = shl_dlist_first_entry(&c->list, struct bench_obj, list);
+	shl_dlist_unlink(&o->list);
+	return o;
+}
+
+static const struct bench_impl bench_impls[] = {
+	{ "heap", SIZE_MAX, bench_heap_insert, bench_heap_remove,
+	  bench_heap_pop },
+	{ "rbtree", SIZE_MAX, bench_rb_insert, bench_rb_remove,
+	  bench_rb_pop },
+	{ "dlist", 10000, bench_list_insert, bench_list_remove,
+	  bench_list_pop },
+};
+
+/*
+ * Benchmark Runner
+ */
+
+static void bench_run(struct bench_ctx *c, const struct bench_impl *impl)
+{
+	struct bench_obj *o;
+	uint64_t start, ns, last;
+	size_t i, num;
+
+	bench_rng = 0x9e3779b97f4a7c15ULL;
+	for (i = 0; i < c->n; ++i)
+		c->objs[i].key = bench_rand();
+
+	start = bench_now();
+	for (i = 0; i < c->n; ++i)
+		impl->insert(c, &c->objs[i]);
+	ns = bench_now() - start;
+	bench_print(impl->name, c->n, "insert", ns, c->n);
+
+	/* update is remove + insert for all but the heap */
+	start = bench_now();
+	for (i = 0; i < c->n; ++i) {
+		o = &c->objs[bench_rand() % c->n];
+		o->key = bench_rand();
+		if (impl->insert == bench_heap_insert) {
+			shl_heap_update(&c->heap, &o->heap);
+		} else {
+			impl->remove(c, o);
+			impl->insert(c, o);
+		}
+	}
+	ns = bench_now() - start;
+	bench_print(impl->name, c->n, "update", ns, c->n);
+
+	start = bench_now();
+	for (i = 0; i < c->n; i += 2)
+		impl->remove(c, &c->objs[i]);
+	ns = bench_now() - start;
+	bench_print(impl->name, c->n, "remove", ns, (c->n + 1) / 2);
+
+	num = 0;
+	last = 0;
+	start = bench_now();
+	while ((o = impl->pop(c))) {
+		if (o->key < last)
+			abort();
+		last = o->key;
+		++num;
+	}
+	ns = bench_now() - start;
+	bench_print(impl->name, c->n, "pop", ns, num);
+
+	if (num != c->n / 2)
+		abort();
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_ctx c = { };
+	size_t n = 100000, i;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	if (!n) {
+		fprintf(stderr, "usage: %s [num-elements]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < sizeof(bench_impls) / sizeof(*bench_impls); ++i) {
+		c.n = shl_min(n, bench_impls[i].max);
+		c.objs = calloc(c.n, sizeof(*c.objs));
+		if (!c.objs)
+			abort();
+
+		shl_heap_init(&c.heap, bench_heap_cmp);
+		shl_rbtree_init(&c.rb);
+		shl_dlist_init(&c.list);
+
+		bench_run(&c, &bench_impls[i]);
+
+		shl_heap_clear(&c.heap);
+		free(c.objs);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,644 @@
+/*
+ * SHL - Trie/HTable Benchmark
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+/*
+ * Trie/HTable Benchmark
+ * This compares shl_trie (in normal and arena mode), shl_art and shl_htable on
+ * different key sets. For each set and structure, we measure insert,
+ * lookup-hit, lookup-miss, prefix-visit and remove throughput and the RSS
+ * growth while the structure is filled.
+ *
+ * Each result is printed as a single line of space-separated key=value pairs
+ * so results can be compared with simple scripts:
+ *   set=url impl=trie n=100000 op=lookup_hit ns_per_op=81.2 ops_per_s=12315271
+ *
+ * Usage: bench_trie [num-keys [prefix-queries]]
+ *
+ * Each structure is benchmarked in its own child process so the RSS growth is
+ * not hidden by memory that a previous run released to malloc.
+ *
+ * This is not part of the test-suite. Run it manually on an otherwise idle
+ * machine with an optimized build.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shl_art.h"
+#include "shl_htable.h"
+#include "shl_trie.h"
+
+struct bench_set {
+	const char *name;
+	bool binary;
+	size_t n;
+	uint8_t **keys;
+	size_t *lens;
+	uint8_t **miss;
+	size_t *misslens;
+};
+
+struct bench_bkey {
+	uint8_t *key;
+	size_t len;
+};
+
+struct bench_ctx {
+	struct bench_set *set;
+	struct shl_trie trie;
+	struct shl_art art;
+	struct shl_htable htable;
+	struct bench_bkey *bkeys;
+	size_t visited;
+	const uint8_t *prefix;
+	size_t plen;
+};
+
+struct bench_impl {
+	const char *name;
+	bool binary;
+	void (*setup) (struct bench_ctx *c);
+	int (*insert) (struct bench_ctx *c, size_t i);
+	bool (*lookup) (struct bench_ctx *c, const uint8_t *key, size_t len);
+	bool (*remove) (struct bench_ctx *c, size_t i);
+	size_t (*visit) (struct bench_ctx *c, const uint8_t *prefix,
+			 size_t plen);
+	void (*teardown) (struct bench_ctx *c);
+};
+
+/*
+ * Helpers
+ */
+
+static uint64_t bench_rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t bench_rand(void)
+{
+	/* xorshift64*, deterministic so runs are comparable */
+	bench_rng ^= bench_rng >> 12;
+	bench_rng ^= bench_rng << 25;
+	bench_rng ^= bench_rng >> 27;
+	return bench_rng * 2685821657736338717ULL;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t bench_rss(void)
+{
+	unsigned long size, rss;
+	FILE *f;
+	int r;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+
+	r = fscanf(f, "%lu %lu", &size, &rss);
+	fclose(f);
+	if (r != 2)
+		return 0;
+
+	return rss * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void bench_print(const char *set, const char *impl, size_t n,
+			const char *op, uint64_t ns, size_t ops)
+{
+	double per_op;
+
+	per_op = ops ? (double)ns / ops : 0;
+	printf("set=%s impl=%s n=%zu op=%s ns_per_op=%.1f ops_per_s=%.0f\n",
+	       set, impl, n, op, per_op, per_op > 0 ? 1e9 / per_op : 0);
+}
+
+/*
+ * Key Sets
+ * All key sets append the key-index to make keys unique. Miss-keys are
+ * generated the same way but carry a different index-range.
+ */
+
+static const char *bench_words[] = {
+	"api", "v1", "v2", "users", "posts", "comments", "static", "img",
+	"css", "js", "admin", "settings", "org", "freedesktop", "systemd",
+	"login", "network", "resolve", "kernel", "device", "input", "display",
+};
+
+#define BENCH_WORDS (sizeof(bench_words) / sizeof(*bench_words))
+
+static size_t bench_key_random(char *buf, size_t idx)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	size_t i, len;
+
+	len = 8 + bench_rand() % 24;
+	for (i = 0; i < len; ++i)
+		buf[i] = chars[bench_rand() % (sizeof(chars) - 1)];
+
+	return len + sprintf(&buf[len], "%zx", idx);
+}
+
+static size_t bench_key_url(char *buf, size_t idx)
+{
+	size_t i, depth, len = 0;
+
+	depth = 2 + bench_rand() % 4;
+	for (i = 0; i < depth; ++i)
+		len += sprintf(&buf[len], "/%s",
+			       bench_words[bench_rand() % BENCH_WORDS]);
+
+	return len + sprintf(&buf[len], "/%zu", idx);
+}
+
+static size_t bench_key_dotted(char *buf, size_t idx)
+{
+	size_t i, depth, len = 0;
+
+	depth = 3 + bench_rand() % 3;
+	for (i = 0; i < depth; ++i)
+		len += sprintf(&buf[len], "%s.",
+			       bench_words[bench_rand() % BENCH_WORDS]);
+
+	return len + sprintf(&buf[len], "Object%zu", idx);
+}
+
+static size_t bench_key_binary(char *buf, size_t idx)
+{
+	size_t i;
+	uint64_t r;
+
+	/* 16 random bytes, every 4th byte is zero */
+	for (i = 0; i < 16; ++i) {
+		r = bench_rand();
+		buf[i] = (r & 3) ? (char)(r >> 8) : 0;
+	}
+
+	memcpy(buf, &idx, sizeof(uint32_t));
+	return 16;
+}
+
+static uint8_t *bench_dup(const char *buf, size_t len)
+{
+	uint8_t *k;
+
+	k = malloc(len + 1);
+	if (!k)
+		abort();
+
+	memcpy(k, buf, len);
+	k[len] = 0;
+	return k;
+}
+
+static void bench_set_init(struct bench_set *set, const char *name,
+			   size_t (*gen) (char *buf, size_t idx), bool binary,
+			   size_t n)
+{
+	char buf[256];
+	size_t i;
+
+	set->name = name;
+	set->binary = binary;
+	set->n = n;
+	set->keys = calloc(n, sizeof(*set->keys));
+	set->lens = calloc(n, sizeof(*set->lens));
+	set->miss = calloc(n, sizeof(*set->miss));
+	set->misslens = calloc(n, sizeof(*set->misslens));
+	if (!set->keys || !set->lens || !set->miss || !set->misslens)
+		abort();
+
+	for (i = 0; i < n; ++i) {
+		set->lens[i] = gen(buf, i);
+		set->keys[i] = bench_dup(buf, set->lens[i]);
+		set->misslens[i] = gen(buf, n + i);
+		set->miss[i] = bench_dup(buf, set->misslens[i]);
+	}
+}
+
+static void bench_set_destroy(struct bench_set *set)
+{
+	size_t i;
+
+	for (i = 0; i < set->n; ++i) {
+		free(set->keys[i]);
+		free(set->miss[i]);
+	}
+
+	free(set->keys);
+	free(set->lens);
+	free(set->miss);
+	free(set->misslens);
+}
+
+/*
+ * Implementations
+ */
+
+static void bench_trie_setup(struct bench_ctx *c)
+{
+	shl_trie_zero(&c->trie);
+}
+
+static void bench_trie_arena_setup(struct bench_ctx *c)
+{
+	shl_trie_zero_arena(&c->trie);
+}
+
+static int bench_trie_insert(struct bench_ctx *c, size_t i)
+{
+	return shl_trie_insert(&c->trie, &c->set->keys[i], c->set->lens[i],
+			       NULL);
+}
+
+static bool bench_trie_lookup(struct bench_ctx *c, const uint8_t *key,
+			      size_t len)
+{
+	return shl_trie_lookup(&c->trie, key, len, NULL);
+}
+
+static bool bench_trie_remove(struct bench_ctx *c, size_t i)
+{
+	return shl_trie_remove(&c->trie, c->set->keys[i], c->set->lens[i],
+			       NULL);
+}
+
+static void bench_trie_visit_cb(uint8_t **key, void *ctx)
+{
+	struct bench_ctx *c = ctx;
+
+	++c->visited;
+}
+
+static size_t bench_trie_visit(struct bench_ctx *c, const uint8_t *prefix,
+			       size_t plen)
+{
+	c->visited = 0;
+	shl_trie_visit(&c->trie, prefix, plen, bench_trie_visit_cb, c);
+	return c->visited;
+}
+
+static void bench_trie_teardown(struct bench_ctx *c)
+{
+	shl_trie_clear(&c->trie, NULL, NULL);
+}
+
+static void bench_art_setup(struct bench_ctx *c)
+{
+	shl_art_zero(&c->art);
+}
+
+static int bench_art_insert(struct bench_ctx *c, size_t i)
+{
+	return shl_art_insert(&c->art, &c->set->keys[i], c->set->lens[i],
+			      NULL);
+}
+
+static bool bench_art_lookup(struct bench_ctx *c, const uint8_t *key,
+			     size_t len)
+{
+	return shl_art_lookup(&c->art, key, len, NULL);
+}
+
+static bool bench_art_remove(struct bench_ctx *c, size_t i)
+{
+	return shl_art_remove(&c->art, c->set->keys[i], c->set->lens[i], NULL);
+}
+
+static size_t bench_art_visit(struct bench_ctx *c, const uint8_t *prefix,
+			      size_t plen)
+{
+	c->visited = 0;
+	shl_art_visit(&c->art, prefix, plen, bench_trie_visit_cb, c);
+	return c->visited;
+}
+
+static void bench_art_teardown(struct bench_ctx *c)
+{
+	shl_art_clear(&c->art, NULL, NULL);
+}
+
+/* string keys use the shl_htable_*_str() helpers */
+
+static void bench_htable_setup(struct bench_ctx *c)
+{
+	shl_htable_init_str(&c->htable);
+}
+
+static int bench_htable_insert(struct bench_ctx *c, size_t i)
+{
+	return shl_htable_insert_str(&c->htable, (char**)&c->set->keys[i],
+				     NULL);
+}
+
+static bool bench_htable_lookup(struct bench_ctx *c, const uint8_t *key,
+				size_t len)
+{
+	return shl_htable_lookup_str(&c->htable, (const char*)key, NULL,
+				     NULL);
+}
+
+static bool bench_htable_remove(struct bench_ctx *c, size_t i)
+{
+	return shl_htable_remove_str(&c->htable, (const char*)c->set->keys[i],
+				     NULL, NULL);
+}
+
+static void bench_htable_visit_cb(char **key, void *ctx)
+{
+	struct bench_ctx *c = ctx;
+
+	if (!strncmp(*key, (const char*)c->prefix, c->plen))
+		++c->visited;
+}
+
+/* hash tables have no order, so prefix-visits need a full scan */
+static size_t bench_htable_visit(struct bench_ctx *c, const uint8_t *prefix,
+				 size_t plen)
+{
+	c->visited = 0;
+	c->prefix = prefix;
+	c->plen = plen;
+	shl_htable_visit_str(&c->htable, bench_htable_visit_cb, c);
+	return c->visited;
+}
+
+static void bench_htable_teardown(struct bench_ctx *c)
+{
+	shl_htable_clear_str(&c->htable, NULL, NULL);
+}
+
+/* binary keys need their own compare and hash functions */
+
+static bool bench_bkey_compare(const void *a, const void *b)
+{
+	const struct bench_bkey *x = a, *y = b;
+
+	return x->len == y->len && !memcmp(x->key, y->key, x->len);
+}
+
+static size_t bench_bkey_hash(const uint8_t *key, size_t len)
+{
+	size_t i, hash = 5381;
+
+	for (i = 0; i < len; ++i)
+		hash = (hash << 5) + hash + key[i];
+
+	return hash;
+}
+
+static size_t bench_bkey_rehash(const void *elem, void *priv)
+{
+	const struct bench_bkey *k = elem;
+
+	return bench_bkey_hash(k->key, k->len);
+}
+
+static void bench_bhtable_setup(struct bench_ctx *c)
+{
+	size_t i;
+
+	shl_htable_init(&c->htable, bench_bkey_compare, bench_bkey_rehash,
+			NULL);
+
+	c->bkeys = calloc(c->set->n, sizeof(*c->bkeys));
+	if (!c->bkeys)
+		abort();
+
+	for (i = 0; i < c->set->n; ++i) {
+		c->bkeys[i].key = c->set->keys[i];
+		c->bkeys[i].len = c->set->lens[i];
+	}
+}
+
+static int bench_bhtable_insert(struct bench_ctx *c, size_t i)
+{
+	return shl_htable_insert(&c->htable, &c->bkeys[i],
+				 bench_bkey_hash(c->bkeys[i].key,
+						 c->bkeys[i].len));
+}
+
+static bool bench_bhtable_lookup(struct bench_ctx *c, const uint8_t *key,
+				 size_t len)
+{
+	struct bench_bkey k = { (uint8_t*)key, len };
+
+	return shl_htable_lookup(&c->htable, &k, bench_bkey_hash(key, len),
+				 NULL);
+}
+
+static bool bench_bhtable_remove(struct bench_ctx *c, size_t i)
+{
+	return shl_htable_remove(&c->htable, &c->bkeys[i],
+				 bench_bkey_hash(c->bkeys[i].key,
+						 c->bkeys[i].len),
+				 NULL);
+}
+
+static void bench_bhtable_visit_cb(void *elem, void *ctx)
+{
+	struct bench_bkey *k = elem;
+	struct bench_ctx *c = ctx;
+
+	if (k->len >= c->plen && !memcmp(k->key, c->prefix, c->plen))
+		++c->visited;
+}
+
+static size_t bench_bhtable_visit(struct bench_ctx *c, const uint8_t *prefix,
+				  size_t plen)
+{
+	c->visited = 0;
+	c->prefix = prefix;
+	c->plen = plen;
+	shl_htable_visit(&c->htable, bench_bhtable_visit_cb, c);
+	return c->visited;
+}
+
+static void bench_bhtable_teardown(struct bench_ctx *c)
+{
+	shl_htable_clear(&c->htable, NULL, NULL);
+	free(c->bkeys);
+	c->bkeys = NULL;
+}
+
+static const struct bench_impl bench_impls[] = {
+	{ "trie", true, bench_trie_setup, bench_trie_insert,
+	  bench_trie_lookup, bench_trie_remove, bench_trie_visit,
+	  bench_trie_teardown },
+	{ "trie_arena", true, bench_trie_arena_setup, bench_trie_insert,
+	  bench_trie_lookup, bench_trie_remove, bench_trie_visit,
+	  bench_trie_teardown },
+	{ "art", false, bench_art_setup, bench_art_insert,
+	  bench_art_lookup, bench_art_remove, bench_art_visit,
+	  bench_art_teardown },
+	{ "htable", false, bench_htable_setup, bench_htable_insert,
+	  bench_htable_lookup, bench_htable_remove, bench_htable_visit,
+	  bench_htable_teardown },
+	{ "htable", true, bench_bhtable_setup, bench_bhtable_insert,
+	  bench_bhtable_lookup, bench_bhtable_remove, bench_bhtable_visit,
+	  bench_bhtable_teardown },
+};
+
+/*
+ * Benchmark Runner
+ */
+
+static void bench_run(struct bench_set *set, const struct bench_impl *impl,
+		      size_t queries)
+{
+	struct bench_ctx c = { .set = set, };
+	uint64_t start, ns;
+	size_t i, j, hits, rss, plen, visited;
+	int r;
+
+	/* htable visits are full scans, limit them */
+	if (impl->visit == bench_htable_visit ||
+	    impl->visit == bench_bhtable_visit)
+		queries = queries / 100 + 1;
+
+	impl->setup(&c);
+
+	rss = bench_rss();
+	start = bench_now();
+	for (i = 0; i < set->n; ++i) {
+		r = impl->insert(&c, i);
+		if (r < 0) {
+			fprintf(stderr, "insert failed (%d): %s/%s\n", r,
+				set->name, impl->name);
+			abort();
+		}
+	}
+	ns = bench_now() - start;
+	bench_print(set->name, impl->name, set->n, "insert", ns, set->n);
+	printf("set=%s impl=%s n=%zu op=rss rss_kib=%zu\n", set->name,
+	       impl->name, set->n, (bench_rss() - rss) / 1024);
+
+	hits = 0;
+	start = bench_now();
+	for (i = 0; i < set->n; ++i)
+		hits += impl->lookup(&c, set->keys[i], set->lens[i]);
+	ns = bench_now() - start;
+	bench_print(set->name, impl->name, set->n, "lookup_hit", ns, set->n);
+	if (hits != set->n)
+		abort();
+
+	hits = 0;
+	start = bench_now();
+	for (i = 0; i < set->n; ++i)
+		hits += impl->lookup(&c, set->miss[i], set->misslens[i]);
+	ns = bench_now() - start;
+	bench_print(set->name, impl->name, set->n, "lookup_miss", ns, set->n);
+	if (hits)
+		abort();
+
+	/* use the first half of random keys as prefixes */
+	visited = 0;
+	start = bench_now();
+	for (i = 0; i < queries; ++i) {
+		j = (i * 7919) % set->n;
+		plen = set->lens[j] / 2;
+		visited += impl->visit(&c, set->keys[j], plen);
+	}
+	ns = bench_now() - start;
+	bench_print(set->name, impl->name, set->n, "prefix_visit", ns,
+		    queries);
+	if (visited < queries)
+		abort();
+
+	start = bench_now();
+	for (i = 0; i < set->n; ++i)
+		if (!impl->remove(&c, i))
+			abort();
+	ns = bench_now() - start;
+	bench_print(set->name, impl->name, set->n, "remove", ns, set->n);
+
+	impl->teardown(&c);
+}
+
+static int bench_fork(struct bench_set *set, const struct bench_impl *impl,
+		      size_t queries)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (!pid) {
+		bench_run(set, impl, queries);
+		fflush(stdout);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -EINVAL;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_set sets[4];
+	size_t n = 100000, queries = 10000, i, j;
+	int r, ret = EXIT_SUCCESS;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		queries = strtoul(argv[2], NULL, 10);
+	if (!n) {
+		fprintf(stderr, "usage: %s [num-keys [prefix-queries]]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench_set_init(&sets[0], "random", bench_key_random, false, n);
+	bench_set_init(&sets[1], "url", bench_key_url, false, n);
+	bench_set_init(&sets[2], "dotted", bench_key_dotted, false, n);
+	bench_set_init(&sets[3], "binary", bench_key_binary, true, n);
+
+	for (i = 0; i < sizeof(sets) / sizeof(*sets); ++i) {
+		for (j = 0; j < sizeof(bench_impls) / sizeof(*bench_impls);
+		     ++j) {
+			/* string-only structures skip binary sets; htable
+			 * has separate implementations for both */
+			if (sets[i].binary && !bench_impls[j].binary)
+				continue;
+			if (!sets[i].binary &&
+			    bench_impls[j].setup == bench_bhtable_setup)
+				continue;
+
+			r = bench_fork(&sets[i], &bench_impls[j], queries);
+			if (r < 0) {
+				fprintf(stderr, "benchmark failed (%d): %s/%s\n",
+					r, sets[i].name, bench_impls[j].name);
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	for (i = 0; i < sizeof(sets) / sizeof(*sets); ++i)
+		bench_set_destroy(&sets[i]);
+
+	return ret;
+}
@@ -0,0 +1,285 @@
+/*
+ * SHL - Adaptive Radix Tree Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include "test_common.h"
+
+static char *s[] = {
+	"/some/path",
+	"/some/sub/path",
+	"/some/path/extended",
+	"/another/path",
+	"/some/more",
+	"/another/path/added",
+	"/some/path/again",
+	"/some",
+	"/",
+	"",
+	"/more/paths",
+	"relative/paths",
+	"/absolute/again",
+	"relative",
+	"relative/paths/again",
+	"another/relative/path",
+	"/some/more/absolute/paths",
+	"this/is/a/bit/longer/than/the/other/paths/without/any/proper/common/prefix/compared/to/the/others",
+	"this/is/a/bit/longer/than/the/other/paths/but/shares/a/prefix",
+	".",
+	"relative/path",
+	"last/path",
+	NULL
+};
+
+static char *u[] = {
+	"/some/",
+	"some",
+	",",
+	"/relative/paths",
+	"some/path",
+	"/some/path/",
+	"/relative/path",
+	"relativ",
+	"this/is/a/bit/longer/than/the/other/paths/",
+	"this/is/a/bit/longer/than/the/other/paths/but/shares/a/prefiX",
+	NULL
+};
+
+START_TEST(test_art_setup)
+{
+	struct shl_art t = { .root = TEST_INVALID_PTR, };
+
+	shl_art_zero(&t);
+	ck_assert(t.root == 0);
+
+	shl_art_clear(&t, NULL, NULL);
+	ck_assert(t.root == 0);
+}
+END_TEST
+
+TEST_DEFINE_CASE(setup)
+	TEST(test_art_setup)
+TEST_END_CASE
+
+/*
+ * Stress test insertions and removals including the empty string.
+ */
+START_TEST(test_art_add_remove)
+{
+	struct shl_art t = { .root = TEST_INVALID_PTR, };
+	int ret, i;
+	bool r;
+	char **o;
+
+	shl_art_zero(&t);
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_art_lookup_str(&t, s[i], NULL);
+		ck_assert(!r);
+	}
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_art_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_art_insert_str(&t, &s[i], &o);
+		ck_assert(ret == -EALREADY);
+		ck_assert(o == &s[i]);
+	}
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_art_lookup_str(&t, s[i], &o);
+		ck_assert(r);
+		ck_assert(o == &s[i]);
+	}
+
+	for (i = 0; u[i]; ++i) {
+		r = shl_art_lookup_str(&t, u[i], NULL);
+		ck_assert(!r);
+		r = shl_art_remove_str(&t, u[i], NULL);
+		ck_assert(!r);
+	}
+
+	for (i = 0; u[i]; ++i) {
+		ret = shl_art_insert_str(&t, &u[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_art_remove_str(&t, s[i], &o);
+		ck_assert(r);
+		ck_assert(o == &s[i]);
+	}
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_art_lookup_str(&t, s[i], NULL);
+		ck_assert(!r);
+	}
+
+	for (i = 0; u[i]; ++i) {
+		r = shl_art_lookup_str(&t, u[i], NULL);
+		ck_assert(r);
+	}
+
+	for (i = 0; u[i]; ++i) {
+		r = shl_art_remove_str(&t, u[i], NULL);
+		ck_assert(r);
+	}
+
+	ck_assert(t.root == NULL);
+}
+END_TEST
+
+static void test_art_count_cb(char **key, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+}
+
+/*
+ * Grow nodes up to 256 children and shrink them again.
+ */
+START_TEST(test_art_grow)
+{
+	struct shl_art t = { .root = TEST_INVALID_PTR, };
+	static char keys[255][8];
+	static char *k[255];
+	int ret, i, num;
+	bool r;
+
+	shl_art_zero(&t);
+
+	for (i = 0; i < 255; ++i) {
+		sprintf(keys[i], "/ab%c", i + 1);
+		k[i] = keys[i];
+		ret = shl_art_insert_str(&t, &k[i], NULL);
+		ck_assert(ret == 0);
+
+		num = 0;
+		shl_art_visit_str(&t, NULL, test_art_count_cb, &num);
+		ck_assert(num == i + 1);
+	}
+
+	for (i = 0; i < 255; ++i) {
+		r = shl_art_lookup_str(&t, k[i], NULL);
+		ck_assert(r);
+	}
+
+	for (i = 0; i < 255; ++i) {
+		r = shl_art_remove_str(&t, k[i], NULL);
+		ck_assert(r);
+
+		num = 0;
+		shl_art_visit_str(&t, "/ab", test_art_count_cb, &num);
+		ck_assert(num == 254 - i);
+	}
+
+	ck_assert(t.root == NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(add)
+	TEST(test_art_add_remove)
+	TEST(test_art_grow)
+TEST_END_CASE
+
+struct test_art_order {
+	const char *last;
+	int num;
+};
+
+static void test_art_order_cb(char **key, void *ctx)
+{
+	struct test_art_order *o = ctx;
+
+	ck_assert(!o->last || strcmp(o->last, *key) < 0);
+	o->last = *key;
+	++o->num;
+}
+
+static void test_art_visit_some_cb(char **key, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+	ck_assert_msg(strncmp(*key, "/some/", 6) == 0, "invalid art visit %s", *key);
+}
+
+static void test_art_visit_long_cb(char **key, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+	ck_assert_msg(strncmp(*key, "this/is/a", 9) == 0, "invalid art visit %s", *key);
+}
+
+START_TEST(test_art_visit)
+{
+	struct shl_art t = { .root = TEST_INVALID_PTR, };
+	struct test_art_order o = { };
+	int ret, i, num;
+
+	shl_art_zero(&t);
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_art_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	shl_art_visit_str(&t, NULL, test_art_order_cb, &o);
+	ck_assert(o.num == SHL_ARRAY_LENGTH(s) - 1);
+
+	num = 0;
+	shl_art_visit_str(&t, "/some/", test_art_visit_some_cb, &num);
+	ck_assert(num == 6);
+
+	num = 0;
+	shl_art_visit_str(&t, "/some/p", test_art_count_cb, &num);
+	ck_assert(num == 3);
+
+	num = 0;
+	shl_art_visit_str(&t, "/some", test_art_count_cb, &num);
+	ck_assert(num == 7);
+
+	num = 0;
+	shl_art_visit_str(&t, "this/is/a", test_art_visit_long_cb, &num);
+	ck_assert(num == 2);
+
+	num = 0;
+	shl_art_visit_str(&t, "this/is/a/bit/longer/than/the/other/paths/b",
+			  test_art_visit_long_cb, &num);
+	ck_assert(num == 1);
+
+	num = 0;
+	shl_art_visit_str(&t, "this/is/a/bit/shorter", test_art_count_cb,
+			  &num);
+	ck_assert(num == 0);
+
+	num = 0;
+	shl_art_visit_str(&t, "~", test_art_count_cb, &num);
+	ck_assert(num == 0);
+
+	num = 0;
+	shl_art_clear_str(&t, test_art_count_cb, &num);
+	ck_assert(num == SHL_ARRAY_LENGTH(s) - 1);
+	ck_assert(t.root == NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(visit)
+	TEST(test_art_visit)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(art,
+		TEST_CASE(setup),
+		TEST_CASE(add),
+		TEST_CASE(visit),
+		TEST_END
+	)
+)
@@ -29,16 +29,21 @@
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <systemd/sd-daemon.h>
+#include "shl_art.h"
 #include "shl_buf.h"
 #include "shl_dlist.h"
 #include "shl_edbus.h"
 #include "shl_githead.h"
+#include "shl_heap.h"
 #include "shl_htable.h"
 #include "shl_llog.h"
 #include "shl_log.h"
 #include "shl_macro.h"
+#include "shl_mpsc.h"
 #include "shl_pty.h"
+#include "shl_rbtree.h"
 #include "shl_ring.h"
+#include "shl_timer.h"
 #include "shl_trie.h"
 #include "shl_util.h"
 
@@ -0,0 +1,155 @@
+/*
+ * SHL - Heap Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include "test_common.h"
+
+struct node {
+	int v;
+	struct shl_heap_node heap;
+};
+
+static int test_heap_cmp(const struct shl_heap_node *a,
+			 const struct shl_heap_node *b)
+{
+	int x = shl_heap_entry(a, struct node, heap)->v;
+	int y = shl_heap_entry(b, struct node, heap)->v;
+
+	return (x > y) - (x < y);
+}
+
+/* verify heap order and index back-pointers */
+static void test_heap_verify(struct shl_heap *h)
+{
+	size_t i;
+
+	for (i = 0; i < h->n; ++i) {
+		ck_assert(h->nodes[i]->index == i + 1);
+		if (i > 0)
+			ck_assert(test_heap_cmp(h->nodes[(i - 1) / SHL_HEAP_ARITY],
+						h->nodes[i]) <= 0);
+	}
+}
+
+START_TEST(test_heap_setup)
+{
+	struct shl_heap h = SHL_HEAP_INIT(test_heap_cmp);
+	struct node o = { };
+	int r;
+
+	ck_assert(shl_heap_empty(&h));
+	ck_assert(!shl_heap_peek(&h));
+	ck_assert(!shl_heap_pop(&h));
+	ck_assert(!shl_heap_node_linked(&o.heap));
+
+	r = shl_heap_insert(&h, &o.heap);
+	ck_assert(r == 0);
+	ck_assert(shl_heap_size(&h) == 1);
+	ck_assert(shl_heap_node_linked(&o.heap));
+	ck_assert(shl_heap_peek_entry(&h, struct node, heap) == &o);
+
+	ck_assert(shl_heap_pop(&h) == &o.heap);
+	ck_assert(shl_heap_empty(&h));
+	ck_assert(!shl_heap_node_linked(&o.heap));
+
+	r = shl_heap_insert(&h, &o.heap);
+	ck_assert(r == 0);
+	shl_heap_clear(&h);
+	ck_assert(shl_heap_empty(&h));
+	ck_assert(!shl_heap_node_linked(&o.heap));
+}
+END_TEST
+
+TEST_DEFINE_CASE(setup)
+	TEST(test_heap_setup)
+TEST_END_CASE
+
+START_TEST(test_heap_order)
+{
+	static struct node o[1000];
+	struct shl_heap h = SHL_HEAP_INIT(test_heap_cmp);
+	struct shl_heap_node *n;
+	int r, i, last;
+
+	for (i = 0; i < 1000; ++i) {
+		o[i].v = (i * 7919) % 1000;
+		r = shl_heap_insert(&h, &o[i].heap);
+		ck_assert(r == 0);
+	}
+	test_heap_verify(&h);
+
+	last = -1;
+	while ((n = shl_heap_pop(&h))) {
+		ck_assert(shl_heap_entry(n, struct node, heap)->v == last + 1);
+		ck_assert(!shl_heap_node_linked(n));
+		++last;
+	}
+	ck_assert(last == 999);
+
+	shl_heap_clear(&h);
+}
+END_TEST
+
+/*
+ * Change keys of linked nodes and remove arbitrary nodes.
+ */
+START_TEST(test_heap_update)
+{
+	static struct node o[256];
+	struct shl_heap h = SHL_HEAP_INIT(test_heap_cmp);
+	struct shl_heap_node *n;
+	int r, i, num, last;
+
+	for (i = 0; i < 256; ++i) {
+		o[i].v = i + 1000;
+		r = shl_heap_insert(&h, &o[i].heap);
+		ck_assert(r == 0);
+	}
+
+	/* decrease-key moves the node to the top */
+	o[200].v = 0;
+	shl_heap_update(&h, &o[200].heap);
+	test_heap_verify(&h);
+	ck_assert(shl_heap_peek(&h) == &o[200].heap);
+
+	/* increase-key moves it back down */
+	o[200].v = 5000;
+	shl_heap_update(&h, &o[200].heap);
+	test_heap_verify(&h);
+	ck_assert(shl_heap_peek(&h) == &o[0].heap);
+
+	for (i = 0; i < 256; i += 3) {
+		shl_heap_remove(&h, &o[i].heap);
+		ck_assert(!shl_heap_node_linked(&o[i].heap));
+		test_heap_verify(&h);
+	}
+
+	num = 0;
+	last = -1;
+	while ((n = shl_heap_pop(&h))) {
+		ck_assert(shl_heap_entry(n, struct node, heap)->v > last);
+		last = shl_heap_entry(n, struct node, heap)->v;
+		++num;
+	}
+	ck_assert(num == 256 - 86);
+	ck_assert(last == 5000);
+
+	shl_heap_clear(&h);
+}
+END_TEST
+
+TEST_DEFINE_CASE(order)
+	TEST(test_heap_order)
+	TEST(test_heap_update)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(heap,
+		TEST_CASE(setup),
+		TEST_CASE(order),
+		TEST_END
+	)
+)
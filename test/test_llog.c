@@ -17,9 +17,29 @@ TEST_DEFINE_CASE(setup)
 	TEST(test_llog_setup)
 TEST_END_CASE
 
+START_TEST(test_llog_filter)
+{
+	llog_submit_t llog = NULL;
+	int x = 0;
+
+	/* arguments are not evaluated without a logger */
+	llog_dnotice(llog, NULL, "%d", ++x);
+	ck_assert(x == 0);
+
+	llog = log_llog;
+	llog_dnotice(llog, NULL, "%d", ++x);
+	ck_assert(x == 1);
+}
+END_TEST
+
+TEST_DEFINE_CASE(filter)
+	TEST(test_llog_filter)
+TEST_END_CASE
+
 TEST_DEFINE(
 	TEST_SUITE(llog,
 		TEST_CASE(setup),
+		TEST_CASE(filter),
 		TEST_END
 	)
 )
@@ -5,6 +5,19 @@
  * Dedicated to the Public Domain.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* compile out everything above LOG_INFO, see test_log_filter */
+#define LOG_SEV_FLOOR LOG_INFO
+
 #include "test_common.h"
 
 START_TEST(test_log_setup)
@@ -17,9 +30,632 @@ TEST_DEFINE_CASE(setup)
 	TEST(test_log_setup)
 TEST_END_CASE
 
+/*
+ * Log a bunch of messages from several threads into a pipe and verify that
+ * each line arrives in one piece.
+ */
+
+#define TEST_THREADS 4
+#define TEST_LINES 500
+
+static void *test_log_thread(void *data)
+{
+	long id = (long)data;
+	int i;
+
+	for (i = 0; i < TEST_LINES; ++i)
+		log_notice("thread %ld line %d", id, i);
+
+	return NULL;
+}
+
+static size_t test_log_read(int fd, bool lossy)
+{
+	static char buf[TEST_THREADS * TEST_LINES * 128];
+	int next_line[TEST_THREADS] = { };
+	char *line, *next;
+	size_t len = 0, num = 0;
+	ssize_t l;
+	long id;
+	int i;
+
+	while ((l = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += l;
+	buf[len] = 0;
+
+	for (line = buf; (next = strchr(line, '\n')); line = next + 1) {
+		*next = 0;
+		ck_assert(sscanf(line, "[%*d.%*d] NOTICE: thread %ld line %d",
+				 &id, &i) == 2);
+		ck_assert(id >= 0 && id < TEST_THREADS);
+		/* lines of a thread may be dropped but never reordered */
+		if (lossy)
+			ck_assert(i >= next_line[id]);
+		else
+			ck_assert(i == next_line[id]);
+		next_line[id] = i + 1;
+		++num;
+	}
+
+	ck_assert(*line == 0);
+	return num;
+}
+
+static void test_log_run(int fd, unsigned int policy)
+{
+	pthread_t threads[TEST_THREADS];
+	int r;
+	long i;
+
+	r = log_async_start(fd, 16, policy);
+	ck_assert(r == 0);
+	ck_assert(log_async_start(fd, 16, policy) == -EALREADY);
+
+	for (i = 0; i < TEST_THREADS; ++i) {
+		r = pthread_create(&threads[i], NULL, test_log_thread,
+				   (void*)i);
+		ck_assert(r == 0);
+	}
+
+	for (i = 0; i < TEST_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+
+	log_async_stop();
+}
+
+START_TEST(test_log_async)
+{
+	int r, p[2];
+	size_t num;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+
+	/* the pipe must not fill up, we only read it after the writer stopped */
+	r = fcntl(p[1], F_SETPIPE_SZ, TEST_THREADS * TEST_LINES * 128);
+	ck_assert(r >= 0);
+
+	test_log_run(p[1], LOG_ASYNC_BLOCK);
+	ck_assert(log_async_dropped() == 0);
+	close(p[1]);
+
+	num = test_log_read(p[0], false);
+	ck_assert(num == TEST_THREADS * TEST_LINES);
+	close(p[0]);
+}
+END_TEST
+
+START_TEST(test_log_drop)
+{
+	int r, p[2];
+	size_t num;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+	r = fcntl(p[1], F_SETPIPE_SZ, TEST_THREADS * TEST_LINES * 128);
+	ck_assert(r >= 0);
+
+	test_log_run(p[1], LOG_ASYNC_DROP);
+	close(p[1]);
+
+	num = test_log_read(p[0], true);
+	ck_assert(num + log_async_dropped() == TEST_THREADS * TEST_LINES);
+	close(p[0]);
+}
+END_TEST
+
+/* the writer must not miss the stop request, regardless of timing */
+START_TEST(test_log_restart)
+{
+	int r, p[2];
+	size_t num;
+	int i;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+	r = fcntl(p[1], F_SETPIPE_SZ, TEST_THREADS * TEST_LINES * 128);
+	ck_assert(r >= 0);
+
+	for (i = 0; i < TEST_LINES; ++i) {
+		r = log_async_start(p[1], 16, LOG_ASYNC_BLOCK);
+		ck_assert(r == 0);
+		log_notice("thread 0 line %d", i);
+		log_async_stop();
+	}
+
+	close(p[1]);
+	num = test_log_read(p[0], false);
+	ck_assert(num == TEST_LINES);
+	close(p[0]);
+}
+END_TEST
+
+TEST_DEFINE_CASE(async)
+	TEST(test_log_async)
+	TEST(test_log_drop)
+	TEST(test_log_restart)
+TEST_END_CASE
+
+/*
+ * Deferred messages must look exactly like immediately formatted ones.
+ */
+
+static void test_log_expect(int *fds, const char *format, ...)
+{
+	char buf[1024], exp[1024], *p;
+	va_list args;
+	ssize_t l;
+
+	va_start(args, format);
+	vsnprintf(exp, sizeof(exp), format, args);
+	va_end(args);
+
+	l = log_defer_flush(fds[1]);
+	ck_assert(l == 1);
+
+	l = read(fds[0], buf, sizeof(buf) - 1);
+	ck_assert(l > 0);
+	buf[l] = 0;
+
+	p = strstr(buf, "NOTICE: ");
+	ck_assert(!!p);
+	p += 8;
+	ck_assert(p[strlen(p) - 1] == '\n');
+	p[strlen(p) - 1] = 0;
+	ck_assert_str_eq(p, exp);
+}
+
+START_TEST(test_log_defer)
+{
+	char str[] = "mutable";
+	long double ld = 1.5L;
+	int r, p[2], i;
+	size_t num;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+
+	r = log_defer_start(1);
+	ck_assert(r == -EINVAL);
+	r = log_defer_start(4096);
+	ck_assert(r == 0);
+	ck_assert(log_defer_start(4096) == -EALREADY);
+
+	log_notice("%d %u %ld %lld %zu %hhd %x %c %%", -5, 7U, -1L,
+		   (long long)INT64_MIN, (size_t)SIZE_MAX, (char)-3, 255, 'q');
+	test_log_expect(p, "%d %u %ld %lld %zu %hhd %x %c %%", -5, 7U, -1L,
+			(long long)INT64_MIN, (size_t)SIZE_MAX, (char)-3, 255,
+			'q');
+
+	log_notice("%s|%.3s|%10s|%-5s", str, str, "ab", "cd");
+	str[0] = 'X';
+	test_log_expect(p, "%s|%.3s|%10s|%-5s", "mutable", "mutable", "ab",
+			"cd");
+
+	log_notice("%*d|%.*f|%-*.*s|%f|%Le|%g", 6, 42, 2, 3.14159, 4, 2, "xyz",
+		   0.5, ld, 1e100);
+	test_log_expect(p, "%*d|%.*f|%-*.*s|%f|%Le|%g", 6, 42, 2, 3.14159,
+			4, 2, "xyz", 0.5, ld, 1e100);
+
+	log_notice("%p %p", (void*)p, NULL);
+	test_log_expect(p, "%p %p", (void*)p, NULL);
+
+	errno = ENOENT;
+	log_notice("err: %m");
+	errno = 0;
+	test_log_expect(p, "err: %s", strerror(ENOENT));
+
+	/* positional arguments cannot be deferred and are written directly */
+	log_notice("%1$d", 5);
+	ck_assert(log_defer_flush(p[1]) == 0);
+
+	/* a full ring drops new messages */
+	for (i = 0; i < 1000; ++i)
+		log_notice("drop %d", i);
+	num = log_defer_flush(p[1]);
+	ck_assert(num > 0 && num < 1000);
+	ck_assert(num + log_defer_dropped() == 1000);
+
+	log_defer_stop();
+	close(p[0]);
+	close(p[1]);
+}
+END_TEST
+
+TEST_DEFINE_CASE(defer)
+	TEST(test_log_defer)
+TEST_END_CASE
+
+START_TEST(test_log_filter)
+{
+	unsigned int max_sev = log_max_sev;
+	int r, p[2], x = 0;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+	r = log_defer_start(4096);
+	ck_assert(r == 0);
+
+	/* filtered messages don't evaluate their arguments */
+	log_max_sev = LOG_NOTICE;
+	log_info("%d", ++x);
+	ck_assert(x == 0);
+	log_notice("%d", ++x);
+	ck_assert(x == 1);
+
+	/* above the compile-time floor */
+	log_max_sev = LOG_DEBUG;
+	log_printf(LOG_DEBUG, "%d", ++x);
+	ck_assert(x == 1);
+	ck_assert(log_defer_flush(p[1]) == 1);
+
+	/* subsystem thresholds override log_max_sev in both directions */
+	log_max_sev = LOG_NOTICE;
+	r = log_set_subsystem_sev("test-quiet", LOG_ERROR);
+	ck_assert(r == 0);
+	r = log_set_subsystem_sev("test-loud", LOG_INFO);
+	ck_assert(r == 0);
+	ck_assert(log_set_subsystem_sev(NULL, LOG_INFO) == -EINVAL);
+
+	log_format(LOG_DEFAULT_BASE, "test-quiet", LOG_NOTICE, "no");
+	log_format(LOG_DEFAULT_BASE, "test-quiet", LOG_ERROR, "yes");
+	log_format(LOG_DEFAULT_BASE, "test-loud", LOG_INFO, "yes");
+	log_format(LOG_DEFAULT_BASE, "test-other", LOG_INFO, "no");
+	ck_assert(log_defer_flush(p[1]) == 2);
+
+	/* other subsystems are not affected by the inline filter */
+	log_info("%d", ++x);
+	ck_assert(x == 1);
+
+	log_max_sev = max_sev;
+	log_defer_stop();
+	close(p[0]);
+	close(p[1]);
+}
+END_TEST
+
+#undef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM "test-site"
+
+static void test_log_site(int *x)
+{
+	log_info("%d", ++*x);
+}
+
+START_TEST(test_log_levels)
+{
+	unsigned int max_sev = log_max_sev;
+	char path[] = "/tmp/test_log_levels.XXXXXX";
+	int r, fd, x = 0;
+	FILE *f;
+
+	/* the call-site resolves its slot once and follows later changes */
+	log_max_sev = LOG_NOTICE;
+	test_log_site(&x);
+	ck_assert(x == 0);
+
+	r = log_set_subsystem_sev("test-site", LOG_INFO);
+	ck_assert(r == 0);
+	test_log_site(&x);
+	ck_assert(x == 1);
+
+	r = log_parse_levels("test-site=warning, *=debug");
+	ck_assert(r == 0);
+	ck_assert(log_max_sev == LOG_DEBUG);
+	test_log_site(&x);
+	ck_assert(x == 1);
+
+	r = log_parse_levels("test-site=inherit");
+	ck_assert(r == 0);
+	test_log_site(&x);
+	ck_assert(x == 2);
+
+	ck_assert(log_parse_levels("test-site") == -EINVAL);
+	ck_assert(log_parse_levels("=info") == -EINVAL);
+	ck_assert(log_parse_levels("test-site=loud") == -EINVAL);
+	ck_assert(log_parse_levels("*=inherit") == -EINVAL);
+	ck_assert(log_set_subsystem_sev("test-site", 100) == -EINVAL);
+
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	f = fdopen(fd, "w");
+	ck_assert(!!f);
+	fprintf(f, "# control file\n*=notice\ntest-site=6 other=error\n");
+	fclose(f);
+
+	r = log_load_levels(path);
+	ck_assert(r == 0);
+	ck_assert(log_max_sev == LOG_NOTICE);
+	test_log_site(&x);
+	ck_assert(x == 3);
+
+	unlink(path);
+	ck_assert(log_load_levels(path) == -ENOENT);
+
+	log_set_subsystem_sev("test-site", LOG_SEV_NUM);
+	log_max_sev = max_sev;
+}
+END_TEST
+
+/*
+ * Flight recorder: record everything, print nothing until dumped.
+ */
+
+static size_t test_log_dump(int *fds, char *buf, size_t size)
+{
+	ssize_t l;
+
+	log_fr_dump(fds[1]);
+	l = read(fds[0], buf, size - 1);
+	ck_assert(l > 0);
+	buf[l] = 0;
+
+	return l;
+}
+
+static void *test_log_fr_thread(void *data)
+{
+	log_debug("fr thread");
+	log_printf(LOG_INFO, "fr thread");
+	return NULL;
+}
+
+START_TEST(test_log_fr)
+{
+	static char buf[65536];
+	unsigned int max_sev = log_max_sev;
+	pthread_t thread;
+	char *p1, *p2;
+	int r, p[2], i, x = 0;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+	r = fcntl(p[0], F_SETFL, O_NONBLOCK);
+	ck_assert(r >= 0);
+
+	log_max_sev = LOG_NOTICE;
+	ck_assert(log_fr_start(16, -1) == -EINVAL);
+	r = log_fr_start(8192, -1);
+	ck_assert(r == 0);
+	ck_assert(log_fr_start(8192, -1) == -EALREADY);
+
+	/* filtered messages are recorded, but arguments still evaluated */
+	log_info("fr info %d", ++x);
+	ck_assert(x == 1);
+	llog_dinfo(log_fr_llog, NULL, "fr llog %d", 5);
+
+	r = pthread_create(&thread, NULL, test_log_fr_thread, NULL);
+	ck_assert(r == 0);
+	pthread_join(thread, NULL);
+
+	test_log_dump(p, buf, sizeof(buf));
+	p1 = strstr(buf, "INFO: test-site: fr info 1\n");
+	ck_assert(!!p1);
+	p2 = strstr(buf, "INFO: fr llog 5\n");
+	ck_assert(p2 > p1);
+	ck_assert(!!strstr(buf, "INFO: test-site: fr thread\n"));
+
+	/* old messages get overwritten, newest ones are kept in order */
+	for (i = 0; i < 1000; ++i)
+		log_info("fr loop %d", i);
+
+	test_log_dump(p, buf, sizeof(buf));
+	ck_assert(!strstr(buf, "fr info 1"));
+	ck_assert(!strstr(buf, "fr loop 0\n"));
+	p1 = strstr(buf, "fr loop 998\n");
+	p2 = strstr(buf, "fr loop 999\n");
+	ck_assert(p1 && p2 > p1);
+
+	log_fr_stop();
+
+	/* the recorder is dumped on fatal messages */
+	r = log_fr_start(8192, p[1]);
+	ck_assert(r == 0);
+	log_info("fr before fatal");
+	log_fatal("fr fatal");
+	r = read(p[0], buf, sizeof(buf) - 1);
+	ck_assert(r > 0);
+	buf[r] = 0;
+	ck_assert(!!strstr(buf, "INFO: test-site: fr before fatal\n"));
+	ck_assert(!!strstr(buf, "FATAL: test-site: fr fatal\n"));
+	log_fr_stop();
+
+	log_max_sev = max_sev;
+	close(p[0]);
+	close(p[1]);
+}
+END_TEST
+
+static int test_log_chain_fd;
+
+static void test_log_chain_handler(int sig)
+{
+	ssize_t l;
+
+	l = write(test_log_chain_fd, "chained\n", 8);
+	_exit(l == 8 ? 7 : 1);
+}
+
+/* crash handlers installed by the application must still be called */
+START_TEST(test_log_fr_chain)
+{
+	static char buf[65536];
+	int r, p[2], status;
+	size_t len;
+	pid_t pid;
+
+	r = pipe(p);
+	ck_assert(r >= 0);
+
+	pid = fork();
+	ck_assert(pid >= 0);
+	if (!pid) {
+		close(p[0]);
+		test_log_chain_fd = p[1];
+		signal(SIGABRT, test_log_chain_handler);
+		if (log_fr_start(8192, p[1]) < 0)
+			_exit(1);
+		log_info("fr crash");
+		raise(SIGABRT);
+		_exit(2);
+	}
+
+	close(p[1]);
+	r = waitpid(pid, &status, 0);
+	ck_assert(r == pid);
+	ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 7);
+
+	len = 0;
+	while ((r = read(p[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += r;
+	buf[len] = 0;
+	close(p[0]);
+
+	ck_assert(!!strstr(buf, "INFO: test-site: fr crash\nchained\n"));
+}
+END_TEST
+
+TEST_DEFINE_CASE(fr)
+	TEST(test_log_fr)
+	TEST(test_log_fr_chain)
+TEST_END_CASE
+
+/*
+ * Journal: receive the datagrams on our own socket and check the fields.
+ */
+
+static size_t test_log_journal_recv(int fd, char *buf, size_t size)
+{
+	union {
+		struct cmsghdr cmsg;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t l;
+	int mfd;
+
+	l = recvmsg(fd, &mh, 0);
+	ck_assert(l >= 0);
+
+	/* large messages are passed as memfd */
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg) {
+		ck_assert(l == 0);
+		ck_assert(cmsg->cmsg_type == SCM_RIGHTS);
+		memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+		l = pread(mfd, buf, size, 0);
+		ck_assert(l > 0);
+		close(mfd);
+	}
+
+	return l;
+}
+
+START_TEST(test_log_journal)
+{
+	static char buf[512 * 1024];
+	char path[] = "/tmp/test_log_journal.XXXXXX", *msg;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	unsigned int max_sev = log_max_sev;
+	uint64_t le;
+	size_t l;
+	int r, fd;
+
+	ck_assert(!!mkdtemp(path));
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket", path);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	ck_assert(fd >= 0);
+	r = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	ck_assert(r >= 0);
+
+	r = log_journal_start(addr.sun_path);
+	ck_assert(r == 0);
+	ck_assert(log_journal_start(NULL) == -EALREADY);
+
+	log_max_sev = LOG_NOTICE;
+	log_warning("journal %d", 5);
+	l = test_log_journal_recv(fd, buf, sizeof(buf));
+	buf[l] = 0;
+	ck_assert(!strncmp(buf, "MESSAGE=journal 5\n", 18));
+	ck_assert(!!strstr(buf, "\nPRIORITY=4\n"));
+	ck_assert(!!strstr(buf, "\nCODE_FILE=" __FILE__ "\n"));
+	ck_assert(!!strstr(buf, "\nCODE_LINE="));
+	ck_assert(!!strstr(buf, "\nCODE_FUNC=test_log_journal\n"));
+	ck_assert(!!strstr(buf, "\nLOG_SUBSYSTEM=test-site\n"));
+
+	/* multi-line messages use the binary field encoding */
+	log_warning("a\nb");
+	l = test_log_journal_recv(fd, buf, sizeof(buf));
+	ck_assert(l > 20);
+	ck_assert(!memcmp(buf, "MESSAGE\n", 8));
+	memcpy(&le, buf + 8, sizeof(le));
+	ck_assert(le64toh(le) == 3);
+	ck_assert(!memcmp(buf + 16, "a\nb\n", 4));
+
+	/* too big for a datagram, must arrive untruncated via memfd */
+	msg = malloc(300 * 1024 + 1);
+	ck_assert(!!msg);
+	memset(msg, 'x', 300 * 1024);
+	msg[300 * 1024] = 0;
+	log_warning("%s", msg);
+	l = test_log_journal_recv(fd, buf, sizeof(buf));
+	ck_assert(l > 300 * 1024);
+	ck_assert(!strncmp(buf, "MESSAGE=xxx", 11));
+	ck_assert(buf[8 + 300 * 1024] == '\n');
+	free(msg);
+
+	/* deferred messages are flushed to the journal, not to stderr */
+	r = log_defer_start(4096);
+	ck_assert(r == 0);
+	log_warning("deferred %d", 7);
+	ck_assert(log_defer_flush(-1) == 1);
+	log_defer_stop();
+	l = test_log_journal_recv(fd, buf, sizeof(buf));
+	buf[l] = 0;
+	ck_assert(!strncmp(buf, "MESSAGE=deferred 7\n", 19));
+	ck_assert(!!strstr(buf, "\nPRIORITY=4\n"));
+	ck_assert(!!strstr(buf, "\nCODE_FUNC=test_log_journal\n"));
+
+	/* nobody reads the socket, so messages are dropped, not blocked on */
+	ck_assert(log_journal_dropped() == 0);
+	for (r = 0; r < 100000 && !log_journal_dropped(); ++r)
+		log_warning("flood %d", r);
+	ck_assert(log_journal_dropped() > 0);
+
+	log_journal_stop();
+	log_max_sev = max_sev;
+
+	close(fd);
+	unlink(addr.sun_path);
+	rmdir(path);
+}
+END_TEST
+
+TEST_DEFINE_CASE(journal)
+	TEST(test_log_journal)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(filter)
+	TEST(test_log_filter)
+	TEST(test_log_levels)
+TEST_END_CASE
+
 TEST_DEFINE(
 	TEST_SUITE(log,
 		TEST_CASE(setup),
+		TEST_CASE(async),
+		TEST_CASE(defer),
+		TEST_CASE(filter),
+		TEST_CASE(fr),
+		TEST_CASE(journal),
 		TEST_END
 	)
 )
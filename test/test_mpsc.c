@@ -0,0 +1,208 @@
+/*
+ * SHL - MPSC Queue Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include "test_common.h"
+
+struct node {
+	int v;
+	struct shl_mpsc_node mpsc;
+};
+
+START_TEST(test_mpsc_setup)
+{
+	struct shl_mpsc q;
+	struct node o[4];
+	struct shl_mpsc_node *n;
+	int i;
+
+	shl_mpsc_init(&q);
+	ck_assert(!shl_mpsc_pop(&q));
+	ck_assert(shl_mpsc_drain(&q, NULL, NULL) == 0);
+
+	for (i = 0; i < 4; ++i) {
+		o[i].v = i;
+		shl_mpsc_push(&q, &o[i].mpsc);
+	}
+
+	for (i = 0; i < 4; ++i) {
+		n = shl_mpsc_pop(&q);
+		ck_assert(n == &o[i].mpsc);
+		ck_assert(shl_mpsc_entry(n, struct node, mpsc)->v == i);
+	}
+
+	ck_assert(!shl_mpsc_pop(&q));
+
+	/* queue must be reusable after it ran empty */
+	shl_mpsc_push(&q, &o[2].mpsc);
+	ck_assert(shl_mpsc_pop(&q) == &o[2].mpsc);
+	ck_assert(!shl_mpsc_pop(&q));
+
+	shl_mpsc_deinit(&q);
+}
+END_TEST
+
+TEST_DEFINE_CASE(setup)
+	TEST(test_mpsc_setup)
+TEST_END_CASE
+
+struct drain_ctx {
+	struct shl_mpsc *q;
+	int next;
+	int requeue;
+};
+
+static void test_mpsc_drain_cb(struct shl_mpsc_node *n, void *data)
+{
+	struct drain_ctx *ctx = data;
+	struct node *o = shl_mpsc_entry(n, struct node, mpsc);
+
+	ck_assert(o->v == ctx->next);
+	++ctx->next;
+
+	if (ctx->requeue) {
+		--ctx->requeue;
+		shl_mpsc_push(ctx->q, n);
+	}
+}
+
+START_TEST(test_mpsc_drain)
+{
+	static struct node o[64];
+	struct shl_mpsc q;
+	struct drain_ctx ctx = { .q = &q };
+	size_t r;
+	int i;
+
+	shl_mpsc_init(&q);
+
+	for (i = 0; i < 64; ++i) {
+		o[i].v = i;
+		shl_mpsc_push(&q, &o[i].mpsc);
+	}
+
+	r = shl_mpsc_drain(&q, test_mpsc_drain_cb, &ctx);
+	ck_assert(r == 64);
+	ck_assert(ctx.next == 64);
+	ck_assert(shl_mpsc_drain(&q, test_mpsc_drain_cb, &ctx) == 0);
+
+	/* nodes pushed from within the callback are left for the next call */
+	ctx.next = 0;
+	ctx.requeue = 1;
+	shl_mpsc_push(&q, &o[0].mpsc);
+	r = shl_mpsc_drain(&q, test_mpsc_drain_cb, &ctx);
+	ck_assert(r == 1);
+	ctx.next = 0;
+	r = shl_mpsc_drain(&q, test_mpsc_drain_cb, &ctx);
+	ck_assert(r == 1);
+	ck_assert(!shl_mpsc_pop(&q));
+
+	shl_mpsc_deinit(&q);
+}
+END_TEST
+
+#define TEST_PRODUCERS 4
+#define TEST_PUSHES 20000
+
+struct prod_node {
+	int producer;
+	int seq;
+	struct shl_mpsc_node mpsc;
+};
+
+struct prod_ctx {
+	struct shl_mpsc *q;
+	struct prod_node *nodes;
+	int producer;
+};
+
+static void *test_mpsc_producer(void *data)
+{
+	struct prod_ctx *ctx = data;
+	int i;
+
+	for (i = 0; i < TEST_PUSHES; ++i) {
+		ctx->nodes[i].producer = ctx->producer;
+		ctx->nodes[i].seq = i;
+		shl_mpsc_push(ctx->q, &ctx->nodes[i].mpsc);
+	}
+
+	return NULL;
+}
+
+static void test_mpsc_consume_cb(struct shl_mpsc_node *n, void *data)
+{
+	int *next = data;
+	struct prod_node *o = shl_mpsc_entry(n, struct prod_node, mpsc);
+
+	/* pushes of a single producer must stay in order */
+	ck_assert(o->seq == next[o->producer]);
+	++next[o->producer];
+}
+
+START_TEST(test_mpsc_threads)
+{
+	struct shl_mpsc q;
+	struct prod_ctx ctx[TEST_PRODUCERS];
+	pthread_t threads[TEST_PRODUCERS];
+	int next[TEST_PRODUCERS] = { };
+	struct pollfd pfd;
+	ssize_t l, num;
+	int r, i;
+
+	shl_mpsc_init(&q);
+	r = shl_mpsc_init_fd(&q);
+	ck_assert(r >= 0);
+
+	for (i = 0; i < TEST_PRODUCERS; ++i) {
+		ctx[i].q = &q;
+		ctx[i].producer = i;
+		ctx[i].nodes = calloc(TEST_PUSHES, sizeof(*ctx[i].nodes));
+		ck_assert(!!ctx[i].nodes);
+
+		r = pthread_create(&threads[i], NULL, test_mpsc_producer,
+				   &ctx[i]);
+		ck_assert(r == 0);
+	}
+
+	/* every push must eventually raise the eventfd */
+	num = 0;
+	pfd.fd = q.fd;
+	pfd.events = POLLIN;
+	while (num < TEST_PRODUCERS * TEST_PUSHES) {
+		r = poll(&pfd, 1, 5000);
+		ck_assert(r == 1);
+
+		l = shl_mpsc_dispatch(&q, test_mpsc_consume_cb, next);
+		ck_assert(l >= 0);
+		num += l;
+	}
+
+	for (i = 0; i < TEST_PRODUCERS; ++i) {
+		pthread_join(threads[i], NULL);
+		ck_assert(next[i] == TEST_PUSHES);
+		free(ctx[i].nodes);
+	}
+
+	ck_assert(!shl_mpsc_pop(&q));
+	shl_mpsc_deinit(&q);
+}
+END_TEST
+
+TEST_DEFINE_CASE(drain)
+	TEST(test_mpsc_drain)
+	TEST(test_mpsc_threads)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(mpsc,
+		TEST_CASE(setup),
+		TEST_CASE(drain),
+		TEST_END
+	)
+)
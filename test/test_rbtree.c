@@ -0,0 +1,255 @@
+/*
+ * SHL - RBTree Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include "test_common.h"
+
+struct node {
+	int v;
+	struct shl_rbnode rb;
+};
+
+static int test_rbtree_cmp(const struct shl_rbnode *a,
+			   const struct shl_rbnode *b)
+{
+	int x = shl_rbtree_entry(a, struct node, rb)->v;
+	int y = shl_rbtree_entry(b, struct node, rb)->v;
+
+	return (x > y) - (x < y);
+}
+
+static int test_rbtree_key_cmp(const void *key, const struct shl_rbnode *n)
+{
+	int x = *(const int*)key;
+	int y = shl_rbtree_entry(n, struct node, rb)->v;
+
+	return (x > y) - (x < y);
+}
+
+/* verify red-black invariants and return the black-height */
+static int test_rbtree_verify(struct shl_rbnode *n, struct shl_rbnode *parent)
+{
+	int l, r;
+	bool red;
+
+	if (!n)
+		return 1;
+
+	ck_assert(shl_rbnode_linked(n));
+	ck_assert(shl_rbnode_parent(n) == parent);
+
+	red = n->__parent & SHL_RBNODE_RED;
+	if (red) {
+		ck_assert(!n->left || !(n->left->__parent & SHL_RBNODE_RED));
+		ck_assert(!n->right || !(n->right->__parent & SHL_RBNODE_RED));
+	}
+
+	l = test_rbtree_verify(n->left, n);
+	r = test_rbtree_verify(n->right, n);
+	ck_assert(l == r);
+
+	return l + !red;
+}
+
+START_TEST(test_rbtree_setup)
+{
+	struct shl_rbtree t = { .root = TEST_INVALID_PTR, };
+	struct node o = { };
+
+	shl_rbtree_init(&t);
+	ck_assert(shl_rbtree_empty(&t));
+	ck_assert(!shl_rbtree_first(&t));
+	ck_assert(!shl_rbtree_last(&t));
+	ck_assert(!shl_rbnode_linked(&o.rb));
+
+	shl_rbtree_insert(&t, &o.rb, test_rbtree_cmp);
+	ck_assert(!shl_rbtree_empty(&t));
+	ck_assert(shl_rbnode_linked(&o.rb));
+	ck_assert(shl_rbtree_first(&t) == &o.rb);
+	ck_assert(shl_rbtree_last(&t) == &o.rb);
+
+	shl_rbtree_remove(&t, &o.rb);
+	ck_assert(shl_rbtree_empty(&t));
+	ck_assert(!shl_rbnode_linked(&o.rb));
+}
+END_TEST
+
+TEST_DEFINE_CASE(setup)
+	TEST(test_rbtree_setup)
+TEST_END_CASE
+
+/*
+ * Insert and remove elements in pseudo-random order and verify ordering and
+ * red-black invariants after each step.
+ */
+START_TEST(test_rbtree_add_remove)
+{
+	static struct node o[512];
+	struct shl_rbtree t = SHL_RBTREE_INIT;
+	struct shl_rbnode *iter, *out;
+	int i, r, num, last;
+
+	for (i = 0; i < 512; ++i) {
+		o[i].v = (i * 7919) % 512;
+		shl_rbtree_insert(&t, &o[i].rb, test_rbtree_cmp);
+		test_rbtree_verify(t.root, NULL);
+	}
+
+	for (i = 0; i < 512; ++i) {
+		r = shl_rbtree_insert_unique(&t, &o[i].rb, test_rbtree_cmp,
+					     &out);
+		ck_assert(r == -EALREADY);
+		ck_assert(out == &o[i].rb);
+	}
+
+	num = 0;
+	last = -1;
+	shl_rbtree_for_each(iter, &t) {
+		ck_assert(shl_rbtree_entry(iter, struct node, rb)->v == last + 1);
+		last = shl_rbtree_entry(iter, struct node, rb)->v;
+		++num;
+	}
+	ck_assert(num == 512);
+
+	num = 0;
+	shl_rbtree_for_each_reverse(iter, &t) {
+		ck_assert(shl_rbtree_entry(iter, struct node, rb)->v == last--);
+		++num;
+	}
+	ck_assert(num == 512);
+
+	for (i = 0; i < 512; i += 2) {
+		shl_rbtree_remove(&t, &o[i].rb);
+		ck_assert(!shl_rbnode_linked(&o[i].rb));
+		test_rbtree_verify(t.root, NULL);
+	}
+
+	num = 0;
+	shl_rbtree_for_each(iter, &t)
+		++num;
+	ck_assert(num == 256);
+
+	for (i = 0; i < 512; i += 2) {
+		r = shl_rbtree_insert_unique(&t, &o[i].rb, test_rbtree_cmp,
+					     NULL);
+		ck_assert(r == 0);
+	}
+	test_rbtree_verify(t.root, NULL);
+
+	num = 0;
+	shl_rbtree_for_each_safe(iter, out, &t) {
+		shl_rbtree_remove(&t, iter);
+		++num;
+	}
+	ck_assert(num == 512);
+	ck_assert(shl_rbtree_empty(&t));
+}
+END_TEST
+
+/*
+ * Equal elements are kept in insertion order.
+ */
+START_TEST(test_rbtree_duplicates)
+{
+	static struct node o[64];
+	struct shl_rbtree t = SHL_RBTREE_INIT;
+	struct shl_rbnode *iter, *tmp;
+	int i, num;
+
+	for (i = 0; i < 64; ++i) {
+		o[i].v = i % 4;
+		shl_rbtree_insert(&t, &o[i].rb, test_rbtree_cmp);
+	}
+	test_rbtree_verify(t.root, NULL);
+
+	num = 0;
+	shl_rbtree_for_each(iter, &t) {
+		ck_assert(iter == &o[(num % 16) * 4 + num / 16].rb);
+		++num;
+	}
+	ck_assert(num == 64);
+
+	num = 0;
+	shl_rbtree_for_each_reverse_safe(iter, tmp, &t) {
+		shl_rbtree_remove(&t, iter);
+		++num;
+	}
+	ck_assert(num == 64);
+	ck_assert(shl_rbtree_empty(&t));
+}
+END_TEST
+
+TEST_DEFINE_CASE(add)
+	TEST(test_rbtree_add_remove)
+	TEST(test_rbtree_duplicates)
+TEST_END_CASE
+
+START_TEST(test_rbtree_seek)
+{
+	static struct node o[16];
+	struct shl_rbtree t = SHL_RBTREE_INIT;
+	struct shl_rbnode *iter;
+	int i, k, num;
+
+	/* insert 0, 10, 20, ..., 150 */
+	for (i = 0; i < 16; ++i) {
+		o[i].v = ((i * 5) % 16) * 10;
+		shl_rbtree_insert(&t, &o[i].rb, test_rbtree_cmp);
+	}
+
+	k = 40;
+	iter = shl_rbtree_find(&t, &k, test_rbtree_key_cmp);
+	ck_assert(iter && shl_rbtree_entry(iter, struct node, rb)->v == 40);
+
+	k = 45;
+	ck_assert(!shl_rbtree_find(&t, &k, test_rbtree_key_cmp));
+
+	iter = shl_rbtree_lower_bound(&t, &k, test_rbtree_key_cmp);
+	ck_assert(iter && shl_rbtree_entry(iter, struct node, rb)->v == 50);
+
+	k = 50;
+	iter = shl_rbtree_lower_bound(&t, &k, test_rbtree_key_cmp);
+	ck_assert(iter && shl_rbtree_entry(iter, struct node, rb)->v == 50);
+
+	iter = shl_rbtree_upper_bound(&t, &k, test_rbtree_key_cmp);
+	ck_assert(iter && shl_rbtree_entry(iter, struct node, rb)->v == 60);
+
+	k = -1;
+	iter = shl_rbtree_lower_bound(&t, &k, test_rbtree_key_cmp);
+	ck_assert(iter == shl_rbtree_first(&t));
+
+	k = 150;
+	ck_assert(!shl_rbtree_upper_bound(&t, &k, test_rbtree_key_cmp));
+
+	k = 151;
+	ck_assert(!shl_rbtree_lower_bound(&t, &k, test_rbtree_key_cmp));
+
+	k = 100;
+	num = 0;
+	shl_rbtree_for_each_from(iter,
+			shl_rbtree_lower_bound(&t, &k, test_rbtree_key_cmp))
+		++num;
+	ck_assert(num == 6);
+
+	iter = shl_rbtree_last(&t);
+	ck_assert(iter == &o[3].rb);
+	ck_assert(shl_rbtree_last_entry(&t, struct node, rb) == &o[3]);
+	ck_assert(shl_rbtree_first_entry(&t, struct node, rb) == &o[0]);
+}
+END_TEST
+
+TEST_DEFINE_CASE(seek)
+	TEST(test_rbtree_seek)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(rbtree,
+		TEST_CASE(setup),
+		TEST_CASE(add),
+		TEST_CASE(seek),
+		TEST_END
+	)
+)
@@ -0,0 +1,191 @@
+/*
+ * SHL - Timer Wheel Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include <poll.h>
+#include <time.h>
+#include "test_common.h"
+
+struct node {
+	struct shl_timer timer;
+	uint64_t fired;
+	int order;
+	int rearm;
+};
+
+static int test_timer_order;
+
+static void test_timer_cb(struct shl_timer *timer, void *data)
+{
+	struct shl_timer_wheel *w = data;
+	struct node *n = shl_timer_entry(timer, struct node, timer);
+
+	ck_assert(!shl_timer_armed(timer));
+
+	n->fired = shl_now(CLOCK_MONOTONIC);
+	n->order = test_timer_order++;
+
+	if (n->rearm > 0) {
+		--n->rearm;
+		shl_timer_arm_rel(w, timer, 1000);
+	}
+}
+
+/* dispatch @w until no timer is armed or @usecs passed */
+static void test_timer_run(struct shl_timer_wheel *w, struct node *o,
+			   size_t num, uint64_t usecs)
+{
+	struct pollfd fd = { .fd = shl_timer_wheel_get_fd(w), .events = POLLIN };
+	uint64_t end;
+	size_t i;
+	int r;
+
+	end = shl_now(CLOCK_MONOTONIC) + usecs;
+	while (shl_now(CLOCK_MONOTONIC) < end) {
+		for (i = 0; i < num; ++i)
+			if (shl_timer_armed(&o[i].timer))
+				break;
+		if (i >= num)
+			break;
+
+		r = poll(&fd, 1, 100);
+		ck_assert(r >= 0);
+
+		r = shl_timer_wheel_dispatch(w);
+		ck_assert(r >= 0);
+	}
+}
+
+START_TEST(test_timer_setup)
+{
+	struct shl_timer_wheel *w;
+	struct node o = { };
+	int r;
+
+	r = shl_timer_wheel_new(&w, 0);
+	ck_assert(r >= 0);
+	ck_assert(r == shl_timer_wheel_get_fd(w));
+
+	shl_timer_init(&o.timer, test_timer_cb, w);
+	ck_assert(!shl_timer_armed(&o.timer));
+
+	r = shl_timer_arm_rel(w, &o.timer, 1000000);
+	ck_assert(r >= 0);
+	ck_assert(shl_timer_armed(&o.timer));
+
+	shl_timer_cancel(w, &o.timer);
+	ck_assert(!shl_timer_armed(&o.timer));
+	shl_timer_cancel(w, &o.timer);
+
+	r = shl_timer_arm_rel(w, &o.timer, 1000000);
+	ck_assert(r >= 0);
+
+	shl_timer_wheel_free(w);
+	ck_assert(!shl_timer_armed(&o.timer));
+}
+END_TEST
+
+TEST_DEFINE_CASE(setup)
+	TEST(test_timer_setup)
+TEST_END_CASE
+
+/*
+ * Arm timers in reverse order and verify they fire in order, never early.
+ */
+START_TEST(test_timer_expire)
+{
+	static struct node o[32];
+	struct shl_timer_wheel *w;
+	uint64_t now;
+	int r, i;
+
+	r = shl_timer_wheel_new(&w, 0);
+	ck_assert(r >= 0);
+
+	test_timer_order = 0;
+	now = shl_now(CLOCK_MONOTONIC);
+
+	for (i = 31; i >= 0; --i) {
+		shl_timer_init(&o[i].timer, test_timer_cb, w);
+		r = shl_timer_arm(w, &o[i].timer, now + 2000 * (i + 1));
+		ck_assert(r >= 0);
+	}
+
+	/* canceled timers never fire, re-armed timers fire once */
+	shl_timer_cancel(w, &o[5].timer);
+	r = shl_timer_arm(w, &o[7].timer, now + 2000 * 8 + 500);
+	ck_assert(r >= 0);
+
+	test_timer_run(w, o, 32, 5000000);
+
+	for (i = 0; i < 32; ++i) {
+		if (i == 5) {
+			ck_assert(!o[i].fired);
+			continue;
+		}
+
+		ck_assert(!shl_timer_armed(&o[i].timer));
+		ck_assert(o[i].fired >= o[i].timer.expires);
+		ck_assert(o[i].order == i - (i > 5));
+	}
+
+	shl_timer_wheel_free(w);
+}
+END_TEST
+
+/*
+ * Timers re-armed from their callback and timers far in the future.
+ */
+START_TEST(test_timer_rearm)
+{
+	static struct node o[3];
+	struct shl_timer_wheel *w;
+	int r;
+
+	r = shl_timer_wheel_new(&w, 0);
+	ck_assert(r >= 0);
+
+	shl_timer_init(&o[0].timer, test_timer_cb, w);
+	o[0].rearm = 3;
+	r = shl_timer_arm_rel(w, &o[0].timer, 1000);
+	ck_assert(r >= 0);
+
+	/* expired timers fire on the next dispatch */
+	shl_timer_init(&o[1].timer, test_timer_cb, w);
+	r = shl_timer_arm(w, &o[1].timer, 0);
+	ck_assert(r >= 0);
+
+	test_timer_run(w, o, 2, 5000000);
+	ck_assert(!o[0].rearm);
+	ck_assert(!shl_timer_armed(&o[0].timer));
+	ck_assert(o[1].fired);
+
+	/* beyond the range of the wheel */
+	shl_timer_init(&o[2].timer, test_timer_cb, w);
+	r = shl_timer_arm_rel(w, &o[2].timer, 1000ULL * 1000 * 3600 * 24 * 365);
+	ck_assert(r >= 0);
+
+	r = shl_timer_wheel_dispatch(w);
+	ck_assert(r >= 0);
+	ck_assert(shl_timer_armed(&o[2].timer));
+	ck_assert(!o[2].fired);
+
+	shl_timer_wheel_free(w);
+}
+END_TEST
+
+TEST_DEFINE_CASE(expire)
+	TEST(test_timer_expire)
+	TEST(test_timer_rearm)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(timer,
+		TEST_CASE(setup),
+		TEST_CASE(expire),
+		TEST_END
+	)
+)
@@ -664,12 +664,690 @@ TEST_DEFINE_CASE(visit)
 	TEST(test_trie_visit)
 TEST_END_CASE
 
+static void test_trie_count_cb(char **key, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+}
+
+/*
+ * Stress tests arena-tries with enough nodes to span multiple slabs.
+ */
+START_TEST(test_trie_arena)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	static char keys[4096][16];
+	static char *k[4096];
+	int ret, i, num;
+	bool r;
+
+	shl_trie_zero_arena(&t);
+	ck_assert(t.root == NULL);
+	ck_assert(t.arena);
+
+	for (i = 0; i < 4096; ++i) {
+		sprintf(keys[i], "/key/%d", i);
+		k[i] = keys[i];
+		ret = shl_trie_insert_str(&t, &k[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	ck_assert(t.slabs != NULL);
+
+	for (i = 0; i < 4096; ++i) {
+		r = shl_trie_lookup_str(&t, k[i], NULL);
+		ck_assert(r);
+	}
+
+	/* removed nodes are reused */
+	for (i = 0; i < 2048; ++i) {
+		r = shl_trie_remove_str(&t, k[i], NULL);
+		ck_assert(r);
+	}
+
+	for (i = 0; i < 2048; ++i) {
+		ret = shl_trie_insert_str(&t, &k[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	num = 0;
+	shl_trie_visit_str(&t, "/key/1", test_trie_count_cb, &num);
+	ck_assert(num == 1 + 10 + 100 + 1000);
+
+	num = 0;
+	shl_trie_clear_str(&t, test_trie_count_cb, &num);
+	ck_assert(num == 4096);
+	ck_assert(t.root == NULL);
+	ck_assert(t.slabs == NULL);
+	ck_assert(t.arena);
+
+	for (i = 0; i < 4096; ++i) {
+		r = shl_trie_lookup_str(&t, k[i], NULL);
+		ck_assert(!r);
+	}
+
+	/* clear without callback, and drop slabs once empty */
+	for (i = 0; i < 4096; ++i) {
+		ret = shl_trie_insert_str(&t, &k[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	shl_trie_clear(&t, NULL, NULL);
+	ck_assert(t.root == NULL);
+	ck_assert(t.slabs == NULL);
+
+	for (i = 0; i < 4096; ++i) {
+		ret = shl_trie_insert_str(&t, &k[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	for (i = 0; i < 4096; ++i) {
+		r = shl_trie_remove_str(&t, k[i], NULL);
+		ck_assert(r);
+	}
+
+	ck_assert(t.root == NULL);
+	ck_assert(t.slabs == NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(arena)
+	TEST(test_trie_arena)
+TEST_END_CASE
+
+/*
+ * Binary keys may contain zero bytes and may be prefixes of each other. Make
+ * sure "a", "a\0" and "a\0\0" are all different keys.
+ */
+
+static uint8_t bkeys[][4] = {
+	{ 'a' },
+	{ 'a', 0 },
+	{ 'a', 0, 0 },
+	{ 'a', 0, 'b' },
+	{ 0 },
+	{ 0, 0, 0, 0 },
+	{ 0xff, 0, 0xff },
+	{ },
+};
+
+static size_t blens[] = { 1, 2, 3, 3, 1, 4, 3, 0 };
+
+static void test_trie_bcount_cb(uint8_t **key, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+}
+
+START_TEST(test_trie_binary)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	static uint8_t *k[SHL_ARRAY_LENGTH(bkeys)];
+	static const uint8_t n[] = { 'a', 0, 0, 0 };
+	uint8_t **o;
+	int ret, num;
+	size_t i;
+	bool r;
+
+	shl_trie_zero(&t);
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(bkeys); ++i) {
+		k[i] = bkeys[i];
+		ret = shl_trie_insert(&t, &k[i], blens[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(bkeys); ++i) {
+		ret = shl_trie_insert(&t, &k[i], blens[i], &o);
+		ck_assert(ret == -EALREADY);
+		ck_assert(o == &k[i]);
+
+		r = shl_trie_lookup(&t, bkeys[i], blens[i], &o);
+		ck_assert(r);
+		ck_assert(o == &k[i]);
+	}
+
+	/* key-lengths are stored as 32bit values */
+	if (SIZE_MAX > UINT32_MAX) {
+		ret = shl_trie_insert(&t, &k[0], (size_t)UINT32_MAX + 1, NULL);
+		ck_assert(ret == -E2BIG);
+	}
+
+	/* "a\0\0\0" shares all bytes with "a\0\0" but is longer */
+	r = shl_trie_lookup(&t, n, 4, NULL);
+	ck_assert(!r);
+	r = shl_trie_lookup(&t, n, 1, &o);
+	ck_assert(r);
+	ck_assert(o == &k[0]);
+
+	num = 0;
+	shl_trie_visit(&t, n, 2, test_trie_bcount_cb, &num);
+	ck_assert(num == 3);
+
+	num = 0;
+	shl_trie_visit(&t, n, 1, test_trie_bcount_cb, &num);
+	ck_assert(num == 4);
+
+	num = 0;
+	shl_trie_visit(&t, n, 4, test_trie_bcount_cb, &num);
+	ck_assert(num == 0);
+
+	num = 0;
+	shl_trie_visit(&t, NULL, 0, test_trie_bcount_cb, &num);
+	ck_assert(num == SHL_ARRAY_LENGTH(bkeys));
+
+	r = shl_trie_lookup_prefix(&t, n, 4, &o, &i);
+	ck_assert(r);
+	ck_assert(o == &k[2]);
+	ck_assert(i == 3);
+
+	r = shl_trie_lookup_prefix(&t, bkeys[3], 2, &o, &i);
+	ck_assert(r);
+	ck_assert(o == &k[1]);
+	ck_assert(i == 2);
+
+	r = shl_trie_remove(&t, n, 2, &o);
+	ck_assert(r);
+	ck_assert(o == &k[1]);
+	r = shl_trie_lookup(&t, n, 2, NULL);
+	ck_assert(!r);
+	r = shl_trie_lookup(&t, n, 3, NULL);
+	ck_assert(r);
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(bkeys); ++i) {
+		r = shl_trie_remove(&t, bkeys[i], blens[i], NULL);
+		ck_assert(r == (i != 1));
+	}
+
+	ck_assert(t.root == NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(binary)
+	TEST(test_trie_binary)
+TEST_END_CASE
+
+/*
+ * Walk the trie with cursors in both directions, seek into it and visit
+ * ranges.
+ */
+
+static void test_trie_range_cb(char **key, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+	ck_assert_msg(strncmp(*key, "/some/", 6) == 0, "invalid range %s", *key);
+}
+
+START_TEST(test_trie_cursor)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	struct shl_trie_cursor c;
+	const char *last;
+	int ret, i, num;
+	bool r;
+
+	shl_trie_zero(&t);
+
+	r = shl_trie_cursor_first(&c, &t);
+	ck_assert(!r);
+	ck_assert(c.entry == NULL);
+	r = shl_trie_cursor_seek_str(&c, &t, "/some");
+	ck_assert(!r);
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	last = NULL;
+	num = 0;
+	for (r = shl_trie_cursor_first(&c, &t); r;
+	     r = shl_trie_cursor_next(&c)) {
+		ck_assert(!last || strcmp(last, (char*)*c.entry) < 0);
+		ck_assert(c.len == strlen((char*)*c.entry));
+		last = (char*)*c.entry;
+		++num;
+	}
+	ck_assert(num == SHL_ARRAY_LENGTH(s) - 1);
+	ck_assert(c.entry == NULL);
+	ck_assert(!shl_trie_cursor_next(&c));
+
+	last = NULL;
+	num = 0;
+	for (r = shl_trie_cursor_last(&c, &t); r;
+	     r = shl_trie_cursor_prev(&c)) {
+		ck_assert(!last || strcmp(last, (char*)*c.entry) > 0);
+		last = (char*)*c.entry;
+		++num;
+	}
+	ck_assert(num == SHL_ARRAY_LENGTH(s) - 1);
+
+	r = shl_trie_cursor_seek_str(&c, &t, "/some");
+	ck_assert(r);
+	ck_assert(!strcmp((char*)*c.entry, "/some"));
+
+	r = shl_trie_cursor_seek_str(&c, &t, "/some/");
+	ck_assert(r);
+	ck_assert(!strcmp((char*)*c.entry, "/some/more"));
+
+	r = shl_trie_cursor_prev(&c);
+	ck_assert(r);
+	ck_assert(!strcmp((char*)*c.entry, "/some"));
+
+	r = shl_trie_cursor_seek_str(&c, &t, "relative/pathz");
+	ck_assert(r);
+	ck_assert(!strncmp((char*)*c.entry, "this/is/a/bit/", 14));
+
+	r = shl_trie_cursor_seek_str(&c, &t, "~");
+	ck_assert(!r);
+
+	r = shl_trie_cursor_seek_str(&c, &t, "");
+	ck_assert(r);
+	ck_assert(!strcmp((char*)*c.entry, ""));
+
+	num = 0;
+	shl_trie_visit_range_str(&t, "/some/", "/some0", test_trie_range_cb,
+				 &num);
+	ck_assert(num == 6);
+
+	num = 0;
+	shl_trie_visit_range_str(&t, "/some/path", "/some/path/again",
+				 test_trie_range_cb, &num);
+	ck_assert(num == 1);
+
+	num = 0;
+	shl_trie_visit_range_str(&t, NULL, NULL, test_trie_count_cb, &num);
+	ck_assert(num == SHL_ARRAY_LENGTH(s) - 1);
+
+	num = 0;
+	shl_trie_visit_range_str(&t, "/some/", "/some/", test_trie_count_cb,
+				 &num);
+	ck_assert(num == 0);
+
+	shl_trie_clear(&t, NULL, NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(cursor)
+	TEST(test_trie_cursor)
+TEST_END_CASE
+
+START_TEST(test_trie_prefix)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	int ret, i;
+	char **o;
+	bool r;
+
+	shl_trie_zero(&t);
+
+	r = shl_trie_lookup_prefix_str(&t, "/some/path", NULL);
+	ck_assert(!r);
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_trie_lookup_prefix_str(&t, s[i], &o);
+		ck_assert(r);
+		ck_assert(o == &s[i]);
+	}
+
+	r = shl_trie_lookup_prefix_str(&t, "/some/path/x", &o);
+	ck_assert(r);
+	ck_assert(!strcmp(*o, "/some/path"));
+
+	r = shl_trie_lookup_prefix_str(&t, "/some/pat", &o);
+	ck_assert(r);
+	ck_assert(!strcmp(*o, "/some"));
+
+	r = shl_trie_lookup_prefix_str(&t, "/some/path/extended/more", &o);
+	ck_assert(r);
+	ck_assert(!strcmp(*o, "/some/path/extended"));
+
+	r = shl_trie_lookup_prefix_str(&t, "relative/pa", &o);
+	ck_assert(r);
+	ck_assert(!strcmp(*o, "relative"));
+
+	r = shl_trie_lookup_prefix_str(&t, "/xyz", &o);
+	ck_assert(r);
+	ck_assert(!strcmp(*o, "/"));
+
+	r = shl_trie_lookup_prefix_str(&t, "xyz", &o);
+	ck_assert(r);
+	ck_assert(!strcmp(*o, ""));
+
+	r = shl_trie_remove_str(&t, "", NULL);
+	ck_assert(r);
+
+	r = shl_trie_lookup_prefix_str(&t, "xyz", NULL);
+	ck_assert(!r);
+
+	r = shl_trie_lookup_prefix_str(&t, "", NULL);
+	ck_assert(!r);
+
+	shl_trie_clear(&t, NULL, NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(prefix)
+	TEST(test_trie_prefix)
+TEST_END_CASE
+
+/*
+ * Concurrent tries are never modified by readers, so we can perform lookups
+ * during visits. Removed nodes are retired until reclaimed.
+ */
+
+static void test_trie_lookup_cb(char **key, void *ctx)
+{
+	struct shl_trie *t = ctx;
+	char **o;
+	bool r;
+
+	r = shl_trie_lookup_str(t, *key, &o);
+	ck_assert(r);
+	ck_assert(o == key);
+}
+
+START_TEST(test_trie_concurrent)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	int ret, i, num;
+	bool r;
+
+	shl_trie_zero_concurrent(&t);
+	ck_assert(t.concurrent);
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	ck_assert(t.max_retired >= t.n_nodes);
+	ck_assert(t.n_retired == 0);
+
+	shl_trie_visit_str(&t, NULL, test_trie_lookup_cb, &t);
+	shl_trie_visit_str(&t, "/some/", test_trie_lookup_cb, &t);
+
+	num = 0;
+	shl_trie_visit_str(&t, "/some/", test_trie_count_cb, &num);
+	ck_assert(num == 6);
+
+	num = 0;
+	shl_trie_visit_str(&t, "/some", test_trie_count_cb, &num);
+	ck_assert(num == 7);
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(s) - 1; i += 2) {
+		r = shl_trie_remove_str(&t, s[i], NULL);
+		ck_assert(r);
+	}
+
+	ck_assert(t.n_retired > 0);
+	shl_trie_reclaim(&t);
+	ck_assert(t.n_retired == 0);
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_trie_lookup_str(&t, s[i], NULL);
+		ck_assert(r == !!(i % 2));
+	}
+
+	for (i = 1; i < SHL_ARRAY_LENGTH(s) - 1; i += 2) {
+		r = shl_trie_remove_str(&t, s[i], NULL);
+		ck_assert(r);
+	}
+
+	ck_assert(t.root == NULL);
+	ck_assert(t.n_nodes == 0);
+	shl_trie_reclaim(&t);
+	ck_assert(t.n_retired == 0);
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	shl_trie_clear(&t, NULL, NULL);
+	ck_assert(t.root == NULL);
+	ck_assert(t.retired == NULL);
+	ck_assert(t.concurrent);
+}
+END_TEST
+
+TEST_DEFINE_CASE(concurrent)
+	TEST(test_trie_concurrent)
+TEST_END_CASE
+
+/*
+ * Bulk-load sorted keys and compare the result with a trie built via inserts.
+ */
+
+static int test_trie_cmp(const void *a, const void *b)
+{
+	return strcmp(**(char***)a, **(char***)b);
+}
+
+START_TEST(test_trie_load)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	struct shl_trie_cursor c;
+	static char **o[SHL_ARRAY_LENGTH(s) - 1];
+	char **d[2], **p;
+	int ret, i, n = SHL_ARRAY_LENGTH(s) - 1;
+	bool r;
+
+	for (i = 0; i < n; ++i)
+		o[i] = &s[i];
+
+	/* unsorted keys are rejected */
+	shl_trie_zero(&t);
+	ret = shl_trie_load_str(&t, o, n);
+	ck_assert(ret == -EINVAL);
+	ck_assert(t.root == NULL);
+
+	qsort(o, n, sizeof(*o), test_trie_cmp);
+
+	/* duplicates are rejected */
+	d[0] = o[0];
+	d[1] = o[0];
+	ret = shl_trie_load_str(&t, d, 2);
+	ck_assert(ret == -EINVAL);
+	ck_assert(t.root == NULL);
+
+	/* non-empty tries are rejected */
+	ret = shl_trie_load_str(&t, o, 2);
+	ck_assert(ret == 0);
+	ret = shl_trie_load_str(&t, o, 2);
+	ck_assert(ret == -EINVAL);
+	shl_trie_clear(&t, NULL, NULL);
+
+	ret = shl_trie_load_str(&t, o, n);
+	ck_assert(ret == 0);
+
+	for (i = 0; i < n; ++i) {
+		r = shl_trie_lookup_str(&t, s[i], &p);
+		ck_assert(r);
+		ck_assert(p == &s[i]);
+	}
+
+	for (r = shl_trie_cursor_first(&c, &t), i = 0; r;
+	     r = shl_trie_cursor_next(&c), ++i)
+		ck_assert((char**)c.entry == o[i]);
+	ck_assert(i == n);
+
+	for (i = 0; u[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &u[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	for (i = 0; i < n; ++i) {
+		r = shl_trie_remove_str(&t, *o[i], &p);
+		ck_assert(r);
+		ck_assert(p == o[i]);
+	}
+
+	for (i = 0; u[i]; ++i) {
+		r = shl_trie_remove_str(&t, u[i], NULL);
+		ck_assert(r);
+	}
+
+	ck_assert(t.root == NULL);
+
+	/* arena-tries get a single slab */
+	shl_trie_zero_arena(&t);
+	ret = shl_trie_load_str(&t, o, n);
+	ck_assert(ret == 0);
+	ck_assert(t.slabs != NULL);
+
+	for (i = 0; i < n; ++i) {
+		r = shl_trie_lookup_str(&t, *o[i], &p);
+		ck_assert(r);
+		ck_assert(p == o[i]);
+	}
+
+	for (i = 0; u[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &u[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	shl_trie_clear(&t, NULL, NULL);
+	ck_assert(t.slabs == NULL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(load)
+	TEST(test_trie_load)
+TEST_END_CASE
+
+/*
+ * Freeze a trie and test the image.
+ */
+
+static void test_trie_frozen_cb(size_t index, const uint8_t *key,
+				size_t keylen, void *ctx)
+{
+	int *num = ctx;
+
+	++*num;
+	ck_assert(keylen >= 6);
+	ck_assert(!memcmp(key, "/some/", 6));
+}
+
+START_TEST(test_trie_frozen)
+{
+	struct shl_trie t = { .root = TEST_INVALID_PTR, };
+	struct shl_trie_frozen f;
+	struct shl_trie_cursor c;
+	const uint8_t *k;
+	size_t size, idx, len;
+	void *data;
+	int ret, i, num;
+	bool r;
+
+	/* empty tries result in empty images */
+	shl_trie_zero(&t);
+	ret = shl_trie_freeze(&t, &data, &size);
+	ck_assert(ret == 0);
+	ret = shl_trie_frozen_open(&f, data, size);
+	ck_assert(ret == 0);
+	ck_assert(f.n_entries == 0);
+	r = shl_trie_frozen_lookup(&f, (const uint8_t*)"", 0, NULL);
+	ck_assert(!r);
+	ret = shl_trie_frozen_open(&f, data, size - 1);
+	ck_assert(ret == -EINVAL);
+	free(data);
+
+	for (i = 0; s[i]; ++i) {
+		ret = shl_trie_insert_str(&t, &s[i], NULL);
+		ck_assert(ret == 0);
+	}
+
+	ret = shl_trie_freeze(&t, &data, &size);
+	ck_assert(ret == 0);
+	ret = shl_trie_frozen_open(&f, data, size);
+	ck_assert(ret == 0);
+	ck_assert(f.n_entries == SHL_ARRAY_LENGTH(s) - 1);
+
+	/* indices follow the lexicographic order */
+	for (r = shl_trie_cursor_first(&c, &t), idx = 0; r;
+	     r = shl_trie_cursor_next(&c), ++idx) {
+		k = shl_trie_frozen_key(&f, idx, &len);
+		ck_assert(len == c.len);
+		ck_assert(!memcmp(k, *c.entry, len));
+	}
+
+	for (i = 0; s[i]; ++i) {
+		r = shl_trie_frozen_lookup(&f, (const uint8_t*)s[i],
+					   strlen(s[i]), &idx);
+		ck_assert(r);
+		k = shl_trie_frozen_key(&f, idx, &len);
+		ck_assert(len == strlen(s[i]));
+		ck_assert(!memcmp(k, s[i], len));
+	}
+
+	for (i = 0; u[i]; ++i) {
+		r = shl_trie_frozen_lookup(&f, (const uint8_t*)u[i],
+					   strlen(u[i]), NULL);
+		ck_assert(!r);
+	}
+
+	r = shl_trie_frozen_lookup_prefix(&f, (const uint8_t*)"/some/path/x",
+					  12, &idx);
+	ck_assert(r);
+	k = shl_trie_frozen_key(&f, idx, &len);
+	ck_assert(len == 10 && !memcmp(k, "/some/path", 10));
+
+	r = shl_trie_frozen_lookup_prefix(&f, (const uint8_t*)"xyz", 3, &idx);
+	ck_assert(r);
+	shl_trie_frozen_key(&f, idx, &len);
+	ck_assert(len == 0);
+
+	num = 0;
+	shl_trie_frozen_visit(&f, (const uint8_t*)"/some/", 6,
+			      test_trie_frozen_cb, &num);
+	ck_assert(num == 6);
+
+	num = 0;
+	shl_trie_frozen_visit(&f, (const uint8_t*)"/x", 2,
+			      test_trie_frozen_cb, &num);
+	ck_assert(num == 0);
+
+	/* the image doesn't depend on the trie */
+	shl_trie_clear(&t, NULL, NULL);
+	r = shl_trie_frozen_lookup(&f, (const uint8_t*)"/some", 5, NULL);
+	ck_assert(r);
+
+	((char*)data)[0] = 0;
+	ret = shl_trie_frozen_open(&f, data, size);
+	ck_assert(ret == -EINVAL);
+
+	free(data);
+}
+END_TEST
+
+TEST_DEFINE_CASE(frozen)
+	TEST(test_trie_frozen)
+TEST_END_CASE
+
 TEST_DEFINE(
 	TEST_SUITE(trie,
 		TEST_CASE(setup),
 		TEST_CASE(add),
 		TEST_CASE(remove),
 		TEST_CASE(visit),
+		TEST_CASE(arena),
+		TEST_CASE(binary),
+		TEST_CASE(cursor),
+		TEST_CASE(prefix),
+		TEST_CASE(concurrent),
+		TEST_CASE(load),
+		TEST_CASE(frozen),
 		TEST_END
 	)
 )
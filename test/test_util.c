@@ -5,6 +5,8 @@
  * Dedicated to the Public Domain.
  */
 
+#include <pthread.h>
+#include <time.h>
 #include "test_common.h"
 
 START_TEST(test_util_atoi_ctoi)
@@ -130,10 +132,126 @@ START_TEST(test_util_atoi_types)
 }
 END_TEST
 
+START_TEST(test_util_atoi_swar)
+{
+	static const char garbage[] = ":/@G`g\x80\xb0\xe6";
+	unsigned long long v, ref;
+	const char *next;
+	char *end, buf[64];
+	unsigned int i, j, k, base;
+	size_t len;
+	int r;
+
+	/* digit blocks must match the per-character parser */
+	TEST_ATOI("12345678", 12345678ULL, 10, 0, 8);
+	TEST_ATOI("1234567890123456", 1234567890123456ULL, 10, 0, 16);
+	TEST_ATOI("00000000000000000042", 42ULL, 10, 0, 20);
+	TEST_ATOI("1234567:", 1234567ULL, 10, 0, 7);
+	TEST_ATOI("12345678:", 12345678ULL, 10, 0, 8);
+	TEST_ATOI("18446744073709551616", 0, 10, -ERANGE, 20);
+	TEST_ATOI("99999999999999999999999999", 0, 10, -ERANGE, 26);
+	TEST_ATOI("deadBEEFcafe0123", 0xdeadbeefcafe0123ULL, 16, 0, 16);
+	TEST_ATOI("ffffffffffffffff", 0xffffffffffffffffULL, 16, 0, 16);
+	TEST_ATOI("1ffffffffffffffff", 0, 16, -ERANGE, 17);
+	TEST_ATOI("0x0123456789abcdef", 0x0123456789abcdefULL, 0, 0, 18);
+	TEST_ATOI("abcdefgh", 0xabcdefULL, 16, 0, 6);
+	TEST_ATOI("ABCDEFGH", 0xabcdefULL, 16, 0, 6);
+
+	srand(0x5eed);
+
+	for (i = 0; i < 4096; ++i) {
+		base = (i & 1) ? 16 : 10;
+		len = 1 + rand() % 24;
+		for (j = 0; j < len; ++j) {
+			k = rand() % base;
+			if (k < 10)
+				buf[j] = '0' + k;
+			else
+				buf[j] = ((rand() & 1) ? 'a' : 'A') + k - 10;
+		}
+		buf[len] = 0;
+
+		/* sometimes cut the number short with an invalid character */
+		if (rand() & 1)
+			buf[rand() % len] = garbage[rand() % (sizeof(garbage) - 1)];
+
+		errno = 0;
+		ref = strtoull(buf, &end, base);
+		if (end == buf)
+			errno = 0;
+
+		r = shl_atoi_ull(buf, base, &next, &v);
+		ck_assert(next == end);
+		if (errno == ERANGE) {
+			ck_assert(r == -ERANGE);
+			ck_assert(v == ULLONG_MAX);
+		} else {
+			ck_assert(r == 0);
+			ck_assert(v == ref);
+		}
+	}
+}
+END_TEST
+
+START_TEST(test_util_atoi_vector)
+{
+	static const char str[] = "1,22,0x10,4294967296";
+	unsigned long long ull[8];
+	size_t z[8], num;
+	const char *next;
+	int r, errs[8];
+
+	r = shl_atoi_ullvn(str, strlen(str), 0, ',', &next, ull, 8, &num,
+			   NULL);
+	ck_assert(r == 0);
+	ck_assert(num == 4);
+	ck_assert(next == str + strlen(str));
+	ck_assert(ull[0] == 1 && ull[1] == 22 && ull[2] == 16);
+	ck_assert(ull[3] == 4294967296ULL);
+
+	/* stop at @max and allow resuming at the separator */
+	r = shl_atoi_zv(str, 10, ',', &next, z, 2, &num, NULL);
+	ck_assert(r == 0);
+	ck_assert(num == 2);
+	ck_assert(next == str + 4 && *next == ',');
+	ck_assert(z[0] == 1 && z[1] == 22);
+
+	r = shl_atoi_zv("", 10, ',', &next, z, 8, &num, NULL);
+	ck_assert(r == 0);
+	ck_assert(num == 0);
+
+	/* stop at the first invalid field */
+	r = shl_atoi_zv("5 6 7x 8", 10, ' ', &next, z, 8, &num, NULL);
+	ck_assert(r == -EINVAL);
+	ck_assert(num == 2);
+	ck_assert(!strcmp(next, "7x 8"));
+
+	r = shl_atoi_zv("5,,8", 10, ',', &next, z, 8, &num, NULL);
+	ck_assert(r == -EINVAL);
+	ck_assert(num == 1);
+	ck_assert(!strcmp(next, ",8"));
+
+	/* collect per-field errors */
+	r = shl_atoi_ullv("5,x9,99999999999999999999,,7,", 10, ',', &next,
+			  ull, 8, &num, errs);
+	ck_assert(r == -EINVAL);
+	ck_assert(num == 6);
+	ck_assert(!*next);
+	ck_assert(errs[0] == 0 && ull[0] == 5);
+	ck_assert(errs[1] == -EINVAL && ull[1] == 0);
+	ck_assert(errs[2] == -ERANGE && ull[2] == ULLONG_MAX);
+	ck_assert(errs[3] == -EINVAL && ull[3] == 0);
+	ck_assert(errs[4] == 0 && ull[4] == 7);
+	ck_assert(errs[5] == -EINVAL);
+}
+END_TEST
+
 TEST_DEFINE_CASE(atoi)
 	TEST(test_util_atoi_ctoi)
 	TEST(test_util_atoi_base)
 	TEST(test_util_atoi_types)
+	TEST(test_util_atoi_swar)
+	TEST(test_util_atoi_vector)
 TEST_END_CASE
 
 static void test_cat(const char *a, const char *b, const char *ab)
@@ -253,6 +371,62 @@ START_TEST(test_util_str_split)
 }
 END_TEST
 
+START_TEST(test_util_str_split_span)
+{
+	static const char str[] = "\r\r\rmore     foo\n\r\nbar \n\rentries\n\n";
+	struct shl_strsplit_iter iter;
+	struct shl_span spans[4], span;
+	char **strv;
+	size_t num;
+	int r;
+
+	num = shl_strsplit_span_n(str, strlen(str), "\r\n ", spans, 4);
+	ck_assert(num == 4);
+	ck_assert(spans[0].str == str + 3 && spans[0].len == 4);
+	ck_assert(!strncmp(spans[1].str, "foo", spans[1].len));
+	ck_assert(!strncmp(spans[2].str, "bar", spans[2].len));
+	ck_assert(!strncmp(spans[3].str, "entries", spans[3].len));
+
+	/* report the full count even if @spans is too small */
+	num = shl_strsplit_span_n("a,b,,c,", 7, ",", spans, 2);
+	ck_assert(num == 3);
+	ck_assert(spans[0].len == 1 && *spans[0].str == 'a');
+	ck_assert(spans[1].len == 1 && *spans[1].str == 'b');
+
+	ck_assert(shl_strsplit_span_n(NULL, 0, ",", NULL, 0) == 0);
+	ck_assert(shl_strsplit_span_n(",,,", 3, ",", NULL, 0) == 0);
+
+	/* bounded by @len, not by a terminating zero */
+	shl_strsplit_iter_init(&iter, "one two three", 7, " ");
+	ck_assert(shl_strsplit_iter_next(&iter, &span));
+	ck_assert(span.len == 3 && !strncmp(span.str, "one", 3));
+	ck_assert(shl_strsplit_iter_next(&iter, &span));
+	ck_assert(span.len == 3 && !strncmp(span.str, "two", 3));
+	ck_assert(!shl_strsplit_iter_next(&iter, &span));
+	ck_assert(!shl_strsplit_iter_next(&iter, &span));
+
+	r = shl_strsplit_packed(str, "\r\n ", &strv);
+	ck_assert(r == 4);
+	ck_assert(strv &&
+		  !strcmp(strv[0], "more") &&
+		  !strcmp(strv[1], "foo") &&
+		  !strcmp(strv[2], "bar") &&
+		  !strcmp(strv[3], "entries") &&
+		  !strv[4]);
+	free(strv);
+
+	r = shl_strsplit_packed("", " ", &strv);
+	ck_assert(r == 0);
+	ck_assert(strv && !*strv);
+	free(strv);
+
+	r = shl_strsplit_packed("foo", "", &strv);
+	ck_assert(r == 1);
+	ck_assert(strv && !strcmp(*strv, "foo") && !strv[1]);
+	free(strv);
+}
+END_TEST
+
 START_TEST(test_util_str_qstr)
 {
 	int r;
@@ -338,12 +512,105 @@ START_TEST(test_util_str_qstr)
 }
 END_TEST
 
+/* tokenize @str fed in chunks of @step bytes into a single string */
+static void test_util_qstr_stream(const char *str,
+				  size_t step,
+				  unsigned int flags,
+				  char *out)
+{
+	struct shl_qstr_tok tok;
+	struct shl_qstr_span span;
+	const char *chunk;
+	size_t len, l, rem;
+
+	shl_qstr_tok_init(&tok, flags);
+	rem = strlen(str);
+
+	do {
+		chunk = str;
+		len = shl_min(step, rem);
+		str += len;
+		rem -= len;
+
+		while (shl_qstr_tok_next(&tok, &chunk, &len, &span)) {
+			l = shl_qstr_span_decode(&span, out);
+			out += l;
+			if (span.flags & SHL_QSTR_END)
+				*out++ = '|';
+			if (span.flags & SHL_QSTR_EOL)
+				*out++ = '$';
+		}
+		ck_assert(!len);
+	} while (rem);
+
+	if (shl_qstr_tok_finish(&tok, &span)) {
+		out += shl_qstr_span_decode(&span, out);
+		*out++ = '|';
+	}
+
+	*out = 0;
+}
+
+START_TEST(test_util_str_qstr_stream)
+{
+	static const char str[] = "\"\\\"'mo\"re  f'\"'oo bar'' 'en\\ntries'\\";
+	struct shl_qstr_tok tok;
+	struct shl_qstr_span span;
+	const char *pos;
+	char buf[128], **strv, *t;
+	size_t len, step;
+	int r;
+
+	/* the result must not depend on how the input is chunked */
+	for (step = 1; step <= sizeof(str); ++step) {
+		test_util_qstr_stream(str, step, 0, buf);
+		ck_assert_str_eq(buf, "\"'more|f\"oo|bar|en\ntries\\|");
+	}
+
+	for (step = 1; step <= 8; ++step) {
+		test_util_qstr_stream("a 'b\nc' d\n\ne \n", step,
+				      SHL_QSTR_TOK_LINES, buf);
+		ck_assert_str_eq(buf, "a|b\nc|d|$$e|$");
+	}
+
+	/* plain tokens are returned verbatim, pointing into the input */
+	pos = "foo  'b r'";
+	len = strlen(pos);
+	shl_qstr_tok_init(&tok, 0);
+	ck_assert(shl_qstr_tok_next(&tok, &pos, &len, &span));
+	ck_assert(span.len == 3 && !strncmp(span.str, "foo", 3));
+	ck_assert(span.flags == SHL_QSTR_END);
+	ck_assert(shl_qstr_tok_next(&tok, &pos, &len, &span));
+	ck_assert(span.len == 5 && span.flags == SHL_QSTR_RAW);
+	ck_assert(!shl_qstr_tok_next(&tok, &pos, &len, &span));
+	ck_assert(shl_qstr_tok_finish(&tok, &span));
+	ck_assert(!span.len && (span.flags & SHL_QSTR_END));
+	ck_assert(!shl_qstr_tok_finish(&tok, &span));
+
+	/* quoted separators stay within the token, so join round-trips */
+	r = shl_qstr_join((char*[]){ "as df", "buhu", "  ", "yeha\\", NULL },
+			  &t);
+	ck_assert(r == 24);
+	r = shl_qstr_tokenize(t, &strv);
+	ck_assert(r == 4);
+	ck_assert(!strcmp(strv[0], "as df") &&
+		  !strcmp(strv[1], "buhu") &&
+		  !strcmp(strv[2], "  ") &&
+		  !strcmp(strv[3], "yeha\\") &&
+		  !strv[4]);
+	shl_strv_free(strv);
+	free(t);
+}
+END_TEST
+
 TEST_DEFINE_CASE(str)
 	TEST(test_util_str_cat)
 	TEST(test_util_str_join)
 	TEST(test_util_str_startswith)
 	TEST(test_util_str_split)
+	TEST(test_util_str_split_span)
 	TEST(test_util_str_qstr)
+	TEST(test_util_str_qstr_stream)
 TEST_END_CASE
 
 START_TEST(test_misc_greedy_alloc)
@@ -375,8 +642,179 @@ START_TEST(test_misc_greedy_alloc)
 }
 END_TEST
 
+START_TEST(test_misc_clock)
+{
+	static const unsigned int sources[] = {
+		SHL_CLOCK_PRECISE,
+		SHL_CLOCK_COARSE,
+		SHL_CLOCK_TSC,
+		SHL_CLOCK_CACHED,
+	};
+	struct timespec ts = { .tv_nsec = 5 * 1000 * 1000 };
+	uint64_t t, t1, t2, ref;
+	unsigned int i;
+	int r;
+
+	ck_assert(shl_clock_select(100) == -EINVAL);
+
+	/* the TSC re-anchors after a second and must stay close and monotonic */
+	if (shl_clock_select(SHL_CLOCK_TSC) == 0) {
+		t1 = shl_clock_now();
+		for (i = 0; i < 220; ++i) {
+			nanosleep(&ts, NULL);
+			t2 = shl_clock_now();
+			ck_assert(t2 >= t1);
+			t1 = t2;
+		}
+		ref = shl_now(CLOCK_MONOTONIC);
+		ck_assert(t2 <= ref + 1000);
+		ck_assert(t2 + 1000 >= ref);
+	}
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(sources); ++i) {
+		r = shl_clock_select(sources[i]);
+		if (r == -EOPNOTSUPP && sources[i] == SHL_CLOCK_TSC)
+			continue;
+		ck_assert(r == 0);
+
+		/* all sources follow CLOCK_MONOTONIC; allow for coarse ticks
+		 * and calibration errors */
+		t1 = shl_clock_now();
+		nanosleep(&ts, NULL);
+		t2 = shl_clock_now();
+		ref = shl_now(CLOCK_MONOTONIC);
+		ck_assert(t2 >= t1);
+		ck_assert(t2 <= ref + 1000);
+		ck_assert(t2 + 20000 >= ref);
+	}
+
+	/* the cached clock only moves on updates */
+	t = shl_clock_update();
+	ck_assert(shl_clock_now() == t);
+	nanosleep(&ts, NULL);
+	ck_assert(shl_clock_now() == t);
+	ck_assert(shl_clock_update() > t);
+
+	shl_clock_select(SHL_CLOCK_PRECISE);
+}
+END_TEST
+
+START_TEST(test_misc_ratelimit)
+{
+	SHL_RATELIMIT_DEFINE(rl, 1000, 5);
+	SHL_TOKENBUCKET_DEFINE(tb, 1000, 10);
+	int i;
+
+	ck_assert(rl.interval == 1000);
+	ck_assert(rl.burst == 5);
+
+	/* drive the clock manually so refill is deterministic */
+	ck_assert(shl_clock_select(SHL_CLOCK_CACHED) == 0);
+	shl__clock_cached = 1000000;
+
+	for (i = 0; i < 5; ++i)
+		ck_assert(shl_ratelimit_test(&rl));
+	ck_assert(!shl_ratelimit_test(&rl));
+	shl__clock_cached += 1001;
+	ck_assert(shl_ratelimit_test(&rl));
+
+	for (i = 0; i < 10; ++i)
+		ck_assert(shl_tokenbucket_test(&tb));
+	ck_assert(!shl_tokenbucket_test(&tb));
+
+	/* refill is continuous, one token every 100us */
+	shl__clock_cached += 150;
+	ck_assert(shl_tokenbucket_test(&tb));
+	ck_assert(!shl_tokenbucket_test(&tb));
+	shl__clock_cached += 50;
+	ck_assert(shl_tokenbucket_test(&tb));
+	ck_assert(!shl_tokenbucket_test(&tb));
+
+	/* never refills beyond the burst */
+	shl__clock_cached += 100000;
+	ck_assert(!shl_tokenbucket_take(&tb, 11));
+	ck_assert(shl_tokenbucket_take(&tb, 7));
+	ck_assert(shl_tokenbucket_take(&tb, 3));
+	ck_assert(!shl_tokenbucket_take(&tb, 1));
+
+	shl_clock_select(SHL_CLOCK_PRECISE);
+}
+END_TEST
+
+#define TEST_THREADS 4
+
+static SHL_RATELIMIT_DEFINE(test_rl, 3600ULL * 1000000ULL, 100);
+static SHL_TOKENBUCKET_DEFINE(test_tb, 3600ULL * 1000000ULL, 100);
+static struct shl_tokenbucket_sharded test_sharded;
+
+static void *test_misc_ratelimit_fn(void *data)
+{
+	unsigned long *num = data;
+	int i;
+
+	for (i = 0; i < 10000; ++i) {
+		num[0] += shl_ratelimit_test(&test_rl);
+		num[1] += shl_tokenbucket_test(&test_tb);
+		num[2] += shl_tokenbucket_sharded_take(&test_sharded, 1);
+	}
+
+	return NULL;
+}
+
+START_TEST(test_misc_ratelimit_threads)
+{
+	pthread_t threads[TEST_THREADS];
+	unsigned long num[TEST_THREADS][3] = { };
+	unsigned long sum[3] = { };
+	struct shl_tokenbucket *tb;
+	int r, i;
+
+	r = shl_tokenbucket_sharded_init(&test_sharded, 3600ULL * 1000000ULL,
+					 100, 0);
+	ck_assert(r == 0);
+	ck_assert(test_sharded.num >= 1);
+
+	for (i = 0; i < TEST_THREADS; ++i) {
+		r = pthread_create(&threads[i], NULL, test_misc_ratelimit_fn,
+				   num[i]);
+		ck_assert(r == 0);
+	}
+
+	for (i = 0; i < TEST_THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+		sum[0] += num[i][0];
+		sum[1] += num[i][1];
+		sum[2] += num[i][2];
+	}
+
+	/* opening the window might race with increments */
+	ck_assert(sum[0] >= 100 && sum[0] <= 100 + TEST_THREADS);
+	ck_assert(sum[1] == 100);
+	ck_assert(sum[2] > 0 && sum[2] <= 100);
+
+	shl_tokenbucket_sharded_deinit(&test_sharded);
+
+	/* shards add up to the burst even if it does not divide evenly */
+	r = shl_tokenbucket_sharded_init(&test_sharded, 1000, 10, 4);
+	ck_assert(r == 0);
+	ck_assert(test_sharded.num == 4);
+	for (i = 0, r = 0; i < 4; ++i) {
+		tb = &test_sharded.shards[i].tb;
+		r += tb->depth / tb->step;
+	}
+	ck_assert(r == 10);
+	shl_tokenbucket_sharded_deinit(&test_sharded);
+
+	r = shl_tokenbucket_sharded_init(&test_sharded, 1000, 0, 4);
+	ck_assert(r == -EINVAL);
+}
+END_TEST
+
 TEST_DEFINE_CASE(misc)
 	TEST(test_misc_greedy_alloc)
+	TEST(test_misc_clock)
+	TEST(test_misc_ratelimit)
+	TEST(test_misc_ratelimit_threads)
 TEST_END_CASE
 
 TEST_DEFINE(